@@ -8,8 +8,12 @@
 #include <memory>
 
 #include "extern/optionparser.h"
+#include "torch_serving/cpu_budget.h"
 #include "torch_serving/model_server.h"
+#include "torch_serving/pooled_allocator.h"
+#include "torch_serving/quantization.h"
 #include "torch_serving/torch_jit_servable.h"
+#include "torch_serving/torch_lite_servable.h"
 
 optionparser::OptionParser GetConfiguration(int argc, const char *argv[]) {
   optionparser::OptionParser parser(
@@ -39,8 +43,203 @@ optionparser::OptionParser GetConfiguration(int argc, const char *argv[]) {
       .mode(optionparser::STORE_VALUE);
 
   parser.add_option("--threads", "-t")
-      .help("Number of concurrent threads to use in the serving layer.")
-      .default_value(8)
+      .help(
+          "Number of concurrent threads to use in the serving layer (0 to "
+          "size from the CPU budget).")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--cores")
+      .help(
+          "Number of CPUs to budget threads for (0 to detect from the "
+          "affinity mask and cgroup CPU quota).")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--intra-op-threads")
+      .help(
+          "Number of threads each forward pass may use (0 to size from the "
+          "CPU budget).")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--inter-op-threads")
+      .help(
+          "Size of libtorch's inter-op thread pool (0 to size from the CPU "
+          "budget).")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--max-in-flight")
+      .help(
+          "Maximum number of requests running inference at once (0 for "
+          "unlimited).")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--max-queued")
+      .help(
+          "Maximum number of requests waiting for an in-flight slot before "
+          "requests are shed with a 503 (0 for unlimited). Keep this below "
+          "--threads so HTTP workers remain free to shed load.")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--max-in-flight-per-servable")
+      .help(
+          "Maximum number of requests running inference at once for a single "
+          "servable (0 for unlimited).")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--max-queued-per-servable")
+      .help(
+          "Maximum number of requests waiting for an in-flight slot for a "
+          "single servable (0 for unlimited).")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--retry-after")
+      .help("Seconds clients are told to wait after a request is shed.")
+      .default_value(1)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--inference-threads")
+      .help(
+          "Number of threads running model inference (0 to size from the CPU "
+          "budget).")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--decode-threads")
+      .help(
+          "Number of threads parsing requests and converting them to model "
+          "inputs (0 to size from the CPU budget).")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--encode-threads")
+      .help(
+          "Number of threads converting model outputs and serializing "
+          "responses (0 to size from the CPU budget).")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--max-decode-queued")
+      .help(
+          "Maximum number of requests waiting to be decoded before requests "
+          "are shed with a 503 (0 for unlimited).")
+      .default_value(1024)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--max-encode-queued")
+      .help(
+          "Maximum number of responses waiting to be encoded before requests "
+          "fail with a 503 (0 for unlimited).")
+      .default_value(1024)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--weighted-priority")
+      .help(
+          "Share inference threads between interactive and bulk requests by "
+          "weight, rather than always running interactive requests first.")
+      .mode(optionparser::STORE_TRUE);
+
+  parser.add_option("--interactive-weight")
+      .help("Scheduling weight of interactive requests (--weighted-priority).")
+      .default_value(4)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--bulk-weight")
+      .help("Scheduling weight of bulk requests (--weighted-priority).")
+      .default_value(1)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--adaptive-concurrency")
+      .help(
+          "Tune each servable's number of concurrent forward passes from its "
+          "observed latency.")
+      .mode(optionparser::STORE_TRUE);
+
+  parser.add_option("--numa")
+      .help(
+          "Pin inference workers to NUMA nodes, place each servable's weights "
+          "on one node, and route its requests to that node's workers.")
+      .mode(optionparser::STORE_TRUE);
+
+  parser.add_option("--pooled-allocator")
+      .help(
+          "Allocate CPU tensors from size-class pools of pre-faulted blocks, "
+          "reused across requests, rather than from the system allocator.")
+      .mode(optionparser::STORE_TRUE);
+
+  parser.add_option("--allocator-cache-mb")
+      .help(
+          "Memory budget, in MiB, for free blocks kept by the pooled "
+          "allocator.")
+      .default_value(1024)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--allocator-huge-pages")
+      .help("Back the pooled allocator's large blocks with huge pages.")
+      .mode(optionparser::STORE_TRUE);
+
+  parser.add_option("--result-cache-mb")
+      .help(
+          "Memory budget, in MiB, for caching inference results by servable "
+          "and input (0 to disable the cache).")
+      .default_value(0)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--result-cache-ttl")
+      .help("Seconds an inference result may be served from the cache.")
+      .default_value(60)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--max-sessions")
+      .help(
+          "Most inference sessions (see /sessions) kept at once; creating "
+          "more evicts the least recently used.")
+      .default_value(1024)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--session-memory-mb")
+      .help("Memory budget, in MiB, for the state tensors of sessions.")
+      .default_value(256)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--session-ttl")
+      .help("Seconds a session may sit idle before it's dropped.")
+      .default_value(600)
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--servable-config")
+      .help(
+          "Path to a JSON file of per-servable options, such as scheduling "
+          "`weight` and `max_concurrency`.")
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--pipeline-config")
+      .help(
+          "Path to a JSON file of pipelines, i.e., servables run one after "
+          "another on the server, served on /pipeline.")
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--backend")
+      .help(
+          "How to run models on the CPU: `interpreter` (the TorchScript "
+          "interpreter), `static_runtime` (libtorch's Static Runtime, "
+          "falling back to the interpreter for unsupported models) or "
+          "`lite_interpreter` (for models saved with "
+          "`_save_for_lite_interpreter`).")
+      .default_value("interpreter")
+      .mode(optionparser::STORE_VALUE);
+
+  parser.add_option("--quantized-engine")
+      .help(
+          "Engine for models quantized with `\"quantize\": "
+          "\"dynamic_int8\"`: `fbgemm` (x86), `qnnpack` (ARM) or `auto`.")
+      .default_value("auto")
       .mode(optionparser::STORE_VALUE);
 
   parser.add_option("--use-gpu")
@@ -56,21 +255,168 @@ int main(int argc, const char *argv[]) {
   logger->info("Starting torch-serving");
 
   auto config = GetConfiguration(argc, argv);
+  // Counts, sizes and durations are stored unsigned, where a negative value
+  // would wrap around to a huge limit.
+  for (const auto &flag :
+       {"model-capacity", "buffer-size", "port", "cores", "threads",
+        "inference-threads", "decode-threads", "encode-threads",
+        "intra-op-threads", "inter-op-threads", "allocator-cache-mb",
+        "max-in-flight", "max-queued", "max-in-flight-per-servable",
+        "max-queued-per-servable", "retry-after", "interactive-weight",
+        "bulk-weight", "max-decode-queued", "max-encode-queued",
+        "result-cache-mb", "result-cache-ttl", "max-sessions",
+        "session-memory-mb", "session-ttl"}) {
+    if (config.get_value<int>(flag) < 0) {
+      logger->error(std::string("--") + flag + " must not be negative");
+      return 1;
+    }
+  }
 
   auto model_capacity = config.get_value<int>("model-capacity");
   auto buffer_size = config.get_value<int>("buffer-size");
-  auto threads = config.get_value<int>("threads");
   auto host = config.get_value<std::string>("host");
   auto port = config.get_value<int>("port");
   auto use_gpu = config.get_value<bool>("use-gpu");
+  auto backend = config.get_value<std::string>("backend");
+  if (backend != "interpreter" && backend != "static_runtime" &&
+      backend != "lite_interpreter") {
+    logger->error("Unknown backend: " + backend +
+                  " (expected `interpreter`, `static_runtime` or "
+                  "`lite_interpreter`)");
+    return 1;
+  }
+  if (use_gpu && backend != "interpreter") {
+    logger->error("The " + backend + " backend only runs on the CPU");
+    return 1;
+  }
+  // Quantized weights are prepacked for one engine as models load.
+  auto quantized_engine = config.get_value<std::string>("quantized-engine");
+  try {
+    torch_serving::SetQuantizedEngine(
+        quantized_engine == "auto" ? "" : quantized_engine);
+  } catch (const std::invalid_argument &err) {
+    logger->error(err.what());
+    return 1;
+  }
+  logger->info("Quantized engine: " + torch_serving::QuantizedEngine());
+
+  // Size every thread pool from one CPU budget, so HTTP workers, inference
+  // workers and libtorch's intra-op threads don't oversubscribe the cores.
+  torch_serving::ThreadBudget requested_budget;
+  requested_budget.cores = config.get_value<int>("cores");
+  requested_budget.http_threads = config.get_value<int>("threads");
+  requested_budget.inference_workers =
+      config.get_value<int>("inference-threads");
+  requested_budget.decode_threads = config.get_value<int>("decode-threads");
+  requested_budget.encode_threads = config.get_value<int>("encode-threads");
+  requested_budget.intra_op_threads = config.get_value<int>("intra-op-threads");
+  requested_budget.inter_op_threads = config.get_value<int>("inter-op-threads");
+  auto budget = torch_serving::ComputeThreadBudget(requested_budget);
+  torch_serving::ApplyThreadBudget(budget);
+  logger->info("Thread budget: " + budget.ToString());
+
+  if (config.get_value<bool>("pooled-allocator")) {
+    torch_serving::BlockPoolOptions allocator_options;
+    allocator_options.max_cached_bytes =
+        static_cast<size_t>(config.get_value<int>("allocator-cache-mb"))
+        << 20;
+    allocator_options.huge_pages =
+        config.get_value<bool>("allocator-huge-pages");
+    torch_serving::InstallPooledCpuAllocator(allocator_options);
+    logger->info("Using the pooled CPU allocator");
+  }
+  auto threads = budget.http_threads;
+
+  torch_serving::AdmissionLimits admission_limits;
+  admission_limits.max_in_flight = config.get_value<int>("max-in-flight");
+  admission_limits.max_queued = config.get_value<int>("max-queued");
+  admission_limits.max_in_flight_per_servable =
+      config.get_value<int>("max-in-flight-per-servable");
+  admission_limits.max_queued_per_servable =
+      config.get_value<int>("max-queued-per-servable");
+  admission_limits.retry_after_seconds = config.get_value<int>("retry-after");
+
+  torch_serving::SchedulerOptions scheduler_options;
+  scheduler_options.num_workers = budget.inference_workers;
+  scheduler_options.strict_priority =
+      !config.get_value<bool>("weighted-priority");
+  scheduler_options.interactive_weight =
+      config.get_value<int>("interactive-weight");
+  scheduler_options.bulk_weight = config.get_value<int>("bulk-weight");
+  scheduler_options.adaptive_concurrency =
+      config.get_value<bool>("adaptive-concurrency");
+  scheduler_options.limiter_options.max_limit =
+      scheduler_options.num_workers;
+  scheduler_options.numa_aware = config.get_value<bool>("numa");
+
+  torch_serving::PipelineOptions pipeline_options;
+  pipeline_options.decode_threads = budget.decode_threads;
+  pipeline_options.max_decode_queued =
+      config.get_value<int>("max-decode-queued");
+  pipeline_options.encode_threads = budget.encode_threads;
+  pipeline_options.max_encode_queued =
+      config.get_value<int>("max-encode-queued");
+
+  torch_serving::ResultCacheOptions result_cache_options;
+  result_cache_options.max_bytes =
+      static_cast<size_t>(config.get_value<int>("result-cache-mb")) << 20;
+  result_cache_options.ttl =
+      std::chrono::seconds(config.get_value<int>("result-cache-ttl"));
+
+  torch_serving::SessionStoreOptions session_options;
+  session_options.max_sessions = config.get_value<int>("max-sessions");
+  session_options.max_bytes =
+      static_cast<size_t>(config.get_value<int>("session-memory-mb")) << 20;
+  session_options.ttl =
+      std::chrono::seconds(config.get_value<int>("session-ttl"));
+
+  // Config files are only read here, so mistakes in them stop the server
+  // before it listens.
+  torch_serving::ServableConfig servable_config;
+  torch_serving::ServablePipelines pipelines;
+  try {
+    if (config.get_value<bool>("servable-config")) {
+      servable_config = torch_serving::ServableConfig::FromFile(
+          config.get_value<std::string>("servable-config"));
+    }
+    if (config.get_value<bool>("pipeline-config")) {
+      pipelines = torch_serving::ServablePipelines::FromFile(
+          config.get_value<std::string>("pipeline-config"));
+    }
+  } catch (const std::exception &err) {
+    logger->error(std::string("Invalid config file: ") + err.what());
+    return 1;
+  }
 
-  if (!use_gpu) {
-    torch_serving::ModelServer<torch_serving::TorchJITServable> model_server(
-        model_capacity, buffer_size, threads);
-    model_server.RunServer(host, port);
-  } else {
-    torch_serving::ModelServer<torch_serving::TorchJITCudaServable>
-        model_server(model_capacity, buffer_size, threads);
-    model_server.RunServer(host, port);
+  try {
+    if (backend == "lite_interpreter") {
+      torch_serving::ModelServer<torch_serving::TorchLiteServable> model_server(
+          model_capacity, buffer_size, threads, admission_limits,
+          scheduler_options, servable_config, pipeline_options,
+          result_cache_options, pipelines, session_options);
+      model_server.RunServer(host, port);
+    } else if (backend == "static_runtime") {
+      torch_serving::ModelServer<torch_serving::TorchStaticServable>
+          model_server(model_capacity, buffer_size, threads, admission_limits,
+                       scheduler_options, servable_config, pipeline_options,
+                       result_cache_options, pipelines, session_options);
+      model_server.RunServer(host, port);
+    } else if (!use_gpu) {
+      torch_serving::ModelServer<torch_serving::TorchJITServable> model_server(
+          model_capacity, buffer_size, threads, admission_limits,
+          scheduler_options, servable_config, pipeline_options,
+          result_cache_options, pipelines, session_options);
+      model_server.RunServer(host, port);
+    } else {
+      torch_serving::ModelServer<torch_serving::TorchJITCudaServable>
+          model_server(model_capacity, buffer_size, threads, admission_limits,
+                       scheduler_options, servable_config, pipeline_options,
+                       result_cache_options, pipelines, session_options);
+      model_server.RunServer(host, port);
+    }
+  } catch (const std::exception &err) {
+    logger->error(std::string("Unable to run the model server: ") +
+                  err.what());
+    return 1;
   }
 }
@@ -0,0 +1,225 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__ADMISSION_CONTROLLER_H_
+#define TORCH_SERVING__ADMISSION_CONTROLLER_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "metrics.h"
+#include "request_context.h"
+
+namespace torch_serving {
+
+// Thrown when a request is shed because the server is past its admission
+// limits. The ModelServer turns this into a 503 with a Retry-After header.
+class OverloadedError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// All limits are disabled when set to zero.
+struct AdmissionLimits {
+  // Number of requests allowed to run inference at once.
+  size_t max_in_flight = 0;
+  // Number of requests allowed to wait for an in-flight slot.
+  size_t max_queued = 0;
+  size_t max_in_flight_per_servable = 0;
+  size_t max_queued_per_servable = 0;
+  int retry_after_seconds = 1;
+};
+
+// Bounds the number of in-flight and queued requests, both globally and per
+// servable. Requests past the queue limits are rejected immediately rather
+// than piling up behind the inference threads, which keeps goodput high
+// during overload.
+class AdmissionController {
+ public:
+  // An admitted request holds its in-flight slot until the ticket is
+  // destroyed.
+  class Ticket {
+   public:
+    Ticket() : controller_(nullptr) {}
+    Ticket(AdmissionController *controller, std::string servable_identifier)
+        : controller_(controller),
+          servable_identifier_(std::move(servable_identifier)) {}
+    Ticket(Ticket &&other) noexcept
+        : controller_(other.controller_),
+          servable_identifier_(std::move(other.servable_identifier_)) {
+      other.controller_ = nullptr;
+    }
+    Ticket &operator=(Ticket &&other) noexcept {
+      Release();
+      controller_ = other.controller_;
+      servable_identifier_ = std::move(other.servable_identifier_);
+      other.controller_ = nullptr;
+      return *this;
+    }
+    Ticket(const Ticket &) = delete;
+    Ticket &operator=(const Ticket &) = delete;
+    ~Ticket() { Release(); }
+
+    void Release() {
+      if (controller_) {
+        controller_->Release(servable_identifier_);
+        controller_ = nullptr;
+      }
+    }
+
+   private:
+    AdmissionController *controller_;
+    std::string servable_identifier_;
+  };
+
+  explicit AdmissionController(const AdmissionLimits &limits = {})
+      : limits_(limits), in_flight_(0), queued_(0) {}
+
+  // Blocks while the request is queued, and throws OverloadedError if the
+  // request can neither run nor queue. Queued requests are dropped with a
+  // DeadlineExceededError once their deadline passes, or a CancelledError
+  // once their client goes away.
+  Ticket Admit(const std::string &servable_identifier,
+               const RequestContext &context = {}) {
+    auto &metrics = MetricsRegistry::Global();
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto &servable = servables_[servable_identifier];
+
+    if (!HasCapacity(servable)) {
+      if (!HasQueueCapacity(servable)) {
+        EraseIfIdle(servable_identifier);
+        lock.unlock();
+        metrics.Increment("admission_shed");
+        metrics.Increment("admission_shed", servable_identifier);
+        throw OverloadedError("Too many outstanding requests for "
+                              "servable_identifier: " +
+                              servable_identifier);
+      }
+      ++queued_;
+      ++servable.queued;
+      PublishGauges(servable_identifier, servable);
+      // Wake up periodically so requests whose clients have gone away are
+      // removed from the queue without waiting for a free slot.
+      while (!HasCapacity(servable) && !context.Expired() &&
+             !context.cancellation.IsCancelled()) {
+        cond_.wait_until(lock,
+                         std::min(context.deadline,
+                                  RequestContext::Clock::now() +
+                                      RequestContext::PollInterval()));
+      }
+      --queued_;
+      --servable.queued;
+      if (!HasCapacity(servable)) {
+        PublishGauges(servable_identifier, servable);
+        EraseIfIdle(servable_identifier);
+        lock.unlock();
+        if (context.cancellation.IsCancelled()) {
+          metrics.Increment("cancelled", servable_identifier);
+          context.CheckCancelled(servable_identifier);
+        }
+        metrics.Increment("deadline_exceeded", servable_identifier);
+        throw DeadlineExceededError(
+            "Deadline exceeded while queued for servable_identifier: " +
+            servable_identifier);
+      }
+    }
+    ++in_flight_;
+    ++servable.in_flight;
+    PublishGauges(servable_identifier, servable);
+    lock.unlock();
+
+    metrics.Increment("admission_accepted");
+    metrics.Increment("admission_accepted", servable_identifier);
+    return Ticket(this, servable_identifier);
+  }
+
+  // Admits a request which needs a slot for each of several servables (e.g.,
+  // an ensemble), taking one per distinct servable. They're taken in sorted
+  // order, so requests waiting on each other's servables can't deadlock, and
+  // given back if any of them can't be taken.
+  std::vector<Ticket> AdmitAll(std::vector<std::string> servable_identifiers,
+                               const RequestContext &context = {}) {
+    std::sort(servable_identifiers.begin(), servable_identifiers.end());
+    servable_identifiers.erase(std::unique(servable_identifiers.begin(),
+                                           servable_identifiers.end()),
+                               servable_identifiers.end());
+    std::vector<Ticket> tickets;
+    tickets.reserve(servable_identifiers.size());
+    for (const auto &servable_identifier : servable_identifiers) {
+      tickets.push_back(Admit(servable_identifier, context));
+    }
+    return tickets;
+  }
+
+  const AdmissionLimits &Limits() const { return limits_; }
+
+ private:
+  struct ServableLoad {
+    size_t in_flight = 0;
+    size_t queued = 0;
+  };
+
+  bool HasCapacity(const ServableLoad &servable) const {
+    return Below(in_flight_, limits_.max_in_flight) &&
+           Below(servable.in_flight, limits_.max_in_flight_per_servable);
+  }
+
+  bool HasQueueCapacity(const ServableLoad &servable) const {
+    return Below(queued_, limits_.max_queued) &&
+           Below(servable.queued, limits_.max_queued_per_servable);
+  }
+
+  static bool Below(const size_t &value, const size_t &limit) {
+    return !limit || value < limit;
+  }
+
+  void Release(const std::string &servable_identifier) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto &servable = servables_[servable_identifier];
+      --in_flight_;
+      --servable.in_flight;
+      PublishGauges(servable_identifier, servable);
+      EraseIfIdle(servable_identifier);
+    }
+    // Waiters are blocked on different servables, so wake all of them.
+    cond_.notify_all();
+  }
+
+  // Servables are only tracked while they have requests in flight or queued,
+  // so arbitrary servable identifiers from clients don't pile up. Must hold
+  // mutex_.
+  void EraseIfIdle(const std::string &servable_identifier) {
+    auto servable = servables_.find(servable_identifier);
+    if (servable != servables_.end() && !servable->second.in_flight &&
+        !servable->second.queued) {
+      servables_.erase(servable);
+    }
+  }
+
+  void PublishGauges(const std::string &servable_identifier,
+                     const ServableLoad &servable) const {
+    auto &metrics = MetricsRegistry::Global();
+    metrics.SetGauge("in_flight", "", in_flight_);
+    metrics.SetGauge("queued", "", queued_);
+    metrics.SetGauge("in_flight", servable_identifier, servable.in_flight);
+    metrics.SetGauge("queued", servable_identifier, servable.queued);
+  }
+
+  AdmissionLimits limits_;
+  size_t in_flight_;
+  size_t queued_;
+  std::unordered_map<std::string, ServableLoad> servables_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__ADMISSION_CONTROLLER_H_
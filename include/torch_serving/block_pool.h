@@ -0,0 +1,96 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__BLOCK_POOL_H_
+#define TORCH_SERVING__BLOCK_POOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "extern/json.hpp"
+
+namespace json = nlohmann;
+
+namespace torch_serving {
+
+struct BlockPoolOptions {
+  // Larger requests bypass the pool, going straight to (and back to) the OS.
+  size_t max_block_bytes = size_t(1) << 30;
+  // Budget for free blocks kept for reuse. Blocks freed beyond it are
+  // returned to the OS.
+  size_t max_cached_bytes = size_t(1) << 30;
+  // Touch every page of a new block, so requests reusing it don't fault.
+  bool prefault = true;
+  // Ask for transparent huge pages on blocks of 2 MiB and up.
+  bool huge_pages = false;
+};
+
+// A thread-safe pool of 64-byte aligned memory blocks, kept on free lists by
+// size class so blocks freed by one request are reused by the next, rather
+// than each allocation mapping (and faulting in) fresh pages. Size classes
+// are multiples of 64 bytes up to 1 KiB, then four per power of two, so
+// rounding wastes at most 25%.
+//
+// Each size class has one mutex, shared by every thread, and there are no
+// per-thread caches. The mutex is only held to push or pop one pointer, and
+// a forward pass allocates a few large activations rather than many small
+// ones, so threads rarely meet on the same class. Threads which allocate one
+// size class at a high rate will serialize on it, though; that's traded for
+// blocks freed by any thread being reusable by every other at once.
+class BlockPool {
+ public:
+  static constexpr size_t kAlignment = 64;
+
+  explicit BlockPool(const BlockPoolOptions &options = {});
+  // Releases cached blocks. Blocks still in use must not outlive the pool.
+  ~BlockPool();
+
+  BlockPool(const BlockPool &) = delete;
+  BlockPool &operator=(const BlockPool &) = delete;
+
+  // Returns null for zero bytes. Throws std::bad_alloc when out of memory.
+  void *Allocate(const size_t &bytes);
+
+  // Returns a block from Allocate to the pool it came from. Null is ignored.
+  static void Free(void *data);
+
+  // The bytes actually reserved for a request of `bytes`.
+  static size_t SizeClassBytes(const size_t &bytes);
+
+  // Returns every cached block to the OS.
+  void Trim();
+
+  json::json Stats() const;
+
+ private:
+  struct Header;
+  struct Bin {
+    std::mutex mutex;
+    std::vector<void *> blocks;
+  };
+
+  static size_t BinIndex(const size_t &bytes);
+
+  void *Map(const size_t &bytes, const size_t &bin);
+  void Release(void *data);
+  void Recycle(void *data);
+
+  BlockPoolOptions options_;
+  std::unique_ptr<Bin[]> bins_;
+  std::atomic<size_t> bytes_in_use_;
+  std::atomic<size_t> bytes_cached_;
+  std::atomic<uint64_t> allocations_;
+  std::atomic<uint64_t> reused_;
+  std::atomic<uint64_t> unpooled_;
+  std::atomic<uint64_t> released_;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__BLOCK_POOL_H_
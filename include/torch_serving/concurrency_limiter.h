@@ -0,0 +1,95 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__CONCURRENCY_LIMITER_H_
+#define TORCH_SERVING__CONCURRENCY_LIMITER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace torch_serving {
+
+struct ConcurrencyLimiterOptions {
+  size_t initial_limit = 4;
+  size_t min_limit = 1;
+  size_t max_limit = 64;
+  // How far the short-term latency may drift above the long-term baseline
+  // before the limit starts backing off.
+  double tolerance = 1.5;
+  // Weight of each new limit estimate (higher reacts faster).
+  double smoothing = 0.2;
+  // Number of samples the long-term latency baseline averages over.
+  size_t long_window = 600;
+};
+
+// Adapts the number of concurrent forward passes for a servable from their
+// observed latency, following the gradient approach of Netflix's
+// concurrency-limits: while latency stays near its long-term baseline the
+// limit grows, and once requests start queueing inside the model (e.g.,
+// through intra-op thread oversubscription) the limit shrinks in proportion.
+//
+// N.B., not thread safe - the InferenceScheduler updates it under its lock.
+class GradientConcurrencyLimiter {
+ public:
+  explicit GradientConcurrencyLimiter(
+      const ConcurrencyLimiterOptions &options = {})
+      : options_(options),
+        limit_(Clamp(static_cast<double>(options.initial_limit))),
+        long_latency_(0.0),
+        samples_(0) {}
+
+  size_t Limit() const { return static_cast<size_t>(limit_); }
+
+  // Records the latency of one forward pass, which ran alongside `in_flight`
+  // others (itself included).
+  void OnSample(const std::chrono::nanoseconds &latency,
+                const size_t &in_flight) {
+    const auto sample = static_cast<double>(latency.count());
+    if (sample <= 0) {
+      return;
+    }
+    ++samples_;
+    const auto window = static_cast<double>(
+        std::min<size_t>(samples_, std::max<size_t>(options_.long_window, 1)));
+    long_latency_ += (sample - long_latency_) / window;
+
+    // If latency has recovered well below the baseline (e.g., after a load
+    // spike), let the baseline catch up quickly.
+    if (long_latency_ / sample > 2.0) {
+      long_latency_ *= 0.95;
+    }
+
+    // When we aren't using the current limit, latency tells us nothing about
+    // whether a higher one would help.
+    if (static_cast<double>(in_flight) < limit_ / 2.0) {
+      return;
+    }
+
+    const auto gradient = std::max(
+        0.5, std::min(1.0, options_.tolerance * long_latency_ / sample));
+    const auto queue_size = std::sqrt(limit_);
+    const auto estimate = limit_ * gradient + queue_size;
+    limit_ = Clamp(limit_ * (1.0 - options_.smoothing) +
+                   estimate * options_.smoothing);
+  }
+
+ private:
+  double Clamp(const double &limit) const {
+    const auto min_limit = std::max<size_t>(options_.min_limit, 1);
+    const auto max_limit = std::max(options_.max_limit, min_limit);
+    return std::max(static_cast<double>(min_limit),
+                    std::min(static_cast<double>(max_limit), limit));
+  }
+
+  ConcurrencyLimiterOptions options_;
+  double limit_;
+  double long_latency_;
+  size_t samples_;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__CONCURRENCY_LIMITER_H_
@@ -0,0 +1,44 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__CPU_BUDGET_H_
+#define TORCH_SERVING__CPU_BUDGET_H_
+
+#include <string>
+
+namespace torch_serving {
+
+// Number of CPUs this process can actually use: the smaller of its affinity
+// mask and its cgroup CPU quota (v1 or v2), if one is set.
+size_t AvailableCores();
+
+// How the CPUs available to the server are split between its thread pools.
+// Each inference worker runs forward passes with `intra_op_threads`, so the
+// workers together fill the cores without oversubscribing them.
+struct ThreadBudget {
+  size_t cores = 0;
+  size_t http_threads = 0;
+  // The conversion stages either side of inference.
+  size_t decode_threads = 0;
+  size_t encode_threads = 0;
+  size_t inference_workers = 0;
+  size_t intra_op_threads = 0;
+  size_t inter_op_threads = 0;
+
+  std::string ToString() const;
+};
+
+// Fills in any zero (i.e., automatic) fields of `requested` from the number of
+// available cores. Explicitly requested values are left alone.
+ThreadBudget ComputeThreadBudget(const ThreadBudget &requested = {});
+
+// Sizes libtorch's intra-op and inter-op thread pools. Must be called before
+// any models are loaded. N.B., the intra-op pool is shared by every forward
+// pass in the process, so it can't be resized per servable.
+void ApplyThreadBudget(const ThreadBudget &budget);
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__CPU_BUDGET_H_
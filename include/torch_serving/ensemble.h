@@ -0,0 +1,181 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__ENSEMBLE_H_
+#define TORCH_SERVING__ENSEMBLE_H_
+
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "extern/json.hpp"
+
+namespace json = nlohmann;
+
+namespace torch_serving {
+
+// Thrown when the results of an ensemble can't be reduced, e.g., because its
+// servables return differently shaped outputs.
+class EnsembleError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// How the results of an ensemble's servables are combined on the server.
+enum class EnsembleReduction { kNone, kMean, kWeightedSum };
+
+inline EnsembleReduction StringToEnsembleReduction(
+    const std::string &reduction) {
+  if (reduction == "none") {
+    return EnsembleReduction::kNone;
+  } else if (reduction == "mean") {
+    return EnsembleReduction::kMean;
+  } else if (reduction == "weighted_sum") {
+    return EnsembleReduction::kWeightedSum;
+  } else {
+    throw std::invalid_argument(
+        "Invalid reduction: " + reduction +
+        " (expected `none`, `mean` or `weighted_sum`)");
+  }
+}
+
+// Parses a comma separated list of weights, e.g., "0.2,0.8".
+inline std::vector<double> ParseEnsembleWeights(const std::string &weights) {
+  std::vector<double> parsed;
+  size_t start = 0;
+  while (start <= weights.size()) {
+    auto end = weights.find(',', start);
+    if (end == std::string::npos) {
+      end = weights.size();
+    }
+    const auto weight = weights.substr(start, end - start);
+    char *parse_end = nullptr;
+    parsed.push_back(std::strtod(weight.c_str(), &parse_end));
+    if (weight.empty() || *parse_end != '\0') {
+      throw std::invalid_argument("Invalid ensemble weight: `" + weight + "`");
+    }
+    start = end + 1;
+  }
+  return parsed;
+}
+
+namespace detail {
+
+// Whether `result` is a tensor or scalar, as encoded by TorchValueToJson.
+inline bool IsEncodedTensor(const json::json &result) {
+  if (!result.is_object() || !result.contains("value")) {
+    return false;
+  }
+  auto type = result.find("type");
+  return type != result.end() && (*type == "tensor" || *type == "scalar");
+}
+
+// Adds `weight` * `result` to `reduced`, element-wise.
+inline void AccumulateResult(const json::json &result, const double &weight,
+                             json::json &reduced) {
+  if (result.is_number()) {
+    if (!reduced.is_number()) {
+      throw EnsembleError("Can't reduce a number with a " +
+                          std::string(reduced.type_name()));
+    }
+    reduced = reduced.get<double>() + weight * result.get<double>();
+  } else if (result.is_boolean()) {
+    if (!reduced.is_number()) {
+      throw EnsembleError("Can't reduce a boolean with a " +
+                          std::string(reduced.type_name()));
+    }
+    reduced = reduced.get<double>() + (result.get<bool>() ? weight : 0.0);
+  } else if (result.is_array()) {
+    if (!reduced.is_array() || reduced.size() != result.size()) {
+      throw EnsembleError("Can't reduce results of different shapes");
+    }
+    for (size_t i = 0; i < result.size(); ++i) {
+      AccumulateResult(result[i], weight, reduced[i]);
+    }
+  } else if (IsEncodedTensor(result)) {
+    // Only the values are reduced; the shapes must match.
+    if (!IsEncodedTensor(reduced) || reduced["type"] != result["type"] ||
+        reduced.value("shape", json::json()) !=
+            result.value("shape", json::json())) {
+      throw EnsembleError("Can't reduce tensors of different shapes");
+    }
+    AccumulateResult(result["value"], weight, reduced["value"]);
+  } else if (result.is_string()) {
+    // E.g., labels, which must agree.
+    if (reduced != result) {
+      throw EnsembleError("Can't reduce different strings");
+    }
+  } else if (result.is_object()) {
+    if (!reduced.is_object() || reduced.size() != result.size()) {
+      throw EnsembleError("Can't reduce results with different keys");
+    }
+    for (const auto &item : result.items()) {
+      auto element = reduced.find(item.key());
+      if (element == reduced.end()) {
+        throw EnsembleError("Can't reduce results with different keys");
+      }
+      AccumulateResult(item.value(), weight, *element);
+    }
+  } else {
+    throw EnsembleError("Can't reduce a " + std::string(result.type_name()));
+  }
+}
+
+// A result of the same shape as `result`, with every number set to zero.
+inline json::json ZerosLike(const json::json &result) {
+  if (result.is_number() || result.is_boolean()) {
+    return 0.0;
+  }
+  if (!result.is_array() && !result.is_object()) {
+    return result;
+  }
+  auto zeros = result;
+  if (IsEncodedTensor(result)) {
+    zeros["value"] = ZerosLike(result["value"]);
+    // Integer values are averaged into floats.
+    const auto data_type = result.value("data_type", "");
+    if (data_type != "float16" && data_type != "bfloat16" &&
+        data_type != "float32") {
+      zeros["data_type"] = "float64";
+    }
+    return zeros;
+  }
+  for (auto &element : zeros) {
+    element = ZerosLike(element);
+  }
+  return zeros;
+}
+
+}  // namespace detail
+
+// Combines the results of an ensemble element-wise. Results must have the same
+// structure, i.e., nested arrays (or objects) of numbers, or the tensors and
+// scalars returned by TorchValueToJson. Any strings (e.g., type tags) must be
+// equal, and are passed through. Weights are ignored by kMean, and there must
+// be one per result for kWeightedSum.
+inline json::json ReduceResults(const std::vector<const json::json *> &results,
+                                const EnsembleReduction &reduction,
+                                const std::vector<double> &weights = {}) {
+  if (results.empty()) {
+    throw EnsembleError("Can't reduce an empty ensemble");
+  }
+  if (reduction == EnsembleReduction::kWeightedSum &&
+      weights.size() != results.size()) {
+    throw EnsembleError("Expected " + std::to_string(results.size()) +
+                        " weights, got " + std::to_string(weights.size()));
+  }
+  auto reduced = detail::ZerosLike(*results.front());
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto weight = reduction == EnsembleReduction::kWeightedSum
+                            ? weights[i]
+                            : 1.0 / static_cast<double>(results.size());
+    detail::AccumulateResult(*results[i], weight, reduced);
+  }
+  return reduced;
+}
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__ENSEMBLE_H_
@@ -0,0 +1,108 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__HTTP_SERVER_H_
+#define TORCH_SERVING__HTTP_SERVER_H_
+
+#include <memory>
+#include <mutex>
+
+#include "extern/httplib.h"
+
+namespace torch_serving {
+
+// A connection being served by a worker thread. The server clears `alive`
+// before it closes the socket, so a probe holding `mutex` never reads from a
+// socket which has been closed, or reused for another connection.
+struct Connection {
+  explicit Connection(socket_t sock) : sock(sock) {}
+
+  const socket_t sock;
+  std::mutex mutex;
+  bool alive = true;
+};
+
+// httplib::Server which remembers which connection each worker thread is
+// serving, so handlers can tell whether their client is still connected.
+class HTTPServer : public httplib::Server {
+ public:
+  // The connection being handled by the calling thread, or null outside of a
+  // handler.
+  static std::shared_ptr<Connection> CurrentConnection() {
+    return current_connection();
+  }
+
+  // Returns false once the peer has closed its end of the connection, or the
+  // server has closed the socket. Note that clients which half-close their
+  // socket after sending a request will look disconnected.
+  static bool IsConnected(const std::shared_ptr<Connection> &connection) {
+    if (!connection) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(connection->mutex);
+    if (!connection->alive) {
+      return false;
+    }
+#ifdef _WIN32
+    return true;
+#else
+    char buffer;
+    auto received =
+        recv(connection->sock, &buffer, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (received > 0) {
+      // A pipelined request is waiting to be read - still connected.
+      return true;
+    }
+    return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#endif
+  }
+
+ private:
+  static std::shared_ptr<Connection> &current_connection() {
+    static thread_local std::shared_ptr<Connection> connection;
+    return connection;
+  }
+
+  // Mirrors httplib::detail::read_and_close_socket, recording the connection
+  // while it is served and marking it closed before its socket is.
+  bool read_and_close_socket(socket_t sock) override {
+    auto connection = std::make_shared<Connection>(sock);
+    current_connection() = connection;
+    auto serve = [this, sock](bool last_connection, bool &connection_close) {
+      httplib::SocketStream strm(sock);
+      return process_request(strm, last_connection, connection_close,
+                             nullptr);
+    };
+    auto ret = false;
+    if (keep_alive_max_count_ > 0) {
+      auto count = keep_alive_max_count_;
+      while (count > 0 &&
+             httplib::detail::select_read(
+                 sock, CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND,
+                 CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND) > 0) {
+        auto connection_close = false;
+        ret = serve(count == 1, connection_close);
+        if (!ret || connection_close) {
+          break;
+        }
+        count--;
+      }
+    } else {
+      auto connection_close = false;
+      ret = serve(true, connection_close);
+    }
+    {
+      std::lock_guard<std::mutex> lock(connection->mutex);
+      connection->alive = false;
+    }
+    current_connection().reset();
+    httplib::detail::close_socket(sock);
+    return ret;
+  }
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__HTTP_SERVER_H_
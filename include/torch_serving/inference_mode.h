@@ -0,0 +1,32 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__INFERENCE_MODE_H_
+#define TORCH_SERVING__INFERENCE_MODE_H_
+
+#include <torch/version.h>
+
+#if TORCH_VERSION_MAJOR > 1 || TORCH_VERSION_MINOR >= 9
+#include <c10/core/InferenceMode.h>
+#else
+#include <torch/utils.h>
+#endif
+
+namespace torch_serving {
+
+// Turns off autograd for a forward pass while in scope. Where libtorch has
+// it (>= 1.9), this is c10::InferenceMode, which also skips the version
+// counters and view tracking autograd would need; otherwise it only disables
+// gradients. N.B., tensors created under InferenceMode can't be modified in
+// place or saved for backward outside it, which serving never does.
+#if TORCH_VERSION_MAJOR > 1 || TORCH_VERSION_MINOR >= 9
+using InferenceModeGuard = c10::InferenceMode;
+#else
+using InferenceModeGuard = torch::NoGradGuard;
+#endif
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__INFERENCE_MODE_H_
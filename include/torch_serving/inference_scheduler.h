@@ -0,0 +1,509 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__INFERENCE_SCHEDULER_H_
+#define TORCH_SERVING__INFERENCE_SCHEDULER_H_
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "concurrency_limiter.h"
+#include "metrics.h"
+#include "numa.h"
+#include "request_context.h"
+#include "servable_config.h"
+
+namespace torch_serving {
+
+struct SchedulerOptions {
+  // Number of threads running inference.
+  size_t num_workers = std::max(1u, std::thread::hardware_concurrency());
+  // With strict priority, bulk work only runs when no interactive work is
+  // queued. Otherwise, free workers are shared between the priority classes
+  // in proportion to their weights.
+  bool strict_priority = true;
+  size_t interactive_weight = 4;
+  size_t bulk_weight = 1;
+  // Adapt each servable's concurrency to its observed forward latency. May be
+  // overridden per servable with `adaptive_concurrency` in the
+  // ServableConfig.
+  bool adaptive_concurrency = false;
+  ConcurrencyLimiterOptions limiter_options;
+  // Split the workers between NUMA nodes, pinned to each node's CPUs, and
+  // route each servable's requests to the workers of a single node.
+  bool numa_aware = false;
+  // The nodes to split workers between, if not this machine's.
+  std::vector<NumaNode> numa_nodes;
+};
+
+// A fixed pool of inference workers fed by one queue per priority class.
+// Within a class, each servable has its own queue and workers are shared
+// between servables by deficit round robin, so one hot model can't starve
+// the others. Servables may be given a `weight` (their share of workers under
+// contention) and a `max_concurrency` in the ServableConfig. With adaptive
+// concurrency, each servable's cap is additionally tuned from its latency by a
+// GradientConcurrencyLimiter.
+//
+// When NUMA aware, workers are grouped (and pinned) by NUMA node and each
+// servable is placed on one node - either its `numa_node` in the
+// ServableConfig, or the node with the fewest servables. Its requests then
+// only run on workers local to its weights.
+//
+// Tasks which expire or are cancelled while queued are dropped at dispatch,
+// before they ever reach a worker.
+class InferenceScheduler {
+ public:
+  using Work = std::function<void()>;
+  using Drop = std::function<void(std::exception_ptr)>;
+
+  explicit InferenceScheduler(const SchedulerOptions &options = {},
+                              const ServableConfig &servable_config = {})
+      : options_(options),
+        servable_config_(servable_config),
+        shutdown_(false),
+        current_weights_{{0, 0}},
+        utilisation_(std::max<size_t>(options.num_workers, 1)) {
+    if (options_.numa_aware) {
+      const auto nodes = options_.numa_nodes.empty() ? NumaTopology()
+                                                     : options_.numa_nodes;
+      for (const auto &node : nodes) {
+        groups_.emplace_back();
+        groups_.back().numa_node = node.id;
+        groups_.back().cpus = node.cpus;
+      }
+    } else {
+      groups_.emplace_back();
+    }
+    const auto num_workers = std::max<size_t>(options_.num_workers, 1);
+    for (size_t i = 0; i < num_workers; ++i) {
+      ++groups_[i % groups_.size()].num_workers;
+    }
+    for (size_t i = 0; i < num_workers; ++i) {
+      workers_.emplace_back([this, i] { WorkerLoop(i % groups_.size()); });
+    }
+  }
+
+  InferenceScheduler(const InferenceScheduler &) = delete;
+  InferenceScheduler &operator=(const InferenceScheduler &) = delete;
+
+  ~InferenceScheduler() { Shutdown(); }
+
+  // Queues `work` to run on an inference worker. If the request is dropped
+  // instead, `drop` is called with the reason.
+  void Submit(const std::string &servable_identifier,
+              const RequestContext &context, Work work, Drop drop) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto &priority_class = classes_[Index(context.priority)];
+      auto &queue = priority_class.queues[servable_identifier];
+      if (queue.tasks.empty()) {
+        priority_class.active.push_back(servable_identifier);
+      }
+      queue.tasks.push_back(
+          {servable_identifier, context, std::move(work), std::move(drop)});
+      ++priority_class.size;
+      auto &state = GetServableState(servable_identifier);
+      ++state.queued;
+      auto &group = groups_[state.group];
+      ++group.queued;
+      PublishQueueDepth(context.priority, servable_identifier);
+      group.cond.notify_one();
+    }
+  }
+
+  size_t NumWorkers() const { return workers_.size(); }
+
+  // Called by a task to report how long its forward pass took. This is the
+  // latency sample for adaptive concurrency, so it mustn't include model
+  // loads or conversions; tasks which don't report one aren't sampled.
+  static void RecordForwardLatency(const std::chrono::nanoseconds &latency) {
+    ForwardLatency() = latency;
+  }
+
+  // Keeps a servable's placement and concurrency limit while it's loaded.
+  // Other servables are only tracked while they have tasks queued or
+  // running, so arbitrary servable identifiers from clients don't pile up.
+  void Retain(const std::string &servable_identifier) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    GetServableState(servable_identifier).retained = true;
+  }
+
+  // Stops retaining every servable for which `loaded` returns false, e.g.,
+  // once it's evicted from the model cache.
+  void ReleaseUnloaded(
+      const std::function<bool(const std::string &)> &loaded) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto state = servables_.begin(); state != servables_.end();) {
+      auto next = std::next(state);
+      if (state->second.retained && !loaded(state->first)) {
+        state->second.retained = false;
+        EraseIfIdle(state);
+      }
+      state = next;
+    }
+  }
+
+  // The number of servables being tracked.
+  size_t NumServables() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return servables_.size();
+  }
+
+  // The NUMA node a servable's requests run on, or -1 if we aren't NUMA
+  // aware.
+  int NumaNode(const std::string &servable_identifier) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return groups_[GetServableState(servable_identifier).group].numa_node;
+  }
+
+  // Queue depth and worker utilisation, for the /metrics endpoint.
+  json::json Stats() {
+    size_t queued = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto &group : groups_) {
+        queued += group.queued;
+      }
+    }
+    return {{"workers", workers_.size()},
+            {"queued", queued},
+            {"utilisation", utilisation_.Read()}};
+  }
+
+  // Describes where the workers are running, for logging at startup.
+  std::string Placement() const {
+    std::string placement;
+    for (const auto &group : groups_) {
+      placement += (placement.empty() ? "" : "; ") +
+                   std::to_string(group.num_workers) + " workers";
+      if (group.numa_node >= 0) {
+        placement += " on NUMA node " + std::to_string(group.numa_node) +
+                     " (CPUs " + CpusToString(group.cpus) + ")";
+      }
+    }
+    return placement;
+  }
+
+  void Shutdown() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (shutdown_) {
+        return;
+      }
+      shutdown_ = true;
+      for (auto &group : groups_) {
+        group.cond.notify_all();
+      }
+    }
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+ private:
+  static constexpr size_t kNumPriorities = 2;
+
+  struct Task {
+    std::string servable_identifier;
+    RequestContext context;
+    Work work;
+    Drop drop;
+  };
+
+  struct ServableQueue {
+    std::deque<Task> tasks;
+    double deficit = 0.0;
+  };
+
+  struct PriorityClass {
+    std::unordered_map<std::string, ServableQueue> queues;
+    // Servables with queued tasks, in round robin order.
+    std::deque<std::string> active;
+    size_t size = 0;
+  };
+
+  // The workers of one NUMA node (or all of them, when not NUMA aware).
+  struct WorkerGroup {
+    int numa_node = -1;
+    // CPUs to pin the workers to, if any.
+    std::vector<int> cpus;
+    size_t num_workers = 0;
+    size_t num_servables = 0;
+    // Tasks queued for servables placed on this group.
+    size_t queued = 0;
+    std::condition_variable cond;
+  };
+
+  struct ServableState {
+    size_t group = 0;
+    double weight = 1.0;
+    size_t max_concurrency = 0;
+    size_t running = 0;
+    size_t queued = 0;
+    // Whether the servable is loaded (see Retain).
+    bool retained = false;
+    std::shared_ptr<GradientConcurrencyLimiter> limiter;
+
+    // The number of tasks this servable may have running, or zero for no
+    // limit.
+    size_t ConcurrencyCap() const {
+      if (!limiter) {
+        return max_concurrency;
+      }
+      return max_concurrency ? std::min(max_concurrency, limiter->Limit())
+                             : limiter->Limit();
+    }
+  };
+
+  // The forward latency reported by the task running on this thread.
+  static std::chrono::nanoseconds &ForwardLatency() {
+    thread_local std::chrono::nanoseconds latency;
+    return latency;
+  }
+
+  static size_t Index(const Priority &priority) {
+    return static_cast<size_t>(priority);
+  }
+
+  ServableState &GetServableState(const std::string &servable_identifier) {
+    auto state = servables_.find(servable_identifier);
+    if (state == servables_.end()) {
+      const auto &options = servable_config_.Options(servable_identifier);
+      ServableState initial;
+      initial.weight = std::max(1.0, options.weight);
+      initial.max_concurrency = options.max_concurrency;
+      if (options.has_adaptive_concurrency ? options.adaptive_concurrency
+                                           : options_.adaptive_concurrency) {
+        initial.limiter = std::make_shared<GradientConcurrencyLimiter>(
+            options_.limiter_options);
+        MetricsRegistry::Global().SetGauge("concurrency_limit",
+                                           servable_identifier,
+                                           initial.limiter->Limit());
+      }
+      initial.group = PlaceServable(servable_identifier);
+      state = servables_.emplace(servable_identifier, initial).first;
+    }
+    return state->second;
+  }
+
+  // Must hold mutex_.
+  void EraseIfIdle(
+      std::unordered_map<std::string, ServableState>::iterator state) {
+    if (!state->second.retained && !state->second.running &&
+        !state->second.queued) {
+      --groups_[state->second.group].num_servables;
+      servables_.erase(state);
+    }
+  }
+
+  // Picks the worker group for a new servable. Must hold mutex_.
+  size_t PlaceServable(const std::string &servable_identifier) {
+    const auto requested_node =
+        servable_config_.Options(servable_identifier).numa_node;
+    size_t selected = groups_.size();
+    for (size_t i = 0; i < groups_.size(); ++i) {
+      if (!groups_[i].num_workers) {
+        continue;
+      }
+      if (groups_[i].numa_node >= 0 &&
+          groups_[i].numa_node == requested_node) {
+        selected = i;
+        break;
+      }
+      if (selected == groups_.size() ||
+          groups_[i].num_servables < groups_[selected].num_servables) {
+        selected = i;
+      }
+    }
+    ++groups_[selected].num_servables;
+    MetricsRegistry::Global().SetGauge("numa_node", servable_identifier,
+                                       groups_[selected].numa_node);
+    return selected;
+  }
+
+  size_t Weight(const size_t &index) const {
+    return index == Index(Priority::kInteractive) ? options_.interactive_weight
+                                                  : options_.bulk_weight;
+  }
+
+  // The order in which to try the priority classes for the next dispatch.
+  // Must hold mutex_.
+  std::array<size_t, kNumPriorities> ClassOrder() {
+    std::array<size_t, kNumPriorities> order{{0, 1}};
+    if (options_.strict_priority) {
+      return order;
+    }
+    // Smooth weighted round robin over the non-empty classes.
+    size_t total_weight = 0;
+    size_t selected = kNumPriorities;
+    for (size_t i = 0; i < kNumPriorities; ++i) {
+      if (!classes_[i].size) {
+        continue;
+      }
+      current_weights_[i] += std::max<size_t>(Weight(i), 1);
+      total_weight += std::max<size_t>(Weight(i), 1);
+      if (selected == kNumPriorities ||
+          current_weights_[i] > current_weights_[selected]) {
+        selected = i;
+      }
+    }
+    if (selected != kNumPriorities) {
+      current_weights_[selected] -= total_weight;
+      std::swap(order[0], order[selected]);
+    }
+    return order;
+  }
+
+  // Deficit round robin over the servables of one priority class, skipping
+  // servables at their concurrency cap or placed on another worker group.
+  // Must hold mutex_.
+  bool NextTaskFromClass(PriorityClass &priority_class, const size_t &group,
+                         Task &task) {
+    auto &active = priority_class.active;
+    for (size_t i = 0; i < active.size(); ++i) {
+      const std::string servable_identifier = active[i];
+      auto &state = GetServableState(servable_identifier);
+      const auto cap = state.ConcurrencyCap();
+      if (state.group != group || (cap && state.running >= cap)) {
+        continue;
+      }
+      auto &queue = priority_class.queues[servable_identifier];
+      if (queue.deficit < 1.0) {
+        queue.deficit += state.weight;
+      }
+      queue.deficit -= 1.0;
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      --priority_class.size;
+      --state.queued;
+      --groups_[group].queued;
+      ++state.running;
+      if (queue.tasks.empty()) {
+        active.erase(active.begin() + i);
+        priority_class.queues.erase(servable_identifier);
+      } else if (queue.deficit < 1.0) {
+        active.erase(active.begin() + i);
+        active.push_back(servable_identifier);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // Must hold mutex_.
+  bool NextTask(const size_t &group, Task &task) {
+    if (!groups_[group].queued) {
+      return false;
+    }
+    for (const auto &index : ClassOrder()) {
+      if (NextTaskFromClass(classes_[index], group, task)) {
+        PublishQueueDepth(task.context.priority, task.servable_identifier);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void PublishQueueDepth(const Priority &priority,
+                         const std::string &servable_identifier) {
+    auto &metrics = MetricsRegistry::Global();
+    metrics.SetGauge("scheduler_queued", PriorityToString(priority),
+                     classes_[Index(priority)].size);
+    metrics.SetGauge("scheduler_queued_per_servable", servable_identifier,
+                     GetServableState(servable_identifier).queued);
+  }
+
+  void WorkerLoop(const size_t &group_index) {
+    auto &group = groups_[group_index];
+    if (!group.cpus.empty()) {
+      PinCurrentThread(group.cpus);
+    }
+    for (;;) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        // N.B., queued tasks may all be held back by concurrency caps, in
+        // which case we wait for a running task to finish.
+        while (!NextTask(group_index, task)) {
+          if (shutdown_ && !group.queued) {
+            return;
+          }
+          group.cond.wait(lock);
+        }
+      }
+      ForwardLatency() = std::chrono::nanoseconds::zero();
+      const auto start = std::chrono::steady_clock::now();
+      const auto ran = Run(task);
+      utilisation_.AddBusy(std::chrono::steady_clock::now() - start);
+      const auto latency = ForwardLatency();
+      bool capped;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &state = GetServableState(task.servable_identifier);
+        if (ran && state.limiter && latency.count() > 0) {
+          state.limiter->OnSample(latency, state.running);
+          MetricsRegistry::Global().SetGauge("concurrency_limit",
+                                             task.servable_identifier,
+                                             state.limiter->Limit());
+        }
+        --state.running;
+        capped = state.ConcurrencyCap() > 0;
+        EraseIfIdle(servables_.find(task.servable_identifier));
+      }
+      // Tasks for this servable may have been held back by its cap.
+      if (capped) {
+        group.cond.notify_all();
+      }
+    }
+  }
+
+  // Returns false if the task was dropped rather than run.
+  static bool Run(Task &task) {
+    auto &metrics = MetricsRegistry::Global();
+    try {
+      if (task.context.cancellation.IsCancelled()) {
+        metrics.Increment("cancelled", task.servable_identifier);
+        task.context.CheckCancelled(task.servable_identifier);
+      }
+      if (task.context.Expired()) {
+        metrics.Increment("deadline_exceeded", task.servable_identifier);
+        task.context.CheckDeadline(task.servable_identifier);
+      }
+    } catch (...) {
+      task.drop(std::current_exception());
+      return false;
+    }
+    task.work();
+    return true;
+  }
+
+  SchedulerOptions options_;
+  ServableConfig servable_config_;
+  bool shutdown_;
+  std::array<PriorityClass, kNumPriorities> classes_;
+  // N.B., a deque so the condition variables never move.
+  std::deque<WorkerGroup> groups_;
+  std::unordered_map<std::string, ServableState> servables_;
+  // Running weights for the smooth weighted round robin between classes.
+  std::array<long long, kNumPriorities> current_weights_;
+  UtilisationMeter utilisation_;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__INFERENCE_SCHEDULER_H_
@@ -0,0 +1,143 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__METRICS_H_
+#define TORCH_SERVING__METRICS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "extern/json.hpp"
+
+namespace json = nlohmann;
+
+namespace torch_serving {
+
+// A process-wide registry of counters and gauges, keyed by metric name and an
+// optional label (usually a servable_identifier). Exported as JSON on the
+// /metrics endpoint of the ModelServer.
+class MetricsRegistry {
+ public:
+  static MetricsRegistry &Global() {
+    static MetricsRegistry registry;
+    return registry;
+  }
+
+  void Increment(const std::string &name, const std::string &label = "",
+                 const int64_t &value = 1) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    counters_[name][label] += value;
+  }
+
+  void SetGauge(const std::string &name, const std::string &label,
+                const double &value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    gauges_[name][label] = value;
+  }
+
+  int64_t GetCounter(const std::string &name,
+                     const std::string &label = "") const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto metric = counters_.find(name);
+    if (metric == counters_.end()) {
+      return 0;
+    }
+    auto value = metric->second.find(label);
+    return value == metric->second.end() ? 0 : value->second;
+  }
+
+  double GetGauge(const std::string &name,
+                  const std::string &label = "") const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto metric = gauges_.find(name);
+    if (metric == gauges_.end()) {
+      return 0.0;
+    }
+    auto value = metric->second.find(label);
+    return value == metric->second.end() ? 0.0 : value->second;
+  }
+
+  // Collectors are called at export time, for metrics which are cheaper to
+  // compute on demand than to keep up to date.
+  void RegisterCollector(const std::string &name,
+                         std::function<json::json()> collector) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    collectors_[name] = std::move(collector);
+  }
+
+  void UnregisterCollector(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    collectors_.erase(name);
+  }
+
+  json::json ToJson() const {
+    json::json payload;
+    std::map<std::string, std::function<json::json()>> collectors;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      payload = {{"counters", counters_}, {"gauges", gauges_}};
+      collectors = collectors_;
+    }
+    for (const auto &collector : collectors) {
+      payload[collector.first] = collector.second();
+    }
+    return payload;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::map<std::string, std::map<std::string, int64_t>> counters_;
+  std::map<std::string, std::map<std::string, double>> gauges_;
+  std::map<std::string, std::function<json::json()>> collectors_;
+};
+
+// Tracks the fraction of time a pool of workers spends busy. Each Read
+// reports utilisation since the previous one, i.e., over the scrape interval.
+class UtilisationMeter {
+ public:
+  explicit UtilisationMeter(const size_t &num_workers)
+      : num_workers_(std::max<size_t>(num_workers, 1)),
+        busy_ns_(0),
+        last_busy_ns_(0),
+        last_read_(std::chrono::steady_clock::now()) {}
+
+  void AddBusy(const std::chrono::nanoseconds &busy) {
+    busy_ns_.fetch_add(busy.count(), std::memory_order_relaxed);
+  }
+
+  double Read() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto now = std::chrono::steady_clock::now();
+    const auto busy_ns = busy_ns_.load(std::memory_order_relaxed);
+    const auto elapsed_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_read_)
+            .count();
+    const auto busy = static_cast<double>(busy_ns - last_busy_ns_);
+    last_busy_ns_ = busy_ns;
+    last_read_ = now;
+    if (elapsed_ns <= 0) {
+      return 0.0;
+    }
+    return std::min(1.0, busy / (static_cast<double>(elapsed_ns) *
+                                 static_cast<double>(num_workers_)));
+  }
+
+ private:
+  const size_t num_workers_;
+  std::atomic<int64_t> busy_ns_;
+  std::mutex mutex_;
+  int64_t last_busy_ns_;
+  std::chrono::steady_clock::time_point last_read_;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__METRICS_H_
@@ -6,10 +6,23 @@
 #ifndef TORCH_SERVING__MODELSERVER_H_
 #define TORCH_SERVING__MODELSERVER_H_
 
+#include <algorithm>
+#include <atomic>
+#include <set>
+
 #include "extern/httplib.h"
 #include "extern/json.hpp"
 
+#include "admission_controller.h"
+#include "ensemble.h"
+#include "http_server.h"
+#include "metrics.h"
+#include "pipeline_stage.h"
+#include "request_coalescer.h"
+#include "result_cache.h"
 #include "servable_manager.h"
+#include "servable_pipeline.h"
+#include "session_store.h"
 #include "tensor_io.h"
 
 namespace json = nlohmann;
@@ -21,28 +34,133 @@ class ModelServer {
  public:
   explicit ModelServer(const size_t &model_capacity = 10,
                        const size_t &buffer = 0,
-                       const size_t &thread_pool_size = 8)
-      : servable_manager_(model_capacity, buffer),
+                       const size_t &thread_pool_size = 8,
+                       const AdmissionLimits &admission_limits = {},
+                       const SchedulerOptions &scheduler_options = {},
+                       const ServableConfig &servable_config = {},
+                       const PipelineOptions &pipeline_options = {},
+                       const ResultCacheOptions &result_cache_options = {},
+                       const ServablePipelines &pipelines = {},
+                       const SessionStoreOptions &session_options = {})
+      : servable_manager_(model_capacity, buffer, scheduler_options,
+                          servable_config, result_cache_options),
+        admission_controller_(admission_limits),
+        servable_config_(servable_config),
+        pipelines_(pipelines),
+        sessions_(session_options),
         logger_(spdlog::get("model_server")),
-        thread_pool_(std::make_shared<httplib::ThreadPool>(thread_pool_size)) {
+        thread_pool_size_(thread_pool_size),
+        decode_stage_("decode", pipeline_options.decode_threads,
+                      pipeline_options.max_decode_queued),
+        encode_stage_("encode", pipeline_options.encode_threads,
+                      pipeline_options.max_encode_queued) {
     if (!logger_) {
       logger_ = spdlog::stdout_color_mt("model_server");
     }
+    if (!pipelines_.Empty() && !HasStagedInference<ServableType>::value) {
+      throw std::invalid_argument(
+          "Pipelines need servables with Decode, Forward and Encode methods");
+    }
     logger_->info("Allocated thread pool of size " +
                   std::to_string(thread_pool_size));
+    logger_->info("Allocated " + std::to_string(scheduler_options.num_workers) +
+                  " inference workers");
+    logger_->info("Allocated " + std::to_string(decode_stage_.NumWorkers()) +
+                  " decode and " + std::to_string(encode_stage_.NumWorkers()) +
+                  " encode workers");
+    MetricsRegistry::Global().RegisterCollector("pipeline", [this] {
+      return json::json{{"decode", decode_stage_.Stats()},
+                        {"inference", servable_manager_.SchedulerStats()},
+                        {"encode", encode_stage_.Stats()}};
+    });
+    MetricsRegistry::Global().RegisterCollector(
+        "sessions", [this] { return sessions_.Stats(); });
     SetupEndpoints();
   }
 
+  // Work in flight moves from the decode stage to the inference workers,
+  // and from there to the encode stage, so each is drained before the next.
+  ~ModelServer() {
+    MetricsRegistry::Global().UnregisterCollector("pipeline");
+    MetricsRegistry::Global().UnregisterCollector("sessions");
+    decode_stage_.Shutdown();
+    servable_manager_.Shutdown();
+    encode_stage_.Shutdown();
+  }
+
   void RunServer(const std::string &host = "localhost",
                  const int &port = 8888) {
-    server_.new_task_queue = [this] { return thread_pool_.get(); };
+    // N.B., httplib takes ownership of the task queue, and shuts it down once
+    // the server stops listening.
+    server_.new_task_queue = [this] {
+      return new httplib::ThreadPool(thread_pool_size_);
+    };
     logger_->info("Listening on " + host + ":" + std::to_string(port));
     server_.listen(host.c_str(), port);
   }
 
+  // Stops listening. RunServer returns once the requests being served have
+  // been answered.
+  void Stop() { server_.stop(); }
+
  private:
+  using StagedRequest = typename ServableManager<ServableType>::StagedRequest;
+  // Serialized response bodies, shared between coalesced requests.
+  using ResponseBytes = std::shared_ptr<const std::string>;
+
+  // One request to /ensemble: the same input, run through several servables
+  // in parallel. The result is set once every forward pass has finished, or
+  // as soon as one fails.
+  struct EnsembleRequest {
+    std::vector<std::shared_ptr<StagedRequest>> requests;
+    EnsembleReduction reduction = EnsembleReduction::kNone;
+    std::vector<double> weights;
+    std::atomic<size_t> pending{0};
+    std::atomic<bool> failed{false};
+    std::shared_ptr<PipelineStage::Reservation> encode_slot;
+    std::promise<ResponseBytes> response;
+  };
+
+  // One request to /pipeline. Each stage is queued on the inference
+  // scheduler once every stage it takes outputs from has run, and the
+  // response is set once every stage has run, or as soon as one fails.
+  struct PipelineRun {
+    const ServablePipeline *pipeline = nullptr;
+    // One per stage; their outputs are kept until the whole pipeline is done.
+    std::vector<std::shared_ptr<StagedRequest>> steps;
+    // The pipeline's input, converted by the first stage's servable.
+    std::vector<torch::jit::IValue> inputs;
+    // How many of each stage's dependencies have yet to run.
+    std::unique_ptr<std::atomic<size_t>[]> waiting;
+    std::atomic<size_t> pending{0};
+    std::atomic<bool> failed{false};
+    std::shared_ptr<PipelineStage::Reservation> encode_slot;
+    std::promise<ResponseBytes> response;
+  };
+
+  struct CoalescingKey {
+    std::string servable_identifier;
+    Priority priority;
+    InputDigest digest;
+
+    bool operator==(const CoalescingKey &other) const {
+      return priority == other.priority && digest == other.digest &&
+             servable_identifier == other.servable_identifier;
+    }
+  };
+
+  struct CoalescingKeyHash {
+    size_t operator()(const CoalescingKey &key) const {
+      return static_cast<size_t>(key.digest.low) ^
+             std::hash<std::string>()(key.servable_identifier);
+    }
+  };
+
+  using Coalescer =
+      RequestCoalescer<CoalescingKey, ResponseBytes, CoalescingKeyHash>;
+
   static std::string GetHTTPMessageFromCode(const int &code) {
-    switch ((code + 1) / 100) {
+    switch (code / 100) {
       case 1:
         return "Info";
       case 2:
@@ -58,10 +176,10 @@ class ModelServer {
     }
   }
 
-  static void SetResponse(httplib::Response &response, const int &code,
-                          const std::string &description = "",
-                          const json::json &payload = json::json::object(),
-                          const std::string &detail = "") {
+  static std::string ResponseBody(
+      const int &code, const std::string &description = "",
+      const json::json &payload = json::json::object(),
+      const std::string &detail = "") {
     json::json outbound_payload = {{"code", code},
                                    {"message", GetHTTPMessageFromCode(code)}};
 
@@ -77,8 +195,606 @@ class ModelServer {
       outbound_payload["detail"] = detail;
     }
 
+    return outbound_payload.dump();
+  }
+
+  static void SetResponse(httplib::Response &response, const int &code,
+                          const std::string &description = "",
+                          const json::json &payload = json::json::object(),
+                          const std::string &detail = "") {
     response.status = code;
-    response.set_content(outbound_payload.dump(), "application/json");
+    response.set_content(ResponseBody(code, description, payload, detail),
+                         "application/json");
+  }
+
+  // Clients may bound how long they are willing to wait for a response, either
+  // with the `timeout_ms` query parameter or the X-Request-Timeout-Ms header,
+  // and choose a priority class with the `priority` query parameter or the
+  // X-Priority header.
+  static RequestContext GetRequestContext(const httplib::Request &req) {
+    RequestContext context = GetRequestTimeout(req);
+    if (req.has_param("priority")) {
+      context.priority = StringToPriority(req.get_param_value("priority"));
+    } else if (req.has_header("X-Priority")) {
+      context.priority = StringToPriority(req.get_header_value("X-Priority"));
+    }
+    return context;
+  }
+
+  static RequestContext GetRequestTimeout(const httplib::Request &req) {
+    std::string timeout;
+    if (req.has_param("timeout_ms")) {
+      timeout = req.get_param_value("timeout_ms");
+    } else if (req.has_header("X-Request-Timeout-Ms")) {
+      timeout = req.get_header_value("X-Request-Timeout-Ms");
+    } else {
+      return RequestContext();
+    }
+    char *end = nullptr;
+    auto timeout_ms = std::strtoll(timeout.c_str(), &end, 10);
+    if (timeout.empty() || *end != '\0' || timeout_ms < 0) {
+      throw std::invalid_argument(
+          "Request timeout must be a non-negative integer number of "
+          "milliseconds, got: " +
+          timeout);
+    }
+    return RequestContext::WithTimeout(std::chrono::milliseconds(timeout_ms));
+  }
+
+  // Serves a response body, which may be shared with other requests, without
+  // copying it.
+  static void SetSharedContent(httplib::Response &response,
+                               const ResponseBytes &body) {
+    response.set_header("Content-Type", "application/json");
+    response.set_content_provider(
+        body->size(), [body](uint64_t offset, uint64_t length,
+                             httplib::Out out) {
+          out(body->data() + offset, length);
+        });
+  }
+
+  // Serves a request, unless an identical one is already in flight, in which
+  // case we wait for its response instead.
+  ResponseBytes Coalesce(const std::string &servable_identifier,
+                         const std::string &body,
+                         const RequestContext &context) {
+    if (!servable_config_.Options(servable_identifier).coalesce_requests) {
+      return Serve(servable_identifier, body, context);
+    }
+    CoalescingKey key{servable_identifier, context.priority,
+                      DigestBytes(body)};
+    auto membership = coalescer_.Join(key);
+    if (!membership.leader) {
+      MetricsRegistry::Global().Increment("coalesced", servable_identifier);
+      if (auto response = Follow(key, membership, context)) {
+        return response;
+      }
+    }
+    try {
+      auto response = Serve(servable_identifier, body, context);
+      coalescer_.Complete(key, response);
+      return response;
+    } catch (const DeadlineExceededError &) {
+      // Only this request gave up, so one of its followers takes over.
+      coalescer_.Abandon(key);
+      throw;
+    } catch (const CancelledError &) {
+      coalescer_.Abandon(key);
+      throw;
+    } catch (...) {
+      coalescer_.Fail(key, std::current_exception());
+      throw;
+    }
+  }
+
+  // Waits for the leader of a coalesced request, while checking this
+  // request's own deadline and client. Returns null if the leader gave up,
+  // and this request was elected to lead in its place.
+  ResponseBytes Follow(const CoalescingKey &key,
+                       typename Coalescer::Membership &membership,
+                       const RequestContext &context) {
+    try {
+      while (membership.future.wait_until(std::min(
+                 RequestContext::Clock::now() + RequestContext::PollInterval(),
+                 context.deadline)) != std::future_status::ready) {
+        context.CheckCancelled(key.servable_identifier);
+        context.CheckDeadline(key.servable_identifier);
+        if (coalescer_.TakeOver(key, membership)) {
+          return nullptr;
+        }
+      }
+    } catch (...) {
+      coalescer_.Leave(key, membership);
+      throw;
+    }
+    coalescer_.Leave(key, membership);
+    return membership.future.get();
+  }
+
+  ResponseBytes Serve(const std::string &servable_identifier,
+                      const std::string &body, const RequestContext &context) {
+    // Step 1: Reserve an in-flight slot for this servable, or shed the
+    // request if we're already past our limits.
+    auto ticket = admission_controller_.Admit(servable_identifier, context);
+
+    // Step 2: Parse the JSON, run it through the model (identified by the
+    // servable_identifier) and serialize the result, each on its own stage.
+    // The stages hand the request on to each other, so the only wait is for
+    // the response.
+    auto response = RunPipeline(servable_identifier, body, context);
+    return response.get();
+  }
+
+  // Runs a request through the decode stage, the inference scheduler and the
+  // encode stage, resolving to the serialized response body. Throws an
+  // OverloadedError if the decode stage is full. A slot on the encode stage
+  // is reserved before the forward pass, so a full encode stage sheds the
+  // request before any inference is spent on it.
+  //
+  // N.B., `body` is not copied, so must outlive the returned future.
+  std::future<ResponseBytes> RunPipeline(const std::string &servable_identifier,
+                                         const std::string &body,
+                                         const RequestContext &context) {
+    auto request = std::make_shared<StagedRequest>();
+    request->servable_identifier = servable_identifier;
+    request->context = context;
+    auto response = std::make_shared<std::promise<ResponseBytes>>();
+    decode_stage_.Submit(
+        [this, request, &body, response] { Decode(request, body, response); });
+    return response->get_future();
+  }
+
+  // Runs on the decode stage.
+  void Decode(std::shared_ptr<StagedRequest> request, const std::string &body,
+              std::shared_ptr<std::promise<ResponseBytes>> response) {
+    try {
+      request->input = json::json::parse(body);
+      servable_manager_.Decode(*request);
+      if (request->result) {
+        // Served from the result cache.
+        response->set_value(std::make_shared<const std::string>(
+            ResponseBody(200, "Success", *request->result)));
+        return;
+      }
+      auto encode_slot = encode_stage_.Reserve();
+      servable_manager_.AsyncForward(
+          request,
+          [this, request, encode_slot, response] {
+            Encode(request, *encode_slot, response);
+          },
+          [response](std::exception_ptr reason) {
+            response->set_exception(reason);
+          });
+    } catch (...) {
+      response->set_exception(std::current_exception());
+    }
+  }
+
+  // Runs on the inference worker once the forward pass is done, and hands
+  // the output over to the encode stage, in the slot reserved for it.
+  void Encode(std::shared_ptr<StagedRequest> request,
+              PipelineStage::Reservation &encode_slot,
+              std::shared_ptr<std::promise<ResponseBytes>> response) {
+    try {
+      encode_stage_.Submit(encode_slot, [this, request, response] {
+        try {
+          servable_manager_.Encode(*request);
+          response->set_value(std::make_shared<const std::string>(
+              ResponseBody(200, "Success", *request->result)));
+        } catch (...) {
+          response->set_exception(std::current_exception());
+        }
+      });
+    } catch (...) {
+      response->set_exception(std::current_exception());
+    }
+  }
+
+  // Serves the next request of a session: its input is converted on the
+  // decode stage, and the session's state is passed to the forward pass as
+  // the last argument. The servable returns an (output, state) tuple, whose
+  // state is kept for the session's next request and whose output is
+  // encoded as usual.
+  ResponseBytes ServeSession(const std::string &session_id,
+                             const std::string &body,
+                             const RequestContext &context) {
+    auto session = sessions_.Take(session_id);
+    AdmissionController::Ticket ticket;
+    std::future<ResponseBytes> response;
+    try {
+      ticket = admission_controller_.Admit(session.servable_identifier,
+                                           context);
+      auto request = std::make_shared<StagedRequest>();
+      request->servable_identifier = session.servable_identifier;
+      request->context = context;
+      auto promise = std::make_shared<std::promise<ResponseBytes>>();
+      response = promise->get_future();
+      decode_stage_.Submit([this, request, session_id,
+                            state = std::move(session.state), &body,
+                            promise]() mutable {
+        DecodeSession(request, session_id, std::move(state), body, promise);
+      });
+    } catch (...) {
+      sessions_.Release(session_id);
+      throw;
+    }
+    return response.get();
+  }
+
+  // Runs on the decode stage. From here on, the session is given back by
+  // FinishSession, or released if the request fails first.
+  void DecodeSession(std::shared_ptr<StagedRequest> request,
+                     const std::string &session_id, torch::jit::IValue state,
+                     const std::string &body,
+                     std::shared_ptr<std::promise<ResponseBytes>> response) {
+    try {
+      request->input = json::json::parse(body);
+      auto encode_slot = encode_stage_.Reserve();
+      servable_manager_.AsyncLoad(
+          request,
+          [this, request, session_id, state, encode_slot, response] {
+            ForwardSession(request, session_id, state, encode_slot, response);
+          },
+          [this, session_id, response](std::exception_ptr reason) {
+            sessions_.Release(session_id);
+            response->set_exception(reason);
+          });
+    } catch (...) {
+      sessions_.Release(session_id);
+      response->set_exception(std::current_exception());
+    }
+  }
+
+  // Runs once the session's servable is loaded and its input converted.
+  void ForwardSession(
+      std::shared_ptr<StagedRequest> request, const std::string &session_id,
+      const torch::jit::IValue &state,
+      std::shared_ptr<PipelineStage::Reservation> encode_slot,
+      std::shared_ptr<std::promise<ResponseBytes>> response) {
+    try {
+      request->inputs.push_back(state);
+      servable_manager_.AsyncForward(
+          request,
+          [this, request, session_id, encode_slot, response] {
+            FinishSession(request, session_id, *encode_slot, response);
+          },
+          [this, session_id, response](std::exception_ptr reason) {
+            sessions_.Release(session_id);
+            response->set_exception(reason);
+          });
+    } catch (...) {
+      sessions_.Release(session_id);
+      response->set_exception(std::current_exception());
+    }
+  }
+
+  // Runs on the inference worker once the forward pass is done.
+  void FinishSession(std::shared_ptr<StagedRequest> request,
+                     const std::string &session_id,
+                     PipelineStage::Reservation &encode_slot,
+                     std::shared_ptr<std::promise<ResponseBytes>> response) {
+    try {
+      if (!request->output.isTuple() ||
+          request->output.toTuple()->elements().size() != 2) {
+        throw SessionStateError("Servable `" + request->servable_identifier +
+                                "` must return an (output, state) tuple");
+      }
+      auto tuple = request->output.toTuple();
+      const auto &elements = tuple->elements();
+      request->output = elements[0];
+      sessions_.Return(session_id, elements[1]);
+    } catch (...) {
+      sessions_.Release(session_id);
+      response->set_exception(std::current_exception());
+      return;
+    }
+    Encode(request, encode_slot, response);
+  }
+
+  // Runs an ensemble through the decode stage, which converts the input once,
+  // forwards it through each servable in parallel on the inference scheduler,
+  // and combines their results on the encode stage.
+  //
+  // N.B., `body` is not copied, so must outlive the returned future.
+  std::future<ResponseBytes> RunEnsemble(
+      std::shared_ptr<EnsembleRequest> ensemble, const std::string &body) {
+    auto response = ensemble->response.get_future();
+    decode_stage_.Submit(
+        [this, ensemble, &body] { DecodeEnsemble(ensemble, body); });
+    return response;
+  }
+
+  // Runs on the decode stage.
+  void DecodeEnsemble(std::shared_ptr<EnsembleRequest> ensemble,
+                      const std::string &body) {
+    // Held until every forward pass has been queued, so the ensemble can't
+    // finish early.
+    ensemble->pending = 1;
+    try {
+      servable_manager_.Decode(json::json::parse(body), ensemble->requests);
+      ensemble->encode_slot = encode_stage_.Reserve();
+      for (auto &request : ensemble->requests) {
+        if (request->result) {
+          // Served from the result cache.
+          continue;
+        }
+        ensemble->pending.fetch_add(1);
+        try {
+          servable_manager_.AsyncForward(
+              request, [this, ensemble] { FinishEnsemble(ensemble); },
+              [this, ensemble](std::exception_ptr reason) {
+                FailEnsemble(*ensemble, reason);
+                FinishEnsemble(ensemble);
+              });
+        } catch (...) {
+          ensemble->pending.fetch_sub(1);
+          throw;
+        }
+      }
+    } catch (...) {
+      FailEnsemble(*ensemble, std::current_exception());
+    }
+    FinishEnsemble(ensemble);
+  }
+
+  // Fails the ensemble, and cancels the forward passes which haven't run
+  // yet, since their results would be thrown away.
+  static void FailEnsemble(EnsembleRequest &ensemble,
+                           std::exception_ptr reason) {
+    if (!ensemble.failed.exchange(true)) {
+      ensemble.response.set_exception(reason);
+      // Every request in the ensemble shares one cancellation token.
+      ensemble.requests.front()->context.cancellation.Cancel();
+    }
+  }
+
+  // Called as each forward pass finishes. The last one hands the outputs
+  // over to the encode stage.
+  void FinishEnsemble(std::shared_ptr<EnsembleRequest> ensemble) {
+    if (ensemble->pending.fetch_sub(1) != 1 || ensemble->failed) {
+      return;
+    }
+    try {
+      encode_stage_.Submit(*ensemble->encode_slot, [this, ensemble] {
+        try {
+          json::json results = json::json::object();
+          std::vector<const json::json *> reduced;
+          for (auto &request : ensemble->requests) {
+            if (!request->result) {
+              servable_manager_.Encode(*request);
+            }
+            results[request->servable_identifier] = *request->result;
+            reduced.push_back(request->result.get());
+          }
+          json::json payload = {{"results", std::move(results)}};
+          if (ensemble->reduction != EnsembleReduction::kNone) {
+            payload["reduced"] =
+                ReduceResults(reduced, ensemble->reduction, ensemble->weights);
+          }
+          ensemble->response.set_value(std::make_shared<const std::string>(
+              ResponseBody(200, "Success", payload)));
+        } catch (...) {
+          FailEnsemble(*ensemble, std::current_exception());
+        }
+      });
+    } catch (...) {
+      FailEnsemble(*ensemble, std::current_exception());
+    }
+  }
+
+  // Runs a ServablePipeline, whose stages pass their outputs to each other
+  // as IValues. Only the pipeline's input and output are converted, on the
+  // decode and encode stages.
+  //
+  // N.B., `body` is not copied, so must outlive the returned future.
+  std::future<ResponseBytes> RunServablePipeline(
+      const ServablePipeline &pipeline, const RequestContext &context,
+      const std::string &body) {
+    auto run = std::make_shared<PipelineRun>();
+    run->pipeline = &pipeline;
+    const auto &steps = pipeline.Steps();
+    run->waiting.reset(new std::atomic<size_t>[steps.size()]);
+    for (size_t i = 0; i < steps.size(); ++i) {
+      auto request = std::make_shared<StagedRequest>();
+      request->servable_identifier = steps[i].servable_identifier;
+      request->context = context;
+      run->steps.push_back(std::move(request));
+      run->waiting[i] = steps[i].dependencies.size();
+    }
+    run->pending = steps.size();
+    auto response = run->response.get_future();
+    decode_stage_.Submit([this, run, &body] {
+      try {
+        run->steps.front()->input = json::json::parse(body);
+        run->encode_slot = encode_stage_.Reserve();
+        // The other stages' servables are loaded as their forward passes
+        // are queued, on their own inference workers.
+        servable_manager_.AsyncLoad(
+            run->steps.front(), [this, run] { StartServablePipeline(run); },
+            [run](std::exception_ptr reason) {
+              FailServablePipeline(*run, reason);
+            });
+      } catch (...) {
+        FailServablePipeline(*run, std::current_exception());
+      }
+    });
+    return response;
+  }
+
+  // Runs once the pipeline's input has been converted by the first stage's
+  // servable, and queues every stage which only takes that input.
+  void StartServablePipeline(std::shared_ptr<PipelineRun> run) {
+    run->inputs = std::move(run->steps.front()->inputs);
+    for (size_t i = 0; i < run->steps.size(); ++i) {
+      if (run->pipeline->Steps()[i].dependencies.empty()) {
+        ForwardStep(run, i);
+      }
+    }
+  }
+
+  // Wires the outputs of a stage's dependencies into its inputs and queues
+  // its forward pass.
+  void ForwardStep(std::shared_ptr<PipelineRun> run, const size_t &index) {
+    try {
+      std::vector<const torch::jit::IValue *> outputs;
+      for (const auto &step : run->steps) {
+        outputs.push_back(&step->output);
+      }
+      auto &request = *run->steps[index];
+      request.inputs.clear();
+      for (const auto &reference : run->pipeline->Steps()[index].inputs) {
+        AppendReferencedValues(reference, run->inputs, outputs,
+                               request.inputs);
+      }
+      servable_manager_.AsyncForward(
+          run->steps[index], [this, run, index] { FinishStep(run, index); },
+          [run](std::exception_ptr reason) {
+            FailServablePipeline(*run, reason);
+          });
+    } catch (...) {
+      FailServablePipeline(*run, std::current_exception());
+    }
+  }
+
+  // Runs on the inference worker once a stage's forward pass is done.
+  void FinishStep(std::shared_ptr<PipelineRun> run, const size_t &index) {
+    if (run->failed) {
+      return;
+    }
+    for (auto dependent : run->pipeline->Steps()[index].dependents) {
+      if (run->waiting[dependent].fetch_sub(1) == 1) {
+        ForwardStep(run, dependent);
+      }
+    }
+    if (run->pending.fetch_sub(1) != 1) {
+      return;
+    }
+    try {
+      encode_stage_.Submit(*run->encode_slot, [this, run] {
+        try {
+          auto &output = *run->steps[run->pipeline->Output()];
+          servable_manager_.Encode(output);
+          run->response.set_value(std::make_shared<const std::string>(
+              ResponseBody(200, "Success", *output.result)));
+        } catch (...) {
+          FailServablePipeline(*run, std::current_exception());
+        }
+      });
+    } catch (...) {
+      FailServablePipeline(*run, std::current_exception());
+    }
+  }
+
+  static void FailServablePipeline(PipelineRun &run,
+                                   std::exception_ptr reason) {
+    if (!run.failed.exchange(true)) {
+      run.response.set_exception(reason);
+    }
+  }
+
+  // Reads the servables and reduction of an /ensemble request.
+  static std::shared_ptr<EnsembleRequest> GetEnsembleRequest(
+      const httplib::Request &req, const RequestContext &context) {
+    auto ensemble = std::make_shared<EnsembleRequest>();
+    auto servable_identifiers = req.params.equal_range("servable_identifier");
+    std::set<std::string> seen;
+    for (auto param = servable_identifiers.first;
+         param != servable_identifiers.second; ++param) {
+      if (!seen.insert(param->second).second) {
+        throw std::invalid_argument("Servable `" + param->second +
+                                    "` is passed in more than once");
+      }
+      auto request = std::make_shared<StagedRequest>();
+      request->servable_identifier = param->second;
+      request->context = context;
+      ensemble->requests.push_back(std::move(request));
+    }
+    if (ensemble->requests.empty()) {
+      throw std::invalid_argument(
+          "Missing required parameter `servable_identifier`");
+    }
+    if (req.has_param("reduction")) {
+      ensemble->reduction =
+          StringToEnsembleReduction(req.get_param_value("reduction"));
+    }
+    if (ensemble->reduction == EnsembleReduction::kWeightedSum) {
+      if (!req.has_param("weights")) {
+        throw std::invalid_argument(
+            "Missing required parameter `weights` for `weighted_sum`");
+      }
+      ensemble->weights = ParseEnsembleWeights(req.get_param_value("weights"));
+      if (ensemble->weights.size() != ensemble->requests.size()) {
+        throw std::invalid_argument(
+            "Expected one weight per servable, got " +
+            std::to_string(ensemble->weights.size()) + " weights for " +
+            std::to_string(ensemble->requests.size()) + " servables");
+      }
+    }
+    return ensemble;
+  }
+
+  // Reads the request options shared by /serve and /ensemble.
+  static RequestContext GetCancellableRequestContext(
+      const httplib::Request &req) {
+    RequestContext context = GetRequestContext(req);
+    // Abandon queued work once the client hangs up.
+    auto connection = HTTPServer::CurrentConnection();
+    context.cancellation = CancellationToken(
+        [connection] { return !HTTPServer::IsConnected(connection); });
+    return context;
+  }
+
+  // Runs `handler`, which sets a successful response, mapping whatever it
+  // throws to an error response.
+  template <typename Handler>
+  void HandleInference(httplib::Response &res, Handler handler) {
+    try {
+      handler();
+    } catch (const json::json::parse_error &err) {
+      SetResponse(res, 400, "Invalid JSON", err.what());
+    } catch (const ServableConfigError &err) {
+      logger_->error(err.what());
+      SetResponse(res, 500, "Invalid servable config", json::json::object(),
+                  err.what());
+    } catch (const std::invalid_argument &err) {
+      SetResponse(res, 400, "Invalid servable identifier");
+    } catch (const DeadlineExceededError &err) {
+      SetResponse(res, 504, "Deadline exceeded", json::json::object(),
+                  err.what());
+    } catch (const CancelledError &err) {
+      SetResponse(res, 499, "Client closed request", json::json::object(),
+                  err.what());
+    } catch (const OverloadedError &err) {
+      const auto &limits = admission_controller_.Limits();
+      res.set_header("Retry-After", std::to_string(limits.retry_after_seconds));
+      SetResponse(res, 503, "Server overloaded", json::json::object(),
+                  err.what());
+    } catch (const TensorIOError &err) {
+      SetResponse(res, 400, "Invalid Input JSON", err.what());
+    } catch (const TensorShapeError &err) {
+      SetResponse(res, 400, "Incompatible tensor shapes", err.what());
+    } catch (const TensorTypeError &err) {
+      SetResponse(res, 400, "Incompatible tensor data type", err.what());
+    } catch (const EnsembleError &err) {
+      SetResponse(res, 400, "Incompatible ensemble results",
+                  json::json::object(), err.what());
+    } catch (const UnknownSessionError &err) {
+      SetResponse(res, 404, "Unknown session", json::json::object(),
+                  err.what());
+    } catch (const SessionBusyError &err) {
+      SetResponse(res, 409, "Session busy", json::json::object(), err.what());
+    } catch (const SessionStateError &err) {
+      logger_->error(err.what());
+      SetResponse(res, 500, "Invalid session state", json::json::object(),
+                  err.what());
+    } catch (const PipelineError &err) {
+      logger_->error(err.what());
+      SetResponse(res, 500, "Incompatible pipeline stages",
+                  json::json::object(), err.what());
+    } catch (const std::exception &err) {
+      logger_->error(err.what());
+      SetResponse(res, 500, "Unexpected server error", err.what());
+    }
   }
 
   void SetupEndpoints() {
@@ -87,6 +803,12 @@ class ModelServer {
                 [&](const httplib::Request &req, httplib::Response &res) {
                   SetResponse(res, 200, "OK");
                 });
+    // Receives GET /metrics requests
+    server_.Get("/metrics",
+                [&](const httplib::Request &req, httplib::Response &res) {
+                  SetResponse(res, 200, "OK",
+                               MetricsRegistry::Global().ToJson());
+                });
     // Receives POST /serve requests
     server_.Post("/serve", [&](const httplib::Request &req,
                                httplib::Response &res) {
@@ -103,53 +825,181 @@ class ModelServer {
       }
       auto servable_identifier = req.params.find("servable_identifier")->second;
 
+      RequestContext context;
+      try {
+        context = GetCancellableRequestContext(req);
+      } catch (const std::invalid_argument &err) {
+        SetResponse(res, 400, "Invalid request options", json::json::object(),
+                    err.what());
+        return;
+      }
+
       // First, just make sure we sent *something* over the wire.
       if (req.body.empty()) {
         SetResponse(res, 400, "Empty body");
         return;
-      } else {
-        // Step 1: Parse the JSON
-        json::json payload;
-        try {
-          payload = json::json::parse(req.body);
-        } catch (const std::exception &err) {
-          SetResponse(res, 400, "Invalid JSON", err.what());
-          return;
+      }
+      HandleInference(res, [&] {
+        auto response = Coalesce(servable_identifier, req.body, context);
+        res.status = 200;
+        SetSharedContent(res, response);
+      });
+    });
+    // Receives POST /ensemble requests, which run one input through several
+    // servables (each passed as a `servable_identifier` parameter).
+    server_.Post("/ensemble", [&](const httplib::Request &req,
+                                  httplib::Response &res) {
+      RequestContext context;
+      std::shared_ptr<EnsembleRequest> ensemble;
+      try {
+        context = GetCancellableRequestContext(req);
+        ensemble = GetEnsembleRequest(req, context);
+      } catch (const std::invalid_argument &err) {
+        SetResponse(res, 400, "Invalid request options", json::json::object(),
+                    err.what());
+        return;
+      }
+      if (req.body.empty()) {
+        SetResponse(res, 400, "Empty body");
+        return;
+      }
+      HandleInference(res, [&] {
+        // Every servable in the ensemble takes an in-flight slot.
+        std::vector<std::string> servable_identifiers;
+        for (const auto &request : ensemble->requests) {
+          servable_identifiers.push_back(request->servable_identifier);
         }
+        auto tickets =
+            admission_controller_.AdmitAll(servable_identifiers, context);
+        auto response = RunEnsemble(ensemble, req.body);
+        res.status = 200;
+        SetSharedContent(res, response.get());
+      });
+    });
 
-        // Step 2: Run the inputs through the model (identified by the
-        // servable_identifier) in a future.
-        std::future<json::json> async_inference_response;
-        try {
-          async_inference_response = servable_manager_.AsyncInferenceRequest(
-              servable_identifier, payload, 0.0, std::launch::async);
-        } catch (const std::exception &err) {
-          SetResponse(res, 500, "Unexpected server error", err.what());
-          return;
+    // Receives POST /pipeline requests, which run the input through the
+    // servables of a pipeline from the pipeline config.
+    server_.Post("/pipeline", [&](const httplib::Request &req,
+                                  httplib::Response &res) {
+      if (!req.has_param("pipeline_identifier")) {
+        SetResponse(res, 400,
+                    "Missing required parameter `pipeline_identifier`");
+        return;
+      }
+      const auto pipeline_identifier =
+          req.get_param_value("pipeline_identifier");
+      const auto *pipeline = pipelines_.Find(pipeline_identifier);
+      if (!pipeline) {
+        SetResponse(res, 404, "Unknown pipeline", json::json::object(),
+                    pipeline_identifier);
+        return;
+      }
+      RequestContext context;
+      try {
+        context = GetCancellableRequestContext(req);
+      } catch (const std::invalid_argument &err) {
+        SetResponse(res, 400, "Invalid request options", json::json::object(),
+                    err.what());
+        return;
+      }
+      if (req.body.empty()) {
+        SetResponse(res, 400, "Empty body");
+        return;
+      }
+      HandleInference(res, [&] {
+        // Every servable in the pipeline takes an in-flight slot, once,
+        // however many of its stages use it.
+        std::vector<std::string> servable_identifiers;
+        for (const auto &step : pipeline->Steps()) {
+          servable_identifiers.push_back(step.servable_identifier);
         }
+        auto tickets =
+            admission_controller_.AdmitAll(servable_identifiers, context);
+        auto response = RunServablePipeline(*pipeline, context, req.body);
+        res.status = 200;
+        SetSharedContent(res, response.get());
+      });
+    });
 
-        // Step 3: Wait for the future to be done, and set the result
-        try {
-          async_inference_response.wait();
-          SetResponse(res, 200, "Success", async_inference_response.get());
-        } catch (const std::invalid_argument &err) {
-          SetResponse(res, 400, "Invalid servable identifier");
-          return;
-        } catch (const TensorIOError &err) {
-          SetResponse(res, 400, "Invalid Input JSON", err.what());
-          return;
-        } catch (const TensorShapeError &err) {
-          SetResponse(res, 400, "Incompatible tensor shapes", err.what());
-          return;
-        } catch (const TensorTypeError &err) {
-          SetResponse(res, 400, "Incompatible tensor data type", err.what());
-          return;
-        } catch (const std::exception &err) {
-          logger_->error(err.what());
-          SetResponse(res, 500, "Unexpected server error", err.what());
-          return;
-        }
+    // Receives POST /sessions requests, which create a session for a
+    // servable, and DELETE /sessions requests, which end one.
+    server_.Post("/sessions", [&](const httplib::Request &req,
+                                  httplib::Response &res) {
+      if (!HasStagedInference<ServableType>::value) {
+        SetResponse(res, 501, "Sessions need staged servables");
+        return;
+      }
+      if (!req.has_param("servable_identifier")) {
+        SetResponse(res, 400,
+                    "Missing required parameter `servable_identifier`");
+        return;
+      }
+      const auto servable_identifier =
+          req.get_param_value("servable_identifier");
+      // Shape buckets would pad the state, or put the attention mask after
+      // it, where the servable expects the state to be last.
+      if (servable_config_.Options(servable_identifier)
+              .raw.contains("shape_buckets")) {
+        SetResponse(res, 400, "Sessions can't use shape buckets",
+                    json::json::object(), servable_identifier);
+        return;
+      }
+      HandleInference(res, [&] {
+        auto request = std::make_shared<StagedRequest>();
+        request->servable_identifier = servable_identifier;
+        // Loads the servable, so unknown ones are rejected up front.
+        auto loaded = std::make_shared<std::promise<void>>();
+        servable_manager_.AsyncLoad(
+            request, [loaded] { loaded->set_value(); },
+            [loaded](std::exception_ptr reason) {
+              loaded->set_exception(reason);
+            });
+        loaded->get_future().get();
+        SetResponse(
+            res, 200, "Session created",
+            {{"session_id", sessions_.Create(request->servable_identifier)}});
+      });
+    });
+    server_.Delete("/sessions", [&](const httplib::Request &req,
+                                    httplib::Response &res) {
+      if (!req.has_param("session_id")) {
+        SetResponse(res, 400, "Missing required parameter `session_id`");
+        return;
+      }
+      const auto session_id = req.get_param_value("session_id");
+      if (!sessions_.Erase(session_id)) {
+        SetResponse(res, 404, "Unknown session", json::json::object(),
+                    session_id);
+        return;
+      }
+      SetResponse(res, 200, "Session deleted");
+    });
+    // Receives POST /sessions/serve requests, which run the next input of a
+    // session through its servable.
+    server_.Post("/sessions/serve", [&](const httplib::Request &req,
+                                        httplib::Response &res) {
+      if (!req.has_param("session_id")) {
+        SetResponse(res, 400, "Missing required parameter `session_id`");
+        return;
+      }
+      RequestContext context;
+      try {
+        context = GetCancellableRequestContext(req);
+      } catch (const std::invalid_argument &err) {
+        SetResponse(res, 400, "Invalid request options", json::json::object(),
+                    err.what());
+        return;
+      }
+      if (req.body.empty()) {
+        SetResponse(res, 400, "Empty body");
+        return;
       }
+      HandleInference(res, [&] {
+        auto response =
+            ServeSession(req.get_param_value("session_id"), req.body, context);
+        res.status = 200;
+        SetSharedContent(res, response);
+      });
     });
 
     server_.set_logger([this](const httplib::Request &req,
@@ -157,7 +1007,7 @@ class ModelServer {
       auto msg = "Request: [" + req.method + " " + req.version + " " +
                  req.path + "] => Response: [" + std::to_string(res.status) +
                  " " + GetHTTPMessageFromCode(res.status) + "]";
-      switch ((res.status + 1) / 100) {
+      switch (res.status / 100) {
         case 3:
           logger_->warn(msg);
           break;
@@ -173,10 +1023,18 @@ class ModelServer {
     });
   }
 
-  httplib::Server server_;
+  HTTPServer server_;
   ServableManager<ServableType> servable_manager_;
+  AdmissionController admission_controller_;
+  ServableConfig servable_config_;
+  ServablePipelines pipelines_;
+  SessionStore sessions_;
+  Coalescer coalescer_;
   std::shared_ptr<spdlog::logger> logger_;
-  std::shared_ptr<httplib::ThreadPool> thread_pool_;
+  size_t thread_pool_size_;
+  // Shut down by ~ModelServer, in the order requests pass through them.
+  PipelineStage decode_stage_;
+  PipelineStage encode_stage_;
 };
 
 }  // namespace torch_serving
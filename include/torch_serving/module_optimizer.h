@@ -0,0 +1,70 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__MODULE_OPTIMIZER_H_
+#define TORCH_SERVING__MODULE_OPTIMIZER_H_
+
+#include <torch/script.h>
+
+#include <string>
+
+#include "extern/json.hpp"
+#include "quantization.h"
+#include "servable_config.h"
+
+namespace json = nlohmann;
+
+namespace torch_serving {
+
+// Optional rewrites of a TorchScript module at load time, read from a
+// servable's options in the ServableConfig.
+struct ModuleOptimizationOptions {
+  // Inline parameters and attributes into the graph as constants, fold them,
+  // and drop code paths which only run in training.
+  bool freeze = false;
+  // Also fuse ops for inference, e.g., conv with batch norm and linear layers
+  // with their activations. Implies freeze.
+  bool optimize_for_inference = false;
+  // Quantize linear layers' weights to int8, and their activations on the
+  // fly, i.e., `"quantize": "dynamic_int8"`. Implies freeze. See
+  // QuantizeDynamicInt8.
+  bool quantize_dynamic_int8 = false;
+
+  static ModuleOptimizationOptions FromJson(const json::json &options);
+
+  bool Enabled() const {
+    return freeze || optimize_for_inference || quantize_dynamic_int8;
+  }
+};
+
+// How far a model's output strays from a reference output, e.g., the output
+// of the same model before it was quantized, over every tensor in them.
+struct OutputDifference {
+  double max_abs_diff = 0.0;
+  // Relative to the largest value in the reference.
+  double max_rel_diff = 0.0;
+
+  std::string ToString() const;
+};
+
+// Throws std::invalid_argument if the outputs have different structures.
+OutputDifference CompareOutputs(const torch::jit::IValue &reference,
+                                const torch::jit::IValue &output);
+
+// The number of ops in a module's forward, with calls to submodules inlined
+// and constants left out.
+size_t CountGraphOps(const torch::jit::script::Module &module);
+
+// Returns a frozen (and maybe quantized and optimized) copy of an eval mode
+// module, reporting what was quantized in `quantization`, if given. Throws if
+// libtorch is too old to freeze modules, or the module can't be frozen.
+torch::jit::script::Module OptimizeModule(
+    const torch::jit::script::Module &module,
+    const ModuleOptimizationOptions &options,
+    QuantizationReport *quantization = nullptr);
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__MODULE_OPTIMIZER_H_
@@ -0,0 +1,47 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__NUMA_H_
+#define TORCH_SERVING__NUMA_H_
+
+#include <string>
+#include <vector>
+
+namespace torch_serving {
+
+struct NumaNode {
+  int id;
+  // CPUs on this node which the process is allowed to run on.
+  std::vector<int> cpus;
+};
+
+// The NUMA nodes of this machine which have usable CPUs, read from sysfs. On
+// machines without NUMA support this is a single node holding every CPU.
+std::vector<NumaNode> NumaTopology();
+
+// As above, reading the node directories under `node_root` (e.g.,
+// /sys/devices/system/node) and keeping only the `allowed_cpus`.
+std::vector<NumaNode> NumaTopology(const std::string &node_root,
+                                   const std::vector<int> &allowed_cpus);
+
+// Parses a sysfs cpulist, e.g. "0-3,8-11".
+std::vector<int> ParseCpuList(const std::string &cpu_list);
+
+// Restricts the calling thread to `cpus`. Returns false on failure.
+bool PinCurrentThread(const std::vector<int> &cpus);
+
+// Binds (and migrates) the pages lying wholly within [address, address +
+// length) to `node`, using mbind(2) directly so we don't depend on libnuma.
+// Pages only partly in the range are left alone, since migrating them would
+// also move whatever else shares them. Returns the number of bytes bound,
+// which is zero on failure, e.g. on kernels without NUMA support.
+size_t BindMemoryToNode(const void *address, const size_t &length,
+                        const int &node);
+
+std::string CpusToString(const std::vector<int> &cpus);
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__NUMA_H_
@@ -0,0 +1,155 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__PIPELINE_STAGE_H_
+#define TORCH_SERVING__PIPELINE_STAGE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "extern/httplib.h"
+#include "admission_controller.h"
+#include "metrics.h"
+
+namespace torch_serving {
+
+// Sizes of the conversion stages either side of inference. Zero queue limits
+// mean unbounded.
+struct PipelineOptions {
+  // Parses request bodies and converts them to model inputs.
+  size_t decode_threads = 2;
+  size_t max_decode_queued = 1024;
+  // Converts model outputs to JSON and serializes response bodies.
+  size_t encode_threads = 2;
+  size_t max_encode_queued = 1024;
+};
+
+// One stage of the request pipeline: a pool of workers behind a bounded
+// queue. Submitting to a full stage throws an OverloadedError, so a stage
+// which falls behind sheds load instead of buffering it. Work must not throw.
+class PipelineStage {
+ public:
+  using Work = std::function<void()>;
+
+  PipelineStage(std::string name, const size_t &num_workers,
+                const size_t &max_queued = 0)
+      : name_(std::move(name)),
+        max_queued_(max_queued),
+        num_workers_(std::max<size_t>(num_workers, 1)),
+        queued_(0),
+        executed_(0),
+        rejected_(0),
+        shutdown_(false),
+        utilisation_(num_workers_),
+        pool_(num_workers_) {}
+
+  PipelineStage(const PipelineStage &) = delete;
+  PipelineStage &operator=(const PipelineStage &) = delete;
+
+  ~PipelineStage() { Shutdown(); }
+
+  // A slot in the stage's queue, taken ahead of the work which will fill it.
+  // It's given back if the reservation is dropped unused.
+  class Reservation {
+   public:
+    Reservation(const Reservation &) = delete;
+    Reservation &operator=(const Reservation &) = delete;
+
+    ~Reservation() {
+      if (stage_) {
+        stage_->queued_.fetch_sub(1);
+      }
+    }
+
+   private:
+    friend class PipelineStage;
+    explicit Reservation(PipelineStage *stage) : stage_(stage) {}
+
+    PipelineStage *stage_;
+  };
+
+  void Submit(Work work) {
+    Acquire();
+    Enqueue(std::move(work));
+  }
+
+  // Takes a slot for work which is only ready later, so it's shed now if the
+  // stage is full, rather than once the work leading up to it has been done.
+  std::shared_ptr<Reservation> Reserve() {
+    Acquire();
+    return std::shared_ptr<Reservation>(new Reservation(this));
+  }
+
+  // Runs `work` in a reserved slot, which is never shed.
+  void Submit(Reservation &reservation, Work work) {
+    if (reservation.stage_ != this) {
+      throw std::logic_error("Reservation is not for the " + name_ +
+                             " stage, or was already used");
+    }
+    reservation.stage_ = nullptr;
+    Enqueue(std::move(work));
+  }
+
+  // Runs the work already queued, then joins the workers. Nothing may be
+  // submitted afterwards.
+  void Shutdown() {
+    if (!shutdown_.exchange(true)) {
+      pool_.shutdown();
+    }
+  }
+
+  const std::string &Name() const { return name_; }
+
+  size_t NumWorkers() const { return num_workers_; }
+
+  json::json Stats() {
+    return {{"workers", num_workers_},
+            {"queued", queued_.load()},
+            {"max_queued", max_queued_},
+            {"executed", executed_.load()},
+            {"rejected", rejected_.load()},
+            {"utilisation", utilisation_.Read()}};
+  }
+
+ private:
+  void Acquire() {
+    if (queued_.fetch_add(1) >= max_queued_ && max_queued_) {
+      queued_.fetch_sub(1);
+      rejected_.fetch_add(1, std::memory_order_relaxed);
+      throw OverloadedError("The " + name_ + " stage has " +
+                            std::to_string(max_queued_) + " requests queued");
+    }
+  }
+
+  void Enqueue(Work work) {
+    pool_.enqueue([this, work] {
+      queued_.fetch_sub(1);
+      const auto start = std::chrono::steady_clock::now();
+      work();
+      utilisation_.AddBusy(std::chrono::steady_clock::now() - start);
+      executed_.fetch_add(1, std::memory_order_relaxed);
+    });
+  }
+
+  std::string name_;
+  const size_t max_queued_;
+  const size_t num_workers_;
+  std::atomic<size_t> queued_;
+  std::atomic<uint64_t> executed_;
+  std::atomic<uint64_t> rejected_;
+  std::atomic<bool> shutdown_;
+  UtilisationMeter utilisation_;
+  // Declared last, so workers are joined before the counters go away.
+  httplib::ThreadPool pool_;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__PIPELINE_STAGE_H_
@@ -0,0 +1,26 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__POOLED_ALLOCATOR_H_
+#define TORCH_SERVING__POOLED_ALLOCATOR_H_
+
+#include "block_pool.h"
+
+namespace torch_serving {
+
+// Replaces libtorch's CPU allocator, for the rest of the process, with one
+// drawing from a BlockPool. Every CPU tensor allocated from then on (request
+// inputs from JsonToTorchValue, activations and outputs inside forwards)
+// reuses blocks freed by earlier requests. Tensors allocated before keep
+// their original allocator. The pool's stats are exported on /metrics under
+// `cpu_allocator`. Only the first call has any effect.
+void InstallPooledCpuAllocator(const BlockPoolOptions &options = {});
+
+// Null until InstallPooledCpuAllocator is called.
+BlockPool *PooledCpuAllocatorPool();
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__POOLED_ALLOCATOR_H_
@@ -0,0 +1,59 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__PRECISION_H_
+#define TORCH_SERVING__PRECISION_H_
+
+#include <torch/script.h>
+
+#include <string>
+#include <vector>
+
+#include "servable_config.h"
+
+namespace torch_serving {
+
+// The precision a servable runs its forward pass in.
+enum class ExecutionPrecision {
+  // As the model was saved.
+  kFp32,
+  // Weights stay as saved, and CPU autocast runs eligible ops (matmuls,
+  // convolutions, etc.) in bfloat16. Needs libtorch >= 1.10.
+  kBf16Autocast,
+  // Weights, and floating point inputs, are cast to bfloat16.
+  kBf16Weights
+};
+
+// Parses "fp32", "bf16_autocast" or "bf16_weights".
+ExecutionPrecision StringToExecutionPrecision(const std::string &precision);
+
+std::string ExecutionPrecisionToString(const ExecutionPrecision &precision);
+
+bool SupportsBf16Autocast();
+
+// Casts every floating point tensor in `value` (including those in lists,
+// tuples and dicts) to `dtype`.
+torch::jit::IValue CastFloatingTensors(const torch::jit::IValue &value,
+                                       const torch::ScalarType &dtype);
+
+// Enables CPU autocast to bfloat16 on this thread while in scope, if
+// `enabled`, restoring the previous autocast state when it leaves.
+class Bf16AutocastGuard {
+ public:
+  explicit Bf16AutocastGuard(const bool &enabled);
+  ~Bf16AutocastGuard();
+
+  Bf16AutocastGuard(const Bf16AutocastGuard &) = delete;
+  Bf16AutocastGuard &operator=(const Bf16AutocastGuard &) = delete;
+
+ private:
+  bool enabled_;
+  bool previously_enabled_ = false;
+  torch::ScalarType previous_dtype_ = torch::kBFloat16;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__PRECISION_H_
@@ -0,0 +1,52 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__QUANTIZATION_H_
+#define TORCH_SERVING__QUANTIZATION_H_
+
+#include <torch/script.h>
+
+#include <string>
+#include <vector>
+
+namespace torch_serving {
+
+struct QuantizationReport {
+  size_t quantized_linear_layers = 0;
+  // Linear layers left in fp32, because their weights aren't constant CPU
+  // float matrices.
+  size_t skipped_linear_layers = 0;
+  // LSTMs are always left in fp32 (see QuantizeDynamicInt8).
+  size_t skipped_lstms = 0;
+
+  std::string ToString() const;
+};
+
+// Applies dynamic int8 quantization to a frozen module, in place: each linear
+// layer (aten::linear with a constant weight) becomes a
+// quantized::linear_dynamic, whose weights are quantized to int8 (per output
+// channel with FBGEMM, per tensor with QNNPACK) and prepacked for the current
+// quantized engine here, once. Activations are quantized on the fly, per
+// batch. N.B., LSTMs are left in fp32, since their quantized kernels take
+// weights in a layout which isn't available from a frozen graph.
+//
+// Throws if libtorch is too old (before 1.7) to run this.
+QuantizationReport QuantizeDynamicInt8(torch::jit::script::Module &module);
+
+// The quantized engines this build of libtorch supports, e.g., "fbgemm" (x86)
+// and "qnnpack" (ARM).
+std::vector<std::string> SupportedQuantizedEngines();
+
+// Selects the process-wide engine for quantized ops. Must be called before
+// any models are quantized, since weights are prepacked for one engine. An
+// empty `engine` picks FBGEMM where it's supported, then QNNPACK, if either is.
+// Throws std::invalid_argument for unsupported engines.
+void SetQuantizedEngine(const std::string &engine = "");
+
+std::string QuantizedEngine();
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__QUANTIZATION_H_
@@ -0,0 +1,148 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__REQUEST_COALESCER_H_
+#define TORCH_SERVING__REQUEST_COALESCER_H_
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace torch_serving {
+
+// Lets concurrent, identical requests share one computation. The first
+// request for a key leads: it computes the value and must Complete, Fail or
+// Abandon its key. Requests for the same key arriving before then follow,
+// waiting on the leader's future instead of computing the value again.
+//
+// A leader which gives up for reasons of its own (e.g., its client hung up)
+// Abandons the key rather than failing its followers. The next follower to
+// call TakeOver, or the next request to Join, then leads in its place.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class RequestCoalescer {
+ public:
+  using Future = std::shared_future<Value>;
+
+  struct Membership {
+    bool leader;
+    Future future;
+    // Which group of requests for the key this one joined.
+    uint64_t group;
+  };
+
+  Membership Join(const Key &key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto group = groups_.find(key);
+    if (group != groups_.end()) {
+      if (!group->second.led) {
+        group->second.led = true;
+        return {true, group->second.future, group->second.id};
+      }
+      ++group->second.followers;
+      return {false, group->second.future, group->second.id};
+    }
+    Group created;
+    created.future = created.promise.get_future().share();
+    created.id = ++num_groups_;
+    Membership membership{true, created.future, created.id};
+    groups_.emplace(key, std::move(created));
+    return membership;
+  }
+
+  void Complete(const Key &key, Value value) {
+    auto promise = Finish(key);
+    promise.set_value(std::move(value));
+  }
+
+  void Fail(const Key &key, std::exception_ptr reason) {
+    auto promise = Finish(key);
+    promise.set_exception(reason);
+  }
+
+  // Called by a leader which won't compute the value after all. Its
+  // followers keep waiting for a new leader, if there are any.
+  void Abandon(const Key &key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto group = groups_.find(key);
+    if (group->second.followers) {
+      group->second.led = false;
+    } else {
+      groups_.erase(group);
+    }
+  }
+
+  // Called by a waiting follower, which leads from then on if its leader
+  // abandoned the key and no other follower took over first.
+  bool TakeOver(const Key &key, Membership &membership) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto group = FindGroup(key, membership);
+    if (group == groups_.end() || group->second.led) {
+      return false;
+    }
+    group->second.led = true;
+    --group->second.followers;
+    membership.leader = true;
+    return true;
+  }
+
+  // Called by a follower once it stops waiting, whether or not the value
+  // was set.
+  void Leave(const Key &key, const Membership &membership) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto group = FindGroup(key, membership);
+    if (group == groups_.end()) {
+      return;
+    }
+    if (!--group->second.followers && !group->second.led) {
+      groups_.erase(group);
+    }
+  }
+
+  size_t InFlight() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return groups_.size();
+  }
+
+ private:
+  struct Group {
+    std::promise<Value> promise;
+    Future future;
+    uint64_t id = 0;
+    bool led = true;
+    size_t followers = 0;
+  };
+  using Groups = std::unordered_map<Key, Group, Hash>;
+
+  // The group a member joined, if it's still in flight.
+  typename Groups::iterator FindGroup(const Key &key,
+                                      const Membership &membership) {
+    auto group = groups_.find(key);
+    if (group != groups_.end() && group->second.id != membership.group) {
+      return groups_.end();
+    }
+    return group;
+  }
+
+  // Requests arriving from now on start a new group.
+  std::promise<Value> Finish(const Key &key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto group = groups_.find(key);
+    auto promise = std::move(group->second.promise);
+    groups_.erase(group);
+    return promise;
+  }
+
+  std::mutex mutex_;
+  Groups groups_;
+  uint64_t num_groups_ = 0;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__REQUEST_COALESCER_H_
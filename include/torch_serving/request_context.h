@@ -0,0 +1,126 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__REQUEST_CONTEXT_H_
+#define TORCH_SERVING__REQUEST_CONTEXT_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace torch_serving {
+
+// Thrown when a request is still waiting for inference past its deadline.
+// The ModelServer turns this into a 504.
+class DeadlineExceededError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Thrown when a request is abandoned by its client before inference runs.
+class CancelledError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// A cheap, copyable handle onto a shared cancellation flag. A token may also
+// be given a probe which is polled to detect cancellation (e.g., a check for
+// whether the client socket is still open).
+class CancellationToken {
+ public:
+  CancellationToken() : state_(std::make_shared<State>()) {}
+
+  explicit CancellationToken(std::function<bool()> probe)
+      : CancellationToken() {
+    state_->probe = std::move(probe);
+  }
+
+  void Cancel() { state_->cancelled = true; }
+
+  bool IsCancelled() const {
+    if (!state_->cancelled && state_->probe && state_->probe()) {
+      state_->cancelled = true;
+    }
+    return state_->cancelled;
+  }
+
+ private:
+  struct State {
+    std::atomic<bool> cancelled{false};
+    std::function<bool()> probe;
+  };
+  std::shared_ptr<State> state_;
+};
+
+// Priority classes for inference traffic. Interactive requests are always
+// dispatched ahead of (or weighted above) queued bulk work.
+enum class Priority { kInteractive = 0, kBulk = 1 };
+
+inline Priority StringToPriority(const std::string &priority) {
+  if (priority == "interactive") {
+    return Priority::kInteractive;
+  } else if (priority == "bulk") {
+    return Priority::kBulk;
+  } else {
+    throw std::invalid_argument("Invalid priority class: " + priority +
+                                " (expected `interactive` or `bulk`)");
+  }
+}
+
+inline std::string PriorityToString(const Priority &priority) {
+  return priority == Priority::kInteractive ? "interactive" : "bulk";
+}
+
+// Per-request state which travels with an inference request from the HTTP
+// handler down to the servable.
+struct RequestContext {
+  using Clock = std::chrono::steady_clock;
+
+  // By default, requests never expire.
+  Clock::time_point deadline = Clock::time_point::max();
+  CancellationToken cancellation;
+  Priority priority = Priority::kInteractive;
+
+  // How often blocked waiters re-check the cancellation token.
+  static std::chrono::milliseconds PollInterval() {
+    return std::chrono::milliseconds(50);
+  }
+
+  // Timeouts which would run past the end of the clock mean no deadline.
+  static RequestContext WithTimeout(const std::chrono::milliseconds &timeout) {
+    RequestContext context;
+    auto now = Clock::now();
+    if (timeout < std::chrono::duration_cast<std::chrono::milliseconds>(
+                      Clock::time_point::max() - now)) {
+      context.deadline = now + timeout;
+    }
+    return context;
+  }
+
+  bool HasDeadline() const { return deadline != Clock::time_point::max(); }
+
+  bool Expired() const { return HasDeadline() && Clock::now() >= deadline; }
+
+  void CheckDeadline(const std::string &servable_identifier) const {
+    if (Expired()) {
+      throw DeadlineExceededError(
+          "Deadline exceeded before inference for servable_identifier: " +
+          servable_identifier);
+    }
+  }
+
+  void CheckCancelled(const std::string &servable_identifier) const {
+    if (cancellation.IsCancelled()) {
+      throw CancelledError(
+          "Request cancelled before inference for servable_identifier: " +
+          servable_identifier);
+    }
+  }
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__REQUEST_CONTEXT_H_
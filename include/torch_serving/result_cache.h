@@ -0,0 +1,365 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__RESULT_CACHE_H_
+#define TORCH_SERVING__RESULT_CACHE_H_
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+
+#include "extern/json.hpp"
+
+namespace json = nlohmann;
+
+namespace torch_serving {
+
+// A 128-bit digest of a request's input. It's keyed with a secret drawn
+// at random when the process starts, so clients can't craft inputs whose
+// digests collide with another client's, and be served its cached result.
+struct InputDigest {
+  uint64_t high = 0;
+  uint64_t low = 0;
+
+  bool operator==(const InputDigest &other) const {
+    return high == other.high && low == other.low;
+  }
+};
+
+namespace detail {
+
+// The key every digest in this process is computed with.
+inline const std::array<uint64_t, 2> &DigestKey() {
+  static const std::array<uint64_t, 2> key = [] {
+    std::random_device device;
+    std::array<uint64_t, 2> drawn;
+    for (auto &half : drawn) {
+      half = (static_cast<uint64_t>(device()) << 32) ^ device();
+    }
+    return drawn;
+  }();
+  return key;
+}
+
+// SipHash-2-4 with a 128-bit output, over a stream of 64-bit words.
+class DigestBuilder {
+ public:
+  DigestBuilder() : num_words_(0) {
+    const auto &key = DigestKey();
+    v0_ = key[0] ^ 0x736F6D6570736575ULL;
+    v1_ = key[1] ^ 0x646F72616E646F6DULL ^ 0xEE;
+    v2_ = key[0] ^ 0x6C7967656E657261ULL;
+    v3_ = key[1] ^ 0x7465646279746573ULL;
+  }
+
+  void Add(const uint64_t &word) {
+    v3_ ^= word;
+    Round();
+    Round();
+    v0_ ^= word;
+    ++num_words_;
+  }
+
+  void Add(const std::string &bytes) {
+    Add(static_cast<uint64_t>(bytes.size()));
+    size_t offset = 0;
+    for (; offset + sizeof(uint64_t) <= bytes.size();
+         offset += sizeof(uint64_t)) {
+      uint64_t word;
+      std::memcpy(&word, bytes.data() + offset, sizeof(word));
+      Add(word);
+    }
+    if (offset < bytes.size()) {
+      uint64_t word = 0;
+      std::memcpy(&word, bytes.data() + offset, bytes.size() - offset);
+      Add(word);
+    }
+  }
+
+  InputDigest Digest() const {
+    auto finished = *this;
+    // Stands in for SipHash's final block, which holds the message length.
+    finished.Add(num_words_);
+    InputDigest digest;
+    finished.v2_ ^= 0xEE;
+    finished.Finish();
+    digest.low = finished.v0_ ^ finished.v1_ ^ finished.v2_ ^ finished.v3_;
+    finished.v1_ ^= 0xDD;
+    finished.Finish();
+    digest.high = finished.v0_ ^ finished.v1_ ^ finished.v2_ ^ finished.v3_;
+    return digest;
+  }
+
+ private:
+  static uint64_t Rotate(const uint64_t &value, const int &bits) {
+    return (value << bits) | (value >> (64 - bits));
+  }
+
+  void Round() {
+    v0_ += v1_;
+    v1_ = Rotate(v1_, 13) ^ v0_;
+    v0_ = Rotate(v0_, 32);
+    v2_ += v3_;
+    v3_ = Rotate(v3_, 16) ^ v2_;
+    v0_ += v3_;
+    v3_ = Rotate(v3_, 21) ^ v0_;
+    v2_ += v1_;
+    v1_ = Rotate(v1_, 17) ^ v2_;
+    v2_ = Rotate(v2_, 32);
+  }
+
+  void Finish() {
+    for (int i = 0; i < 4; ++i) {
+      Round();
+    }
+  }
+
+  uint64_t v0_, v1_, v2_, v3_;
+  uint64_t num_words_;
+};
+
+enum DigestTag : uint64_t {
+  kNullTag = 1,
+  kBooleanTag,
+  kIntegerTag,
+  kUnsignedTag,
+  kFloatTag,
+  kStringTag,
+  kArrayTag,
+  kObjectTag,
+  kOtherTag
+};
+
+inline void AddToDigest(const json::json &value, DigestBuilder &builder) {
+  switch (value.type()) {
+    case json::json::value_t::null:
+      builder.Add(kNullTag);
+      break;
+    case json::json::value_t::boolean:
+      builder.Add(kBooleanTag);
+      builder.Add(static_cast<uint64_t>(value.get<bool>()));
+      break;
+    case json::json::value_t::number_integer:
+      builder.Add(kIntegerTag);
+      builder.Add(static_cast<uint64_t>(value.get<int64_t>()));
+      break;
+    case json::json::value_t::number_unsigned: {
+      // Non-negative integers parse as unsigned, but are the same tensor
+      // values as their signed counterparts.
+      auto unsigned_value = value.get<uint64_t>();
+      builder.Add(unsigned_value <= static_cast<uint64_t>(
+                                        std::numeric_limits<int64_t>::max())
+                      ? kIntegerTag
+                      : kUnsignedTag);
+      builder.Add(unsigned_value);
+      break;
+    }
+    case json::json::value_t::number_float: {
+      auto float_value = value.get<double>();
+      uint64_t bits;
+      std::memcpy(&bits, &float_value, sizeof(bits));
+      builder.Add(kFloatTag);
+      builder.Add(bits);
+      break;
+    }
+    case json::json::value_t::string:
+      builder.Add(kStringTag);
+      builder.Add(value.get_ref<const std::string &>());
+      break;
+    case json::json::value_t::array:
+      builder.Add(kArrayTag);
+      builder.Add(static_cast<uint64_t>(value.size()));
+      for (const auto &element : value) {
+        AddToDigest(element, builder);
+      }
+      break;
+    case json::json::value_t::object:
+      // N.B., objects iterate in key order, so this is canonical.
+      builder.Add(kObjectTag);
+      builder.Add(static_cast<uint64_t>(value.size()));
+      for (const auto &item : value.items()) {
+        builder.Add(item.key());
+        AddToDigest(item.value(), builder);
+      }
+      break;
+    default:
+      builder.Add(kOtherTag);
+  }
+}
+
+}  // namespace detail
+
+// Digests the values of a JSON document rather than its text, so inputs which
+// differ only in whitespace, key order or number formatting collide. Numbers
+// are hashed in binary by kind, since integers and floats become tensors of
+// different types.
+inline InputDigest DigestJson(const json::json &value) {
+  detail::DigestBuilder builder;
+  detail::AddToDigest(value, builder);
+  return builder.Digest();
+}
+
+// Digests raw bytes, e.g., a request body.
+inline InputDigest DigestBytes(const std::string &bytes) {
+  detail::DigestBuilder builder;
+  builder.Add(bytes);
+  return builder.Digest();
+}
+
+// Roughly how much memory a JSON document takes up.
+inline size_t ApproximateBytes(const json::json &value) {
+  size_t bytes = sizeof(json::json);
+  switch (value.type()) {
+    case json::json::value_t::string:
+      bytes += value.get_ref<const std::string &>().capacity();
+      break;
+    case json::json::value_t::array:
+      for (const auto &element : value) {
+        bytes += ApproximateBytes(element);
+      }
+      break;
+    case json::json::value_t::object:
+      for (const auto &item : value.items()) {
+        // Tree node overhead, plus the key.
+        bytes += 4 * sizeof(void *) + sizeof(std::string) +
+                 item.key().capacity() + ApproximateBytes(item.value());
+      }
+      break;
+    default:
+      break;
+  }
+  return bytes;
+}
+
+struct ResultCacheOptions {
+  // Budget for cached results, by their approximate size in memory. Zero
+  // disables the cache.
+  size_t max_bytes = 0;
+  // How long a result may be served from the cache.
+  std::chrono::milliseconds ttl = std::chrono::seconds(60);
+};
+
+// An LRU cache of inference results, bounded in bytes and entry age. Results
+// are keyed by servable, by the generation of the servable which computed
+// them (so reloads invalidate them) and by a digest of their input.
+class ResultCache {
+ public:
+  using Result = std::shared_ptr<const json::json>;
+
+  struct Key {
+    std::string servable_identifier;
+    uint64_t generation = 0;
+    InputDigest digest;
+
+    bool operator==(const Key &other) const {
+      return generation == other.generation && digest == other.digest &&
+             servable_identifier == other.servable_identifier;
+    }
+  };
+
+  explicit ResultCache(const ResultCacheOptions &options = {})
+      : options_(options), bytes_(0) {}
+
+  ResultCache(const ResultCache &) = delete;
+  ResultCache &operator=(const ResultCache &) = delete;
+
+  bool Enabled() const { return options_.max_bytes > 0; }
+
+  // Returns the cached result, or null on a miss.
+  Result Get(const Key &key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = index_.find(key);
+    if (entry == index_.end()) {
+      return nullptr;
+    }
+    if (std::chrono::steady_clock::now() > entry->second->expiry) {
+      Erase(entry->second);
+      return nullptr;
+    }
+    entries_.splice(entries_.begin(), entries_, entry->second);
+    return entry->second->result;
+  }
+
+  void Put(const Key &key, Result result) {
+    const auto bytes = ApproximateBytes(*result) + sizeof(Entry) +
+                       key.servable_identifier.capacity();
+    if (!Enabled() || bytes > options_.max_bytes) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto existing = index_.find(key);
+    if (existing != index_.end()) {
+      Erase(existing->second);
+    }
+    entries_.push_front({key, std::move(result), bytes,
+                         std::chrono::steady_clock::now() + options_.ttl});
+    index_.emplace(key, entries_.begin());
+    bytes_ += bytes;
+    while (bytes_ > options_.max_bytes) {
+      Erase(std::prev(entries_.end()));
+    }
+  }
+
+  // Drops every result computed by a servable, e.g., when it's reloaded.
+  void Invalidate(const std::string &servable_identifier) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto entry = entries_.begin(); entry != entries_.end();) {
+      auto next = std::next(entry);
+      if (entry->key.servable_identifier == servable_identifier) {
+        Erase(entry);
+      }
+      entry = next;
+    }
+  }
+
+  json::json Stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return {{"entries", entries_.size()},
+            {"bytes", bytes_},
+            {"max_bytes", options_.max_bytes}};
+  }
+
+ private:
+  struct Entry {
+    Key key;
+    Result result;
+    size_t bytes;
+    std::chrono::steady_clock::time_point expiry;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      return static_cast<size_t>(key.digest.low ^ (key.generation << 1)) ^
+             std::hash<std::string>()(key.servable_identifier);
+    }
+  };
+
+  // Must hold mutex_.
+  void Erase(std::list<Entry>::iterator entry) {
+    bytes_ -= entry->bytes;
+    index_.erase(entry->key);
+    entries_.erase(entry);
+  }
+
+  ResultCacheOptions options_;
+  std::mutex mutex_;
+  // Most recently used first.
+  std::list<Entry> entries_;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index_;
+  size_t bytes_;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__RESULT_CACHE_H_
@@ -0,0 +1,115 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__SERVABLE_CONFIG_H_
+#define TORCH_SERVING__SERVABLE_CONFIG_H_
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include "extern/json.hpp"
+
+namespace json = nlohmann;
+
+namespace torch_serving {
+
+// Thrown when a servable's options are invalid. These are only read when the
+// servable loads, so the ModelServer turns this into a 500: the request was
+// fine, the server's config isn't.
+class ServableConfigError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// A servable's options, parsed once when the ServableConfig is loaded.
+struct ServableOptions {
+  // Relative share of the inference workers (see InferenceScheduler).
+  double weight = 1.0;
+  // Most requests of this servable running at once (0 for unlimited).
+  size_t max_concurrency = 0;
+  // Whether to adapt the concurrency limit to the forward latency, if set;
+  // otherwise the scheduler's default applies.
+  bool has_adaptive_concurrency = false;
+  bool adaptive_concurrency = false;
+  // Preferred NUMA node (-1 for the least loaded one).
+  int numa_node = -1;
+  bool cache_results = true;
+  bool coalesce_requests = true;
+  // All of the options, for servables which accept their own.
+  json::json raw = json::json::object();
+};
+
+// Per-servable options, read from a JSON file of the form
+//
+//   {
+//     "defaults": {"weight": 1},
+//     "servables": {
+//       "model-example.pt": {"weight": 4, "max_concurrency": 2}
+//     }
+//   }
+//
+// where each servable's options are merged over the defaults.
+class ServableConfig {
+ public:
+  ServableConfig() = default;
+
+  explicit ServableConfig(const json::json &config) {
+    if (!config.is_object()) {
+      throw std::invalid_argument("Servable config must be a JSON object");
+    }
+    auto defaults = config.value("defaults", json::json::object());
+    auto servables = config.value("servables", json::json::object());
+    if (!defaults.is_object() || !servables.is_object()) {
+      throw std::invalid_argument(
+          "Servable config fields `defaults` and `servables` must be objects");
+    }
+    defaults_ = Parse(defaults);
+    for (const auto &servable : servables.items()) {
+      auto options = defaults;
+      options.update(servable.value());
+      servables_.emplace(servable.key(), Parse(options));
+    }
+  }
+
+  static ServableConfig FromFile(const std::string &path) {
+    std::ifstream stream(path);
+    if (!stream) {
+      throw std::invalid_argument("Unable to open servable config: " + path);
+    }
+    return ServableConfig(json::json::parse(stream));
+  }
+
+  const ServableOptions &Options(const std::string &servable_identifier) const {
+    auto servable = servables_.find(servable_identifier);
+    return servable != servables_.end() ? servable->second : defaults_;
+  }
+
+ private:
+  static ServableOptions Parse(const json::json &options) {
+    ServableOptions parsed;
+    parsed.weight = options.value("weight", parsed.weight);
+    parsed.max_concurrency =
+        options.value("max_concurrency", parsed.max_concurrency);
+    if (options.contains("adaptive_concurrency")) {
+      parsed.has_adaptive_concurrency = true;
+      parsed.adaptive_concurrency =
+          options.at("adaptive_concurrency").get<bool>();
+    }
+    parsed.numa_node = options.value("numa_node", parsed.numa_node);
+    parsed.cache_results = options.value("cache_results", parsed.cache_results);
+    parsed.coalesce_requests =
+        options.value("coalesce_requests", parsed.coalesce_requests);
+    parsed.raw = options;
+    return parsed;
+  }
+
+  ServableOptions defaults_;
+  std::unordered_map<std::string, ServableOptions> servables_;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__SERVABLE_CONFIG_H_
@@ -12,6 +12,12 @@
 
 #include "extern/LRUCache11.hpp"
 #include "extern/json.hpp"
+#include "inference_scheduler.h"
+#include "metrics.h"
+#include "request_context.h"
+#include "result_cache.h"
+#include "servable_config.h"
+#include "servable_traits.h"
 
 #include <spdlog/logger.h>
 #include <spdlog/sinks/stdout_color_sinks-inl.h>
@@ -39,22 +45,43 @@ class ServableManager {
  public:
   ServableManager() : ServableManager(5, 0) {}
 
-  explicit ServableManager(const size_t &size, const size_t &buffer_size = 0)
+  explicit ServableManager(const size_t &size, const size_t &buffer_size = 0,
+                           const SchedulerOptions &scheduler_options = {},
+                           const ServableConfig &servable_config = {},
+                           const ResultCacheOptions &result_cache_options = {})
       : logger_(spdlog::get("servable_manager")),
-        model_cache_(size, buffer_size) {
+        servable_config_(servable_config),
+        result_cache_(result_cache_options),
+        model_cache_(size, buffer_size),
+        scheduler_(scheduler_options, servable_config) {
     if (!logger_) {
       logger_ = spdlog::stdout_color_mt("servable_manager");
     }
+    logger_->info("Inference workers: " + scheduler_.Placement());
+    if (result_cache_.Enabled()) {
+      MetricsRegistry::Global().RegisterCollector(
+          "result_cache", [this] { return result_cache_.Stats(); });
+    }
+  }
+
+  ~ServableManager() {
+    if (result_cache_.Enabled()) {
+      MetricsRegistry::Global().UnregisterCollector("result_cache");
+    }
   }
 
+  // Runs the inference requests already queued, then joins the workers.
+  void Shutdown() { scheduler_.Shutdown(); }
+
   std::shared_ptr<ServableType> GetServable(
       const std::string &servable_identifier) {
     logger_->info("Loading servable from servable_identifier: " +
                   servable_identifier);
-    if (model_cache_.contains(servable_identifier)) {
+    std::shared_ptr<ServableType> cached;
+    if (model_cache_.tryGet(servable_identifier, cached)) {
       logger_->info("Found model with servable_identifier: " +
                     servable_identifier + " in cache");
-      return model_cache_.get(servable_identifier);
+      return cached;
     }
     logger_->info("Cache miss detected for servable_identifier: " +
                   servable_identifier);
@@ -62,13 +89,28 @@ class ServableManager {
     // Try to load the servable - if if fails, throw an error.
     try {
       servable = LoadServableFromIdentifier(servable_identifier);
+    } catch (const ServableConfigError &) {
+      // The servable exists, but its options are wrong.
+      throw;
     } catch (const std::exception &err) {
       const std::string msg("Failed to load from servable_identifier: " +
                             servable_identifier);
       logger_->warn(msg);
       throw std::invalid_argument(msg + err.what());
     }
+    scheduler_.Retain(servable_identifier);
+    PlaceServable(servable_identifier, *servable,
+                  HasBindToNumaNode<ServableType>());
+    // Results computed by any previous load are now stale.
+    {
+      std::lock_guard<std::mutex> lock(generations_mutex_);
+      auto &generation = generations_[servable_identifier];
+      ++generation.number;
+      generation.servable = servable;
+    }
+    result_cache_.Invalidate(servable_identifier);
     model_cache_.insert(servable_identifier, servable);
+    ReleaseEvicted();
     logger_->info("Cache is now of size: " + std::to_string(Size()));
     return servable;
   }
@@ -84,6 +126,7 @@ class ServableManager {
                     servable_identifier);
       if (model_cache_.contains(servable_identifier)) {
         model_cache_.remove(servable_identifier);
+        ReleaseEvicted();
       }
     }
     return GetServable(servable_identifier);
@@ -91,47 +134,429 @@ class ServableManager {
 
   size_t Size() { return model_cache_.size(); }
 
+  json::json SchedulerStats() { return scheduler_.Stats(); }
+
   json::json InferenceRequest(const std::string &servable_identifier,
                               const json::json &input,
                               const float &invalidation_prob = 0.0) {
+    return InferenceRequest(servable_identifier, input, RequestContext(),
+                            invalidation_prob);
+  }
+
+  json::json InferenceRequest(const std::string &servable_identifier,
+                              const json::json &input,
+                              const RequestContext &context,
+                              const float &invalidation_prob = 0.0) {
+    // Nobody is waiting for requests past their deadline or abandoned by
+    // their client, so don't spend a model load or a forward pass on them.
+    CheckContext(servable_identifier, context);
+    ResultCache::Key cache_key;
+    const auto cacheable = CacheResults(servable_identifier);
+    if (cacheable) {
+      cache_key = ResultCacheKey(servable_identifier, input);
+      if (auto cached = GetCachedResult(cache_key)) {
+        return *cached;
+      }
+    }
+    std::shared_ptr<ServableType> servable =
+        invalidation_prob > 1e-5
+            ? GetServable(servable_identifier, invalidation_prob)
+            : GetServable(servable_identifier);
+    CheckContext(servable_identifier, context);
+    cache_key.generation = GenerationOf(servable_identifier, servable);
+    auto result = EvictOnError(servable_identifier, [&] {
+      const auto start = std::chrono::steady_clock::now();
+      auto result = servable->RunInference(input);
+      InferenceScheduler::RecordForwardLatency(
+          std::chrono::steady_clock::now() - start);
+      return result;
+    });
+    if (cacheable && cache_key.generation) {
+      result_cache_.Put(cache_key, std::make_shared<const json::json>(result));
+    }
+    return result;
+  }
+
+  std::future<json::json> AsyncInferenceRequest(
+      const std::string &servable_identifier, const json::json &input,
+      const float &invalidation_prob = 0.0,
+      std::launch policy = std::launch::async) {
+    return AsyncInferenceRequest(servable_identifier, input, RequestContext(),
+                                 invalidation_prob, policy);
+  }
+
+  // Runs the request on the inference scheduler, in its priority class. The
+  // identifier and input are copied, so the caller is free to drop the
+  // returned future.
+  std::future<json::json> AsyncInferenceRequest(
+      const std::string &servable_identifier, const json::json &input,
+      const RequestContext &context, const float &invalidation_prob = 0.0,
+      std::launch policy = std::launch::async) {
+    if (policy == std::launch::deferred) {
+      return std::async(policy, [this, servable_identifier, input, context,
+                                 invalidation_prob]() {
+        return InferenceRequest(servable_identifier, input, context,
+                                invalidation_prob);
+      });
+    }
+    logger_->debug("Launching async inference request");
+    auto promise = std::make_shared<std::promise<json::json>>();
+    auto shared_input = std::make_shared<const json::json>(input);
+    scheduler_.Submit(
+        servable_identifier, context,
+        [this, promise, servable_identifier, shared_input, context,
+         invalidation_prob]() {
+          logger_->debug("Running inference on a scheduler worker.");
+          try {
+            promise->set_value(InferenceRequest(servable_identifier,
+                                                *shared_input, context,
+                                                invalidation_prob));
+          } catch (...) {
+            promise->set_exception(std::current_exception());
+          }
+        },
+        [promise](std::exception_ptr reason) {
+          promise->set_exception(reason);
+        });
+    return promise->get_future();
+  }
+
+  // One request's progress through the decode, inference and encode stages
+  // of the ModelServer. Servables with the staged inference hooks (see
+  // servable_traits.h) convert the input in Decode and the output in Encode;
+  // for any others, the whole of RunInference runs in the inference stage.
+  struct StagedRequest {
+    std::string servable_identifier;
+    RequestContext context;
+    json::json input;
+    std::shared_ptr<ServableType> servable;
+    std::vector<torch::jit::IValue> inputs;
+    torch::jit::IValue output;
+    ResultCache::Result result;
+    bool cacheable = false;
+    ResultCache::Key cache_key;
+  };
+
+  // Converts the request's input, if its servable is already loaded. If the
+  // result is already cached, it's set on the request and nothing else needs
+  // to run. Servables which aren't loaded yet are loaded by AsyncForward, on
+  // an inference worker, which converts the input there instead.
+  void Decode(StagedRequest &request) {
+    CheckContext(request.servable_identifier, request.context);
+    request.cacheable = CacheResults(request.servable_identifier);
+    if (request.cacheable) {
+      request.cache_key =
+          ResultCacheKey(request.servable_identifier, request.input);
+      if ((request.result = GetCachedResult(request.cache_key))) {
+        return;
+      }
+    }
+    if (FindServable(request)) {
+      Decode(request, HasStagedInference<ServableType>());
+    }
+  }
+
+  // Decode for an ensemble of requests with the same input, which is only
+  // converted once (by the first loaded servable without a cached result)
+  // and shared by the others. Requests whose servables aren't loaded yet
+  // keep the JSON input, and convert it once they're loaded.
+  void Decode(const json::json &input,
+              std::vector<std::shared_ptr<StagedRequest>> &requests) {
+    const auto digest = DigestJson(input);
+    std::vector<torch::jit::IValue> inputs;
+    bool converted = false;
+    for (auto &request : requests) {
+      CheckContext(request->servable_identifier, request->context);
+      request->cacheable = CacheResults(request->servable_identifier);
+      if (request->cacheable) {
+        request->cache_key = ResultCacheKey(request->servable_identifier);
+        request->cache_key.digest = digest;
+        if ((request->result = GetCachedResult(request->cache_key))) {
+          continue;
+        }
+      }
+      if (!HasStagedInference<ServableType>::value ||
+          !FindServable(*request)) {
+        request->input = input;
+      } else if (converted) {
+        request->inputs = inputs;
+      } else {
+        request->input = input;
+        Decode(*request, HasStagedInference<ServableType>());
+        inputs = request->inputs;
+        converted = true;
+      }
+    }
+  }
+
+  // Loads the servable for a request whose inputs are set by the caller,
+  // e.g., from the outputs of other servables in a ServablePipeline, and
+  // converts its JSON input, if it has one. Its result isn't cached. If the
+  // servable is already loaded, this happens right away, and `done` is called
+  // on this thread; otherwise, it's loaded on an inference worker, which
+  // calls `done` or `drop`.
+  void AsyncLoad(std::shared_ptr<StagedRequest> request,
+                 std::function<void()> done, InferenceScheduler::Drop drop) {
+    CheckContext(request->servable_identifier, request->context);
+    request->cacheable = false;
+    if (FindServable(*request)) {
+      if (!request->input.is_null()) {
+        Decode(*request, HasStagedInference<ServableType>());
+      }
+      done();
+      return;
+    }
+    const auto servable_identifier = request->servable_identifier;
+    const auto context = request->context;
+    scheduler_.Submit(
+        servable_identifier, context,
+        [this, request, done, drop]() {
+          try {
+            CheckContext(request->servable_identifier, request->context);
+            LoadOnWorker(*request);
+          } catch (...) {
+            drop(std::current_exception());
+            return;
+          }
+          done();
+        },
+        drop);
+  }
+
+  // Queues the forward pass on the inference scheduler. Once it has run,
+  // `done` is called on the inference worker; if it fails or is dropped,
+  // `drop` is called with the reason instead.
+  void AsyncForward(std::shared_ptr<StagedRequest> request,
+                    std::function<void()> done,
+                    InferenceScheduler::Drop drop) {
+    const auto servable_identifier = request->servable_identifier;
+    const auto context = request->context;
+    scheduler_.Submit(
+        servable_identifier, context,
+        [this, request, done, drop]() {
+          try {
+            // The deadline is checked again right before the forward pass,
+            // after any time spent queued for a worker.
+            CheckContext(request->servable_identifier, request->context);
+            LoadOnWorker(*request);
+            EvictOnError(request->servable_identifier, [&] {
+              const auto start = std::chrono::steady_clock::now();
+              Forward(*request, HasStagedInference<ServableType>());
+              InferenceScheduler::RecordForwardLatency(
+                  std::chrono::steady_clock::now() - start);
+            });
+          } catch (...) {
+            drop(std::current_exception());
+            return;
+          }
+          done();
+        },
+        drop);
+  }
+
+  // Converts the output of the forward pass into `request.result`.
+  void Encode(StagedRequest &request) {
+    Encode(request, HasStagedInference<ServableType>());
+    if (request.cacheable && request.cache_key.generation) {
+      result_cache_.Put(request.cache_key, request.result);
+    }
+  }
+
+ private:
+  // Sets the request's servable if it's loaded, without loading it.
+  bool FindServable(StagedRequest &request) {
+    std::shared_ptr<ServableType> servable;
+    if (!model_cache_.tryGet(request.servable_identifier, servable)) {
+      return false;
+    }
+    request.servable = std::move(servable);
+    request.cache_key.generation =
+        GenerationOf(request.servable_identifier, request.servable);
+    return true;
+  }
+
+  // Loads the servable of a request which Decode didn't find loaded, and
+  // converts its input. Runs on an inference worker, so a slow load holds
+  // up neither the decode stage nor other servables' workers, and the
+  // weights are first touched on the servable's NUMA node.
+  void LoadOnWorker(StagedRequest &request) {
+    if (request.servable) {
+      return;
+    }
+    request.servable = GetServable(request.servable_identifier);
+    request.cache_key.generation =
+        GenerationOf(request.servable_identifier, request.servable);
+    if (!request.input.is_null()) {
+      Decode(request, HasStagedInference<ServableType>());
+    }
+  }
+
+  void Decode(StagedRequest &request, std::true_type) {
+    request.inputs = request.servable->Decode(request.input);
+    request.input = json::json();
+  }
+
+  void Decode(StagedRequest &request, std::false_type) {}
+
+  void Forward(StagedRequest &request, std::true_type) {
+    request.output = request.servable->Forward(std::move(request.inputs));
+    request.inputs.clear();
+  }
+
+  void Forward(StagedRequest &request, std::false_type) {
+    request.result = std::make_shared<const json::json>(
+        request.servable->RunInference(request.input));
+  }
+
+  void Encode(StagedRequest &request, std::true_type) {
+    request.result = std::make_shared<const json::json>(
+        request.servable->Encode(request.output));
+    request.output = torch::jit::IValue();
+  }
+
+  // Servables may opt out of result caching (e.g., if they aren't
+  // deterministic) with `cache_results` in the ServableConfig.
+  bool CacheResults(const std::string &servable_identifier) const {
+    return result_cache_.Enabled() &&
+           servable_config_.Options(servable_identifier).cache_results;
+  }
+
+  ResultCache::Key ResultCacheKey(const std::string &servable_identifier,
+                                  const json::json &input) {
+    auto key = ResultCacheKey(servable_identifier);
+    key.digest = DigestJson(input);
+    return key;
+  }
+
+  // A key without the input digest.
+  ResultCache::Key ResultCacheKey(const std::string &servable_identifier) {
+    ResultCache::Key key;
+    key.servable_identifier = servable_identifier;
+    std::lock_guard<std::mutex> lock(generations_mutex_);
+    key.generation = generations_[servable_identifier].number;
+    return key;
+  }
+
+  // The generation of a loaded servable, or zero if it has since been
+  // reloaded, in which case its results shouldn't be cached.
+  uint64_t GenerationOf(const std::string &servable_identifier,
+                        const std::shared_ptr<ServableType> &servable) {
+    std::lock_guard<std::mutex> lock(generations_mutex_);
+    auto generation = generations_.find(servable_identifier);
+    return generation != generations_.end() &&
+                   generation->second.servable.lock() == servable
+               ? generation->second.number
+               : 0;
+  }
+
+  ResultCache::Result GetCachedResult(const ResultCache::Key &key) {
+    auto cached = result_cache_.Get(key);
+    MetricsRegistry::Global().Increment(
+        cached ? "result_cache_hits" : "result_cache_misses",
+        key.servable_identifier);
+    return cached;
+  }
+
+  void Encode(StagedRequest &request, std::false_type) {}
+
+  // Runs `step`, evicting the servable from the cache if it throws, in case
+  // the model was left in a bad state.
+  template <typename Step>
+  auto EvictOnError(const std::string &servable_identifier, Step step)
+      -> decltype(step()) {
     try {
-      return (invalidation_prob > 1e-5
-                  ? GetServable(servable_identifier, invalidation_prob)
-                  : GetServable(servable_identifier))
-          ->RunInference(input);
+      return step();
     } catch (const std::exception &e) {
       if (model_cache_.contains(servable_identifier)) {
         logger_->warn("Removing servable_identifier: " + servable_identifier +
                       " from cache due to caught exception.");
         model_cache_.remove(servable_identifier);
+        ReleaseEvicted();
       }
       throw;
     }
   }
 
-  std::future<json::json> AsyncInferenceRequest(
-      const std::string &servable_identifier, const json::json &input,
-      const float &invalidation_prob = 0.0,
-      std::launch policy = std::launch::async) {
-    logger_->debug("Launching async inference request");
-    return std::async(policy, [this, &servable_identifier, &input,
-                               &invalidation_prob]() {
-      logger_->debug("Running inference in a future.");
-      return InferenceRequest(servable_identifier, input, invalidation_prob);
+  // Lets the scheduler forget servables which have left the model cache.
+  void ReleaseEvicted() {
+    scheduler_.ReleaseUnloaded([this](const std::string &servable_identifier) {
+      return model_cache_.contains(servable_identifier);
     });
   }
 
- private:
-  static std::shared_ptr<ServableType> LoadServableFromIdentifier(
+  void CheckContext(const std::string &servable_identifier,
+                    const RequestContext &context) {
+    if (context.cancellation.IsCancelled()) {
+      logger_->warn("Dropping cancelled request for servable_identifier: " +
+                    servable_identifier);
+      MetricsRegistry::Global().Increment("cancelled", servable_identifier);
+      context.CheckCancelled(servable_identifier);
+    }
+    if (context.Expired()) {
+      logger_->warn("Dropping expired request for servable_identifier: " +
+                    servable_identifier);
+      MetricsRegistry::Global().Increment("deadline_exceeded",
+                                          servable_identifier);
+      context.CheckDeadline(servable_identifier);
+    }
+  }
+
+  // Binds the weights of a freshly loaded servable to the NUMA node its
+  // requests are routed to.
+  void PlaceServable(const std::string &servable_identifier,
+                     ServableType &servable, std::true_type) {
+    auto node = scheduler_.NumaNode(servable_identifier);
+    if (node < 0) {
+      return;
+    }
+    auto bytes = servable.BindToNumaNode(node);
+    logger_->info("Placed servable_identifier: " + servable_identifier +
+                  " on NUMA node " + std::to_string(node) + " (" +
+                  std::to_string(bytes) + " bytes of weights bound)");
+  }
+
+  void PlaceServable(const std::string &servable_identifier,
+                     ServableType &servable, std::false_type) {}
+
+  std::shared_ptr<ServableType> LoadServableFromIdentifier(
       const std::string &servable_identifier) {
+    return LoadServableFromIdentifier(servable_identifier,
+                                      AcceptsServableOptions<ServableType>());
+  }
+
+  std::shared_ptr<ServableType> LoadServableFromIdentifier(
+      const std::string &servable_identifier, std::true_type) {
+    return std::make_shared<ServableType>(
+        servable_identifier,
+        servable_config_.Options(servable_identifier).raw);
+  }
+
+  std::shared_ptr<ServableType> LoadServableFromIdentifier(
+      const std::string &servable_identifier, std::false_type) {
     return std::make_shared<ServableType>(servable_identifier);
   }
 
   std::shared_ptr<spdlog::logger> logger_;
+  ServableConfig servable_config_;
+
+  struct Generation {
+    uint64_t number = 0;
+    std::weak_ptr<ServableType> servable;
+  };
+
+  ResultCache result_cache_;
+  // How many times each servable has been loaded (and its latest load), so
+  // results computed by a previous load are never served.
+  std::unordered_map<std::string, Generation> generations_;
+  std::mutex generations_mutex_;
 
   // N.B., this uses a mutex so the insertion and retrieval of models into
-  // model_cache_ is thread safe/
-  lru11::Cache<std::string, std::shared_ptr<ServableType>> model_cache_;
+  // model_cache_ is thread safe.
+  lru11::Cache<std::string, std::shared_ptr<ServableType>, std::mutex>
+      model_cache_;
+
+  // Declared last, so workers are joined before the cache goes away.
+  InferenceScheduler scheduler_;
 };
 
 }  // namespace torch_serving
@@ -0,0 +1,286 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__SERVABLE_PIPELINE_H_
+#define TORCH_SERVING__SERVABLE_PIPELINE_H_
+
+#include <torch/script.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "extern/json.hpp"
+
+namespace json = nlohmann;
+
+namespace torch_serving {
+
+// Thrown when one stage's output can't be wired into another's input, e.g.,
+// because the referenced tuple element doesn't exist.
+class PipelineError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// A reference to a value flowing through a ServablePipeline: the pipeline's
+// (decoded) input, or a stage's output, optionally narrowed to one tuple or
+// list element or one dict entry. Written as
+//
+//   "$input"       every input argument
+//   "$input[1]"    the second input argument
+//   "encoder"      the output of stage `encoder`
+//   "encoder[0]"   the first element of its (tuple or list) output
+//   "encoder.emb"  the `emb` entry of its (dict) output
+struct ValueReference {
+  static constexpr size_t kPipelineInput = static_cast<size_t>(-1);
+
+  enum class Selector { kWhole, kIndex, kKey };
+
+  // The index of the referenced stage, or kPipelineInput.
+  size_t source = kPipelineInput;
+  Selector selector = Selector::kWhole;
+  int64_t index = 0;
+  std::string key;
+};
+
+// One forward pass in a ServablePipeline.
+struct PipelineStep {
+  std::string name;
+  std::string servable_identifier;
+  // Positional arguments to the servable's forward. Stages which don't list
+  // their inputs take the pipeline's input arguments.
+  std::vector<ValueReference> inputs;
+  // Distinct stages whose outputs this one takes, and those which take its
+  // output.
+  std::vector<size_t> dependencies;
+  std::vector<size_t> dependents;
+};
+
+// A DAG of servables, run on the server so intermediate outputs are passed
+// between forward passes as IValues, never serialized. Defined in JSON as
+//
+//   {
+//     "stages": [
+//       {"name": "encoder", "servable_identifier": "encoder.pt"},
+//       {"name": "ranker", "servable_identifier": "ranker.pt",
+//        "inputs": ["encoder[0]", "$input[1]"]}
+//     ],
+//     "output": "ranker"
+//   }
+//
+// Stages may only take the outputs of stages listed before them, so the
+// graph is acyclic by construction. The request's input is converted by the
+// first stage's servable, and the response is the output stage's output.
+class ServablePipeline {
+ public:
+  ServablePipeline(std::string name, const json::json &definition)
+      : name_(std::move(name)) {
+    if (!definition.is_object() || !definition.contains("stages") ||
+        !definition.at("stages").is_array() ||
+        definition.at("stages").empty()) {
+      throw std::invalid_argument("Pipeline `" + name_ +
+                                  "` must have a non-empty array of `stages`");
+    }
+    std::map<std::string, size_t> indices;
+    for (const auto &stage : definition.at("stages")) {
+      PipelineStep step;
+      if (!stage.is_object() || !stage.contains("name") ||
+          !stage.contains("servable_identifier")) {
+        throw std::invalid_argument(
+            "Each stage of pipeline `" + name_ +
+            "` needs a `name` and a `servable_identifier`");
+      }
+      step.name = stage.at("name").get<std::string>();
+      step.servable_identifier =
+          stage.at("servable_identifier").get<std::string>();
+      if (step.name.empty() || step.name[0] == '$' ||
+          step.name.find_first_of(".[") != std::string::npos) {
+        throw std::invalid_argument("Invalid stage name in pipeline `" +
+                                    name_ + "`: `" + step.name + "`");
+      }
+      if (stage.contains("inputs")) {
+        for (const auto &input : stage.at("inputs")) {
+          step.inputs.push_back(ParseReference(input.get<std::string>(),
+                                               indices));
+        }
+      } else {
+        step.inputs.push_back(ValueReference());
+      }
+      for (const auto &input : step.inputs) {
+        if (input.source != ValueReference::kPipelineInput &&
+            std::find(step.dependencies.begin(), step.dependencies.end(),
+                      input.source) == step.dependencies.end()) {
+          step.dependencies.push_back(input.source);
+          steps_[input.source].dependents.push_back(steps_.size());
+        }
+      }
+      if (!indices.emplace(step.name, steps_.size()).second) {
+        throw std::invalid_argument("Duplicate stage `" + step.name +
+                                    "` in pipeline `" + name_ + "`");
+      }
+      steps_.push_back(std::move(step));
+    }
+    output_ = steps_.size() - 1;
+    if (definition.contains("output")) {
+      auto output = indices.find(definition.at("output").get<std::string>());
+      if (output == indices.end()) {
+        throw std::invalid_argument("Unknown output stage for pipeline `" +
+                                    name_ + "`");
+      }
+      output_ = output->second;
+    }
+  }
+
+  const std::string &Name() const { return name_; }
+
+  const std::vector<PipelineStep> &Steps() const { return steps_; }
+
+  // The index of the stage whose output is the pipeline's.
+  size_t Output() const { return output_; }
+
+ private:
+  ValueReference ParseReference(const std::string &text,
+                                const std::map<std::string, size_t> &indices) {
+    ValueReference reference;
+    const auto end = text.find_first_of(".[");
+    const auto source = text.substr(0, end);
+    if (source != "$input") {
+      auto stage = indices.find(source);
+      if (stage == indices.end()) {
+        throw std::invalid_argument(
+            "Stage input `" + text + "` in pipeline `" + name_ +
+            "` must refer to `$input` or an earlier stage");
+      }
+      reference.source = stage->second;
+    }
+    if (end == std::string::npos) {
+      return reference;
+    }
+    if (text[end] == '.' && end + 1 < text.size() &&
+        reference.source != ValueReference::kPipelineInput) {
+      reference.selector = ValueReference::Selector::kKey;
+      reference.key = text.substr(end + 1);
+      return reference;
+    }
+    const auto index = text.substr(end + 1, text.size() - end - 2);
+    if (text[end] != '[' || text.back() != ']' || index.empty() ||
+        index.find_first_not_of("0123456789") != std::string::npos) {
+      throw std::invalid_argument("Invalid stage input `" + text +
+                                  "` in pipeline `" + name_ + "`");
+    }
+    reference.selector = ValueReference::Selector::kIndex;
+    reference.index = std::stoll(index);
+    return reference;
+  }
+
+  std::string name_;
+  std::vector<PipelineStep> steps_;
+  size_t output_ = 0;
+};
+
+// Every pipeline the server runs, read from a JSON file mapping pipeline
+// names to their definitions.
+class ServablePipelines {
+ public:
+  ServablePipelines() = default;
+
+  explicit ServablePipelines(const json::json &config) {
+    if (!config.is_object()) {
+      throw std::invalid_argument("Pipeline config must be a JSON object");
+    }
+    for (const auto &item : config.items()) {
+      pipelines_.emplace(item.key(),
+                         ServablePipeline(item.key(), item.value()));
+    }
+  }
+
+  static ServablePipelines FromFile(const std::string &path) {
+    std::ifstream stream(path);
+    if (!stream) {
+      throw std::invalid_argument("Unable to open pipeline config: " + path);
+    }
+    return ServablePipelines(json::json::parse(stream));
+  }
+
+  bool Empty() const { return pipelines_.empty(); }
+
+  // Returns null for unknown pipelines.
+  const ServablePipeline *Find(const std::string &name) const {
+    auto pipeline = pipelines_.find(name);
+    return pipeline == pipelines_.end() ? nullptr : &pipeline->second;
+  }
+
+ private:
+  std::map<std::string, ServablePipeline> pipelines_;
+};
+
+// Appends the arguments `reference` refers to, given the pipeline's input
+// arguments and the outputs of the stages run so far.
+inline void AppendReferencedValues(
+    const ValueReference &reference,
+    const std::vector<torch::jit::IValue> &pipeline_inputs,
+    const std::vector<const torch::jit::IValue *> &outputs,
+    std::vector<torch::jit::IValue> &arguments) {
+  using Selector = ValueReference::Selector;
+  if (reference.source == ValueReference::kPipelineInput) {
+    if (reference.selector == Selector::kWhole) {
+      arguments.insert(arguments.end(), pipeline_inputs.begin(),
+                       pipeline_inputs.end());
+    } else if (reference.index < static_cast<int64_t>(pipeline_inputs.size())) {
+      arguments.push_back(pipeline_inputs[reference.index]);
+    } else {
+      throw PipelineError("The pipeline's input has only " +
+                          std::to_string(pipeline_inputs.size()) +
+                          " arguments");
+    }
+    return;
+  }
+  const auto &value = *outputs[reference.source];
+  switch (reference.selector) {
+    case Selector::kWhole:
+      arguments.push_back(value);
+      return;
+    case Selector::kIndex:
+      if (value.isTuple()) {
+        const auto &elements = value.toTuple()->elements();
+        if (reference.index < static_cast<int64_t>(elements.size())) {
+          arguments.push_back(elements[reference.index]);
+          return;
+        }
+      } else if (value.isList()) {
+        auto elements = value.toList();
+        if (reference.index < static_cast<int64_t>(elements.size())) {
+          arguments.push_back(elements.get(reference.index));
+          return;
+        }
+      } else {
+        throw PipelineError(
+            "Can't index an output which isn't a tuple or list");
+      }
+      throw PipelineError("Output index " + std::to_string(reference.index) +
+                          " is out of range");
+    case Selector::kKey: {
+      if (!value.isGenericDict()) {
+        throw PipelineError("Can't look up `" + reference.key +
+                            "` in an output which isn't a dict");
+      }
+      auto dict = value.toGenericDict();
+      auto entry = dict.find(torch::jit::IValue(reference.key));
+      if (entry == dict.end()) {
+        throw PipelineError("Output has no entry `" + reference.key + "`");
+      }
+      arguments.push_back(entry->value());
+      return;
+    }
+  }
+}
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__SERVABLE_PIPELINE_H_
@@ -0,0 +1,63 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__SERVABLE_TRAITS_H_
+#define TORCH_SERVING__SERVABLE_TRAITS_H_
+
+#include <torch/script.h>
+
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "extern/json.hpp"
+
+namespace torch_serving {
+
+// Beyond RunInference, servables may optionally implement hooks which the
+// ServableManager uses when present. These traits detect them.
+
+template <typename...>
+using void_t = void;
+
+// size_t BindToNumaNode(int node): move the servable's weights onto `node`,
+// returning the number of bytes bound.
+template <typename ServableType, typename = void>
+struct HasBindToNumaNode : std::false_type {};
+
+template <typename ServableType>
+struct HasBindToNumaNode<ServableType,
+                         void_t<decltype(std::declval<ServableType &>()
+                                             .BindToNumaNode(0))>>
+    : std::true_type {};
+
+// A (std::string, json) constructor: the servable is constructed with its
+// options from the ServableConfig, as well as its servable_identifier.
+template <typename ServableType>
+using AcceptsServableOptions =
+    std::is_constructible<ServableType, std::string, nlohmann::json>;
+
+// The staged inference hooks, which split RunInference so the ModelServer can
+// run each part on its own pool:
+//   std::vector<IValue> Decode(json): convert a request to model inputs,
+//   IValue Forward(std::vector<IValue>): run the model,
+//   json Encode(IValue): convert the model output to a response.
+template <typename ServableType, typename = void>
+struct HasStagedInference : std::false_type {};
+
+template <typename ServableType>
+struct HasStagedInference<
+    ServableType,
+    void_t<decltype(std::declval<ServableType &>().Decode(
+               std::declval<const nlohmann::json &>())),
+           decltype(std::declval<ServableType &>().Forward(
+               std::declval<std::vector<torch::jit::IValue>>())),
+           decltype(std::declval<ServableType &>().Encode(
+               std::declval<const torch::jit::IValue &>()))>>
+    : std::true_type {};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__SERVABLE_TRAITS_H_
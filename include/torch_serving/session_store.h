@@ -0,0 +1,297 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__SESSION_STORE_H_
+#define TORCH_SERVING__SESSION_STORE_H_
+
+#include <torch/script.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include "extern/json.hpp"
+
+namespace json = nlohmann;
+
+namespace torch_serving {
+
+class UnknownSessionError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Thrown when a session is already serving a request, since its requests
+// must run one after another.
+class SessionBusyError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Thrown when a servable doesn't follow the session protocol (see
+// SessionStore).
+class SessionStateError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Roughly how much memory the tensors in a state take up.
+inline size_t StateBytes(const torch::jit::IValue &state) {
+  if (state.isTensor()) {
+    const auto &tensor = state.toTensor();
+    return tensor.defined() ? tensor.numel() * tensor.element_size() : 0;
+  }
+  size_t bytes = 0;
+  if (state.isTensorList()) {
+    for (const torch::Tensor &tensor : state.toTensorList()) {
+      bytes += StateBytes(tensor);
+    }
+  } else if (state.isTuple()) {
+    for (const auto &element : state.toTuple()->elements()) {
+      bytes += StateBytes(element);
+    }
+  } else if (state.isList()) {
+    for (const auto &element : state.toList()) {
+      bytes += StateBytes(element);
+    }
+  } else if (state.isGenericDict()) {
+    for (const auto &entry : state.toGenericDict()) {
+      bytes += StateBytes(entry.value());
+    }
+  }
+  return bytes;
+}
+
+struct SessionStoreOptions {
+  // Most sessions kept at once, like the model cache's capacity: creating
+  // one more evicts the least recently used.
+  size_t max_sessions = 1024;
+  // Budget for the sessions' state tensors.
+  size_t max_bytes = size_t(256) << 20;
+  // How long a session may sit idle.
+  std::chrono::milliseconds ttl = std::chrono::minutes(10);
+};
+
+// Keeps the state of inference sessions server-side, so clients of
+// recurrent or streaming models only send their new inputs. A session's
+// servable takes its state (None at first) as the last argument to forward,
+// and returns an (output, state) tuple; the new state is kept for the
+// session's next request. Sessions are evicted least recently used first,
+// past max_sessions or max_bytes, and once idle for longer than the TTL.
+// A state larger than max_bytes on its own is rejected instead. Session IDs
+// are 128 bits straight from std::random_device, so they can't be guessed.
+class SessionStore {
+ public:
+  struct Checkout {
+    std::string servable_identifier;
+    torch::jit::IValue state;
+  };
+
+  explicit SessionStore(const SessionStoreOptions &options = {})
+      : options_(options), bytes_(0) {}
+
+  SessionStore(const SessionStore &) = delete;
+  SessionStore &operator=(const SessionStore &) = delete;
+
+  // Returns the new session's ID.
+  std::string Create(const std::string &servable_identifier) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto id = NewId();
+    entries_.push_front(
+        {id, servable_identifier, torch::jit::IValue(), 0, Expiry(), false});
+    index_.emplace(id, entries_.begin());
+    Evict();
+    return id;
+  }
+
+  // Takes a session's state for a request, which must Return (or Release)
+  // it once done. Throws UnknownSessionError for unknown or expired
+  // sessions, and SessionBusyError while another request has it.
+  Checkout Take(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Expire();
+    auto entry = Find(id);
+    if (entry->busy) {
+      throw SessionBusyError("Session " + id + " is serving another request");
+    }
+    entry->busy = true;
+    entries_.splice(entries_.begin(), entries_, entry);
+    return {entry->servable_identifier, entry->state};
+  }
+
+  // Keeps a taken session's new state. Dropped if the session was deleted
+  // in the meantime. Throws SessionStateError, leaving the session taken,
+  // if the state alone is larger than max_bytes.
+  void Return(const std::string &id, torch::jit::IValue state) {
+    const auto bytes = StateBytes(state);
+    if (bytes > options_.max_bytes) {
+      throw SessionStateError(
+          "Session " + id + " has a state of " + std::to_string(bytes) +
+          " bytes, more than the " + std::to_string(options_.max_bytes) +
+          " bytes allowed for all sessions");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto index = index_.find(id);
+    if (index == index_.end()) {
+      return;
+    }
+    auto entry = index->second;
+    bytes_ += bytes - entry->bytes;
+    entry->state = std::move(state);
+    entry->bytes = bytes;
+    Idle(entry);
+    Evict();
+  }
+
+  // Gives a taken session back with its state unchanged, e.g., after a
+  // failed request.
+  void Release(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto index = index_.find(id);
+    if (index != index_.end()) {
+      Idle(index->second);
+    }
+  }
+
+  // Returns false for unknown sessions.
+  bool Erase(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto index = index_.find(id);
+    if (index == index_.end()) {
+      return false;
+    }
+    Erase(index->second);
+    return true;
+  }
+
+  json::json Stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Expire();
+    return {{"sessions", entries_.size()},
+            {"max_sessions", options_.max_sessions},
+            {"bytes", bytes_},
+            {"max_bytes", options_.max_bytes},
+            {"evicted", evicted_},
+            {"expired", expired_}};
+  }
+
+ private:
+  struct Entry {
+    std::string id;
+    std::string servable_identifier;
+    torch::jit::IValue state;
+    size_t bytes;
+    std::chrono::steady_clock::time_point expiry;
+    // Whether a request has the session's state.
+    bool busy;
+  };
+
+  using Iterator = std::list<Entry>::iterator;
+
+  std::chrono::steady_clock::time_point Expiry() const {
+    return std::chrono::steady_clock::now() + options_.ttl;
+  }
+
+  // Must hold mutex_.
+  std::string NewId() {
+    std::string id;
+    do {
+      id.clear();
+      for (int word = 0; word < 4; ++word) {
+        char buffer[9];
+        std::snprintf(buffer, sizeof(buffer), "%08x",
+                      static_cast<unsigned int>(random_() & 0xffffffffu));
+        id += buffer;
+      }
+    } while (index_.count(id));
+    return id;
+  }
+
+  // Marks a session idle, and most recently used. Idle sessions are thus
+  // kept in order of expiry. Must hold mutex_.
+  void Idle(Iterator entry) {
+    entry->busy = false;
+    entry->expiry = Expiry();
+    entries_.splice(entries_.begin(), entries_, entry);
+  }
+
+  // Must hold mutex_.
+  Iterator Find(const std::string &id) {
+    auto index = index_.find(id);
+    if (index == index_.end()) {
+      throw UnknownSessionError("Unknown session: " + id);
+    }
+    auto entry = index->second;
+    if (!entry->busy && std::chrono::steady_clock::now() > entry->expiry) {
+      ++expired_;
+      Erase(entry);
+      throw UnknownSessionError("Session " + id + " has expired");
+    }
+    return entry;
+  }
+
+  // Drops expired sessions, oldest first, stopping at the first idle one
+  // which hasn't expired: the ones before it were used more recently. Must
+  // hold mutex_.
+  void Expire() {
+    const auto now = std::chrono::steady_clock::now();
+    auto entry = entries_.end();
+    while (entry != entries_.begin()) {
+      --entry;
+      if (entry->busy) {
+        continue;
+      }
+      if (now <= entry->expiry) {
+        return;
+      }
+      auto expired = entry++;
+      ++expired_;
+      Erase(expired);
+    }
+  }
+
+  // Drops expired sessions, then the least recently used idle ones until
+  // we're within budget. Sessions serving a request are never evicted. Must
+  // hold mutex_.
+  void Evict() {
+    Expire();
+    auto entry = entries_.end();
+    while ((entries_.size() > options_.max_sessions ||
+            bytes_ > options_.max_bytes) &&
+           entry != entries_.begin()) {
+      --entry;
+      if (entry->busy) {
+        continue;
+      }
+      auto evicted = entry++;
+      ++evicted_;
+      Erase(evicted);
+    }
+  }
+
+  // Must hold mutex_.
+  void Erase(Iterator entry) {
+    bytes_ -= entry->bytes;
+    index_.erase(entry->id);
+    entries_.erase(entry);
+  }
+
+  SessionStoreOptions options_;
+  std::mutex mutex_;
+  // Most recently used first.
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, Iterator> index_;
+  size_t bytes_;
+  uint64_t evicted_ = 0;
+  uint64_t expired_ = 0;
+  std::random_device random_;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__SESSION_STORE_H_
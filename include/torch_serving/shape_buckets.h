@@ -0,0 +1,115 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__SHAPE_BUCKETS_H_
+#define TORCH_SERVING__SHAPE_BUCKETS_H_
+
+#include <torch/script.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "extern/json.hpp"
+#include "servable_config.h"
+
+namespace json = nlohmann;
+
+namespace torch_serving {
+
+// The true length of a padded input, and the bucket it was padded to.
+struct BucketedLength {
+  int64_t length = -1;
+  int64_t bucket = -1;
+
+  bool Padded() const { return length >= 0; }
+};
+
+// Pads variable-length inputs up to one of a few fixed lengths, so a model
+// only ever sees (and the profiling executor only specializes on) those
+// shapes. Configured by a servable's "shape_buckets" option, either a list
+// of lengths or
+//
+//   {
+//     "sizes": [16, 32, 64, 128, 256, 512],
+//     "dim": 1,                   // the sequence dimension of inputs
+//     "sequence_inputs": [0, 1],  // the arguments padded, default [0]
+//     "output_dim": 1,            // the sequence dimension of outputs,
+//                                 // default `dim`
+//     "slice_outputs": ["[0]"],   // the outputs sliced, default none
+//     "pad_value": 0,
+//     "attention_mask": true      // append an int64 mask argument
+//   }
+//
+// The sequence inputs must all have the same length, which is read from the
+// first of them. Each output to slice is a path into the output: "" for the
+// whole output, "[i]" for an element of a tuple or list, ".key" for an
+// entry of a dict, or a chain of those, e.g. "[0].logits". Only the
+// configured arguments and outputs are touched, whatever their lengths.
+class ShapeBuckets {
+ public:
+  ShapeBuckets() = default;
+
+  explicit ShapeBuckets(const json::json &config);
+
+  bool Enabled() const { return !sizes_.empty(); }
+
+  const std::vector<int64_t> &Sizes() const { return sizes_; }
+
+  // The smallest bucket holding `length`. Throws TensorShapeError if the
+  // largest bucket is too short.
+  int64_t BucketFor(const int64_t &length) const;
+
+  // Pads the sequence inputs in place, appending the attention mask, if
+  // configured. Throws TensorShapeError if a sequence input is missing, isn't
+  // a tensor with a sequence dimension, or differs in length from the first.
+  BucketedLength Pad(std::vector<torch::jit::IValue> &inputs) const;
+
+  // Slices the configured outputs back to the true length. Throws if one of
+  // them isn't in `output`, or isn't a tensor of the bucket's length.
+  torch::jit::IValue Slice(const torch::jit::IValue &output,
+                           const BucketedLength &length) const;
+
+  // Copies of `inputs` with their sequences cut or padded to exactly `size`,
+  // e.g., to warm up every bucket from one example input.
+  std::vector<torch::jit::IValue> Resize(
+      const std::vector<torch::jit::IValue> &inputs,
+      const int64_t &size) const;
+
+ private:
+  // One step of a path into an output: a tuple or list index, or a dict key.
+  struct PathStep {
+    int64_t index = -1;
+    std::string key;
+  };
+
+  struct OutputPath {
+    std::string text;
+    std::vector<PathStep> steps;
+  };
+
+  static OutputPath ParseOutputPath(const std::string &text);
+
+  // The length of the sequence inputs, checking they all have it.
+  int64_t SequenceLength(const std::vector<torch::jit::IValue> &inputs) const;
+
+  at::Tensor PadTensor(const at::Tensor &tensor, const int64_t &size) const;
+
+  torch::jit::IValue SliceAt(const torch::jit::IValue &value,
+                             const OutputPath &path, const size_t &step,
+                             const BucketedLength &length) const;
+
+  std::vector<int64_t> sizes_;
+  int64_t dim_ = 1;
+  std::vector<size_t> sequence_inputs_{0};
+  int64_t output_dim_ = 1;
+  std::vector<OutputPath> slice_outputs_;
+  double pad_value_ = 0.0;
+  bool attention_mask_ = false;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__SHAPE_BUCKETS_H_
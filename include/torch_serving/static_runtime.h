@@ -0,0 +1,45 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__STATIC_RUNTIME_H_
+#define TORCH_SERVING__STATIC_RUNTIME_H_
+
+#include <torch/script.h>
+
+#include <memory>
+#include <vector>
+
+namespace torch_serving {
+
+// Runs a module through libtorch's Static Runtime, which replaces the
+// interpreter's per-op dispatch with out variants of each op writing into
+// memory planned ahead of time. A runtime (and its memory plan) can only run
+// one forward at a time, so each concurrent forward takes one from a pool,
+// and they're reused across requests.
+class StaticRuntimePool {
+ public:
+  // Throws if libtorch is too old to have a Static Runtime, or the module's
+  // graph isn't supported by it.
+  StaticRuntimePool(const torch::jit::script::Module &module,
+                    const bool &frozen);
+  ~StaticRuntimePool();
+
+  StaticRuntimePool(const StaticRuntimePool &) = delete;
+  StaticRuntimePool &operator=(const StaticRuntimePool &) = delete;
+
+  torch::jit::IValue Run(const std::vector<torch::jit::IValue> &inputs);
+
+  // How many runtimes have been created, i.e., the most forwards which have
+  // run at once.
+  size_t NumRuntimes() const;
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__STATIC_RUNTIME_H_
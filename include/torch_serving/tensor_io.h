@@ -30,7 +30,14 @@ class TensorShapeError : public std::runtime_error {
   using std::runtime_error::runtime_error;
 };
 
-json::json TorchValueToJson(const torch::jit::IValue &torch_value);
+// Parses a tensor `data_type`, e.g., "float32" or "bfloat16".
+torch::ScalarType StringToScalarType(const std::string &scalar_type);
+
+// If given, floating point tensors are cast to `floating_type` first, e.g.,
+// back to the float32 a client sent, from a model run in bfloat16.
+json::json TorchValueToJson(
+    const torch::jit::IValue &torch_value,
+    const c10::optional<torch::ScalarType> &floating_type = c10::nullopt);
 
 std::vector<torch::jit::IValue> JsonToTorchValue(
     const json::json &payload, const at::Device &device = at::kCPU);
@@ -13,27 +13,97 @@
 #include <spdlog/logger.h>
 #include <spdlog/sinks/stdout_color_sinks-inl.h>
 
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <limits>
+
 #include "extern/json.hpp"
+#include "inference_mode.h"
+#include "metrics.h"
+#include "module_optimizer.h"
+#include "precision.h"
+#include "shape_buckets.h"
+#include "static_runtime.h"
 #include "tensor_io.h"
+#include "weight_memory.h"
 
 namespace json = nlohmann;
 
 namespace torch_serving {
 
+// Runs TorchScript modules through the interpreter. Options from the
+// servable's entry in the ServableConfig:
+//
+//   "freeze", "optimize_for_inference", "quantize": see
+//       ModuleOptimizationOptions.
+//   "warmup_input": a request body to run through the model once it's
+//       loaded (and before and after optimizing it), logging the latency,
+//       and how far optimizing it moved its output.
+//   "warmup_runs": how many times to run it, default 3. The last run is
+//       timed, after any profiling runs.
+//   "precision": "fp32" (default), "bf16_autocast" or "bf16_weights", see
+//       ExecutionPrecision. With a warmup_input, the model stays in fp32 if
+//       its output then strays further from fp32's than
+//       "max_precision_error" (relative, default 0.02).
+//   "output_data_type": the data type floating point outputs are returned
+//       in, default float32 when running in bfloat16, or as computed. It's
+//       the same for every request; clients can't choose it.
+//   "huge_pages", "prefault_weights", "mlock_weights": see
+//       WeightMemoryOptions.
+//   "shape_buckets": pad variable-length inputs to a few fixed lengths, see
+//       ShapeBuckets. With a warmup_input, every bucket is warmed up.
 class TorchJITServable {
  public:
-  explicit TorchJITServable(std::string path)
+  explicit TorchJITServable(std::string path,
+                            const json::json &options = json::json::object())
       : m_path(std::move(path)),
         m_servable(LoadServable(m_path)),
         m_logger(spdlog::get("servable_manager")) {
     if (!m_logger) {
       m_logger = spdlog::stdout_color_mt("torch_jit_servable");
     }
+    SetServable(m_servable);
+    Prepare(options);
   }
 
   virtual json::json RunInference(const json::json &input) {
-    return TorchValueToJson(
-        m_servable.forward(JsonToTorchValue(input, at::kCPU)));
+    return Encode(Forward(Decode(input)));
+  }
+
+  // RunInference, split into stages so the ModelServer can overlap the
+  // conversions with other requests' forward passes.
+  virtual std::vector<torch::jit::IValue> Decode(const json::json &input) {
+    return JsonToTorchValue(input, at::kCPU);
+  }
+
+  // Runs the cached forward function directly (rather than looking it up
+  // through Module::forward) under inference mode, on a stack reused by
+  // every forward on this thread.
+  virtual torch::jit::IValue Forward(std::vector<torch::jit::IValue> inputs) {
+    const auto length = m_shape_buckets.Pad(inputs);
+    CastInputs(inputs);
+    InferenceModeGuard inference_mode;
+    Bf16AutocastGuard autocast(m_precision ==
+                               ExecutionPrecision::kBf16Autocast);
+    thread_local torch::jit::Stack stack;
+    // Keeps the capacity, but not the tensors, even if the forward throws.
+    struct ClearStack {
+      torch::jit::Stack &stack;
+      ~ClearStack() { stack.clear(); }
+    } clear_stack{stack};
+    stack.reserve(inputs.size() + 1);
+    stack.emplace_back(m_servable._ivalue());
+    std::move(inputs.begin(), inputs.end(), std::back_inserter(stack));
+    // Function::run binds the stack as is.
+    NormalizeInputs(stack);
+    m_forward->run(stack);
+    auto output = std::move(stack.back());
+    return m_shape_buckets.Slice(output, length);
+  }
+
+  json::json Encode(const torch::jit::IValue &output) {
+    return TorchValueToJson(output, m_output_type);
   }
 
   virtual torch::jit::script::Module LoadServable(const std::string &path) {
@@ -42,20 +112,319 @@ class TorchJITServable {
     return module;
   }
 
+  // Sets the module's precision, optimizes it as configured, warms it up, and
+  // places its weights in memory.
+  void Prepare(const json::json &options) {
+    // Every option is read up front, so a bad one fails the load before any
+    // work is done.
+    ModuleOptimizationOptions optimization;
+    ExecutionPrecision precision;
+    WeightMemoryOptions weight_memory;
+    json::json warmup_input;
+    int warmup_runs;
+    double max_precision_error;
+    try {
+      optimization = ModuleOptimizationOptions::FromJson(options);
+      precision = StringToExecutionPrecision(
+          options.value("precision", std::string("fp32")));
+      weight_memory = WeightMemoryOptions::FromJson(options);
+      warmup_input = options.value("warmup_input", json::json());
+      warmup_runs = options.value("warmup_runs", 3);
+      max_precision_error = options.value("max_precision_error", 0.02);
+      if (options.contains("shape_buckets")) {
+        m_shape_buckets = ShapeBuckets(options.at("shape_buckets"));
+      }
+      if (options.contains("output_data_type")) {
+        m_output_type = StringToScalarType(
+            options.at("output_data_type").get<std::string>());
+      }
+    } catch (const json::json::exception &err) {
+      throw ServableConfigError("Invalid options for " + m_path + ": " +
+                                err.what());
+    } catch (const TensorTypeError &err) {
+      throw ServableConfigError("Invalid output_data_type for " + m_path +
+                                ": " + err.what());
+    }
+    if (precision != ExecutionPrecision::kFp32) {
+      // Before optimizing, since freezing turns weights into constants.
+      SetPrecision(precision, max_precision_error, warmup_input, warmup_runs);
+    }
+    if (optimization.Enabled()) {
+      Optimize(optimization, warmup_input, warmup_runs);
+    } else if (!warmup_input.is_null() &&
+               precision == ExecutionPrecision::kFp32) {
+      // SetPrecision logs its own warmup latency.
+      m_logger->info("Warmup forward for " + m_path + ": " +
+                     LatencyToString(Warmup(warmup_input, warmup_runs)));
+    }
+    // Last, since optimizing may replace the weights.
+    PlaceWeights(weight_memory);
+    if (m_shape_buckets.Enabled() && !warmup_input.is_null()) {
+      WarmBuckets(warmup_input, warmup_runs);
+    }
+  }
+
+  const std::string &Path() const { return m_path; }
+
+  ExecutionPrecision Precision() const { return m_precision; }
+
+  WeightFootprint Footprint() const { return MeasureWeights(m_servable); }
+
+  // Moves the pages backing the module's weights onto a NUMA node, returning
+  // the number of bytes bound.
+  size_t BindToNumaNode(const int &node) {
+    const auto bytes = BindWeightsToNumaNode(m_servable, node);
+    if (!bytes) {
+      m_logger->warn("Unable to bind weights to NUMA node " +
+                     std::to_string(node));
+    }
+    return bytes;
+  }
+
+ protected:
+  // Fills in defaulted arguments and rejects extra ones, as Module::forward
+  // does. The stack starts with the module itself.
+  void NormalizeInputs(torch::jit::Stack &stack) const {
+    m_forward->getSchema().checkAndNormalizeInputs(stack);
+  }
+
+  // Casts floating point inputs to the precision of the module's weights.
+  void CastInputs(std::vector<torch::jit::IValue> &inputs) const {
+    if (m_precision != ExecutionPrecision::kBf16Weights) {
+      return;
+    }
+    for (auto &input : inputs) {
+      input = CastFloatingTensors(input, torch::kBFloat16);
+    }
+  }
+
  private:
+  // Optimizes the module, logging how that changed its op count, warmup
+  // latency and output.
+  void Optimize(const ModuleOptimizationOptions &optimization,
+                const json::json &warmup_input, const int &warmup_runs) {
+    const auto ops_before = CountGraphOps(m_servable);
+    std::string latency_before;
+    torch::jit::IValue reference;
+    if (!warmup_input.is_null()) {
+      latency_before =
+          LatencyToString(Warmup(warmup_input, warmup_runs, &reference));
+    }
+    QuantizationReport quantization;
+    try {
+      SetServable(OptimizeModule(m_servable, optimization, &quantization));
+      m_frozen = true;
+    } catch (const std::exception &err) {
+      m_logger->warn("Unable to optimize " + m_path +
+                     ", running it as loaded: " + err.what());
+      return;
+    }
+    std::string message = "Optimized " + m_path + ": " +
+                          std::to_string(ops_before) + " -> " +
+                          std::to_string(CountGraphOps(m_servable)) + " ops";
+    if (optimization.quantize_dynamic_int8) {
+      message += ", " + quantization.ToString();
+    }
+    if (!warmup_input.is_null()) {
+      torch::jit::IValue output;
+      message += ", warmup forward " + latency_before + " -> " +
+                 LatencyToString(Warmup(warmup_input, warmup_runs, &output));
+      try {
+        message += ", " + CompareOutputs(reference, output).ToString();
+      } catch (const std::exception &err) {
+        m_logger->warn("Optimizing " + m_path +
+                       " changed its output: " + err.what());
+      }
+    }
+    m_logger->info(message);
+  }
+
+  // Applies `options` to the module's weights, and reports their footprint
+  // in the log and on /metrics.
+  void PlaceWeights(const WeightMemoryOptions &options) {
+    if (options.Enabled()) {
+      for (const auto &warning : torch_serving::PlaceWeights(m_servable,
+                                                             options)) {
+        m_logger->warn(m_path + ": " + warning);
+      }
+    }
+    const auto footprint = Footprint();
+    m_logger->info("Weights of " + m_path + ": " + footprint.ToString());
+    auto &metrics = MetricsRegistry::Global();
+    metrics.SetGauge("weight_bytes", m_path, footprint.bytes);
+    metrics.SetGauge("weight_resident_bytes", m_path,
+                     footprint.resident_bytes);
+    metrics.SetGauge("weight_huge_page_bytes", m_path,
+                     footprint.huge_page_bytes);
+    metrics.SetGauge("weight_locked_bytes", m_path, footprint.locked_bytes);
+  }
+
+  // Runs the warmup input through the model at the length of every shape
+  // bucket, so each is profiled before requests arrive.
+  void WarmBuckets(const json::json &input, const int &runs) {
+    std::string message = "Warmed up shape buckets of " + m_path + ":";
+    for (const auto &size : m_shape_buckets.Sizes()) {
+      auto latency = std::chrono::microseconds::zero();
+      for (int run = 0; run < std::max(runs, 1); ++run) {
+        auto inputs = m_shape_buckets.Resize(Decode(input), size);
+        const auto start = std::chrono::steady_clock::now();
+        Forward(std::move(inputs));
+        latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+      }
+      message += " " + std::to_string(size) + ": " + LatencyToString(latency);
+    }
+    m_logger->info(message);
+  }
+
+  void SetServable(torch::jit::script::Module servable) {
+    m_servable = std::move(servable);
+    m_forward = &m_servable.get_method("forward").function();
+  }
+
+  // Runs the module in `precision`, unless its output on the warmup input
+  // then differs from the fp32 output by more than `max_error`, relative to
+  // the largest value in the fp32 output.
+  void SetPrecision(const ExecutionPrecision &precision,
+                    const double &max_error, const json::json &warmup_input,
+                    const int &warmup_runs) {
+    if (precision == ExecutionPrecision::kBf16Autocast &&
+        !SupportsBf16Autocast()) {
+      m_logger->warn("bf16_autocast needs libtorch >= 1.10, running " +
+                     m_path + " in fp32");
+      return;
+    }
+    torch::jit::IValue reference;
+    std::string latency_before;
+    if (!warmup_input.is_null()) {
+      latency_before =
+          LatencyToString(Warmup(warmup_input, warmup_runs, &reference));
+    }
+    auto fp32_servable = m_servable;
+    if (precision == ExecutionPrecision::kBf16Weights) {
+      auto converted = m_servable.clone();
+      converted.to(torch::kBFloat16);
+      SetServable(converted);
+    }
+    m_precision = precision;
+    std::string message =
+        "Running " + m_path + " in " + ExecutionPrecisionToString(precision);
+    if (!warmup_input.is_null()) {
+      torch::jit::IValue output;
+      message += ", warmup forward " + latency_before + " -> " +
+                 LatencyToString(Warmup(warmup_input, warmup_runs, &output));
+      OutputDifference difference;
+      try {
+        difference = CompareOutputs(reference, output);
+      } catch (const std::invalid_argument &) {
+        difference.max_abs_diff = std::numeric_limits<double>::infinity();
+        difference.max_rel_diff = std::numeric_limits<double>::infinity();
+      }
+      message += ", " + difference.ToString();
+      if (difference.max_rel_diff > max_error) {
+        m_logger->warn(message + " vs. fp32, above max_precision_error " +
+                       std::to_string(max_error) + ", running it in fp32");
+        SetServable(fp32_servable);
+        m_precision = ExecutionPrecision::kFp32;
+        return;
+      }
+      message += " vs. fp32";
+    }
+    if (!m_output_type) {
+      m_output_type = torch::kFloat;
+    }
+    m_logger->info(message);
+  }
+
+  // Runs `input` through the model `runs` times, returning the latency of the
+  // last run, and its output in `output`, if given.
+  std::chrono::microseconds Warmup(const json::json &input, const int &runs,
+                                   torch::jit::IValue *output = nullptr) {
+    auto latency = std::chrono::microseconds::zero();
+    for (int run = 0; run < std::max(runs, 1); ++run) {
+      auto inputs = Decode(input);
+      const auto start = std::chrono::steady_clock::now();
+      auto result = Forward(std::move(inputs));
+      latency = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start);
+      if (output) {
+        *output = std::move(result);
+      }
+    }
+    return latency;
+  }
+
+  static std::string LatencyToString(const std::chrono::microseconds &latency) {
+    return std::to_string(latency.count() / 1000.0) + "ms";
+  }
+
   std::string m_path;
 
  protected:
   torch::jit::script::Module m_servable;
   std::shared_ptr<spdlog::logger> m_logger;
+  // m_servable's forward, owned by its compilation unit.
+  torch::jit::Function *m_forward = nullptr;
+  // Whether Prepare froze the module.
+  bool m_frozen = false;
+  ExecutionPrecision m_precision = ExecutionPrecision::kFp32;
+  // What floating point outputs are cast to, if anything.
+  c10::optional<torch::ScalarType> m_output_type;
+  ShapeBuckets m_shape_buckets;
+};
+
+// Runs TorchScript modules on the CPU through libtorch's Static Runtime,
+// which cuts the interpreter's per-op overhead for small models (see
+// StaticRuntimePool). Models whose graphs it doesn't support run through the
+// interpreter instead.
+class TorchStaticServable : public TorchJITServable {
+ public:
+  explicit TorchStaticServable(
+      std::string path, const json::json &options = json::json::object())
+      : TorchJITServable(std::move(path), options) {
+    try {
+      m_runtimes.reset(new StaticRuntimePool(m_servable, m_frozen));
+    } catch (const std::exception &err) {
+      m_logger->warn("Unable to run " + Path() +
+                     " with Static Runtime, falling back to the "
+                     "interpreter: " +
+                     err.what());
+    }
+  }
+
+  torch::jit::IValue Forward(std::vector<torch::jit::IValue> inputs) override {
+    if (!m_runtimes) {
+      return TorchJITServable::Forward(std::move(inputs));
+    }
+    const auto length = m_shape_buckets.Pad(inputs);
+    // Static Runtime only normalizes inputs passed with keyword arguments.
+    inputs.insert(inputs.begin(), m_servable._ivalue());
+    NormalizeInputs(inputs);
+    inputs.erase(inputs.begin());
+    CastInputs(inputs);
+    InferenceModeGuard inference_mode;
+    Bf16AutocastGuard autocast(m_precision ==
+                               ExecutionPrecision::kBf16Autocast);
+    return m_shape_buckets.Slice(m_runtimes->Run(inputs), length);
+  }
+
+  bool UsesStaticRuntime() const { return static_cast<bool>(m_runtimes); }
+
+ private:
+  std::unique_ptr<StaticRuntimePool> m_runtimes;
 };
 
 class TorchJITCudaServable : TorchJITServable {
  public:
-  explicit TorchJITCudaServable(std::string path) : TorchJITServable(path) {}
-  json::json RunInference(const json::json &input) override {
-    return TorchValueToJson(
-        m_servable.forward(JsonToTorchValue(input, at::kCUDA)));
+  explicit TorchJITCudaServable(
+      std::string path, const json::json &options = json::json::object())
+      : TorchJITServable(path, options) {}
+  using TorchJITServable::RunInference;
+  using TorchJITServable::Forward;
+  using TorchJITServable::Encode;
+
+  std::vector<torch::jit::IValue> Decode(const json::json &input) override {
+    return JsonToTorchValue(input, at::kCUDA);
   }
 
   torch::jit::script::Module LoadServable(const std::string &path) override {
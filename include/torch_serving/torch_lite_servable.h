@@ -0,0 +1,80 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__TORCH_LITE_SERVABLE_H_
+#define TORCH_SERVING__TORCH_LITE_SERVABLE_H_
+
+#include <torch/script.h>
+#include <torch/version.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if TORCH_VERSION_MAJOR > 1 || TORCH_VERSION_MINOR >= 5
+#define TORCH_SERVING_HAS_LITE_INTERPRETER 1
+#include <torch/csrc/jit/mobile/import.h>
+#include <torch/csrc/jit/mobile/module.h>
+#endif
+
+#include "extern/json.hpp"
+#include "inference_mode.h"
+#include "tensor_io.h"
+
+namespace json = nlohmann;
+
+namespace torch_serving {
+
+#ifdef TORCH_SERVING_HAS_LITE_INTERPRETER
+
+// Runs models saved with `_save_for_lite_interpreter` through libtorch's lite
+// (mobile) interpreter. Their archives hold bytecode rather than TorchScript
+// source, so they're smaller and load faster, and the interpreter has less
+// overhead per op, which suits tiny models. Runs on the CPU.
+class TorchLiteServable {
+ public:
+  explicit TorchLiteServable(std::string path)
+      : m_path(std::move(path)),
+        m_module(torch::jit::_load_for_mobile(m_path)) {}
+
+  json::json RunInference(const json::json &input) {
+    return Encode(Forward(Decode(input)));
+  }
+
+  std::vector<torch::jit::IValue> Decode(const json::json &input) {
+    return JsonToTorchValue(input, at::kCPU);
+  }
+
+  torch::jit::IValue Forward(std::vector<torch::jit::IValue> inputs) {
+    InferenceModeGuard inference_mode;
+    return m_module.forward(std::move(inputs));
+  }
+
+  json::json Encode(const torch::jit::IValue &output) {
+    return TorchValueToJson(output);
+  }
+
+ private:
+  std::string m_path;
+  torch::jit::mobile::Module m_module;
+};
+
+#else
+
+class TorchLiteServable {
+ public:
+  explicit TorchLiteServable(std::string path) {
+    throw std::runtime_error(
+        "The lite interpreter needs libtorch >= 1.5, unable to load: " + path);
+  }
+
+  json::json RunInference(const json::json &input) { return json::json(); }
+};
+
+#endif
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__TORCH_LITE_SERVABLE_H_
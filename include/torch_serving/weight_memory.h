@@ -0,0 +1,80 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__WEIGHT_MEMORY_H_
+#define TORCH_SERVING__WEIGHT_MEMORY_H_
+
+#include <torch/script.h>
+
+#include <string>
+#include <vector>
+
+#include "extern/json.hpp"
+#include "servable_config.h"
+
+namespace json = nlohmann;
+
+namespace torch_serving {
+
+enum class HugePages {
+  kNone,
+  // madvise(MADV_HUGEPAGE), i.e., transparent huge pages where the kernel
+  // has them to spare.
+  kTransparent,
+  // MAP_HUGETLB, from the pages reserved in /proc/sys/vm/nr_hugepages.
+  kHugetlb
+};
+
+// Where a servable's weights live in memory, from its servable config:
+//
+//   "huge_pages": "none" (default), "transparent" or "hugetlb".
+//   "prefault_weights": touch every page of the weights at load time.
+//   "mlock_weights": lock the weights in memory, so they're never swapped
+//       out. Subject to RLIMIT_MEMLOCK.
+struct WeightMemoryOptions {
+  HugePages huge_pages = HugePages::kNone;
+  bool prefault = false;
+  bool mlock = false;
+
+  static WeightMemoryOptions FromJson(const json::json &options);
+
+  bool Enabled() const {
+    return huge_pages != HugePages::kNone || prefault || mlock;
+  }
+};
+
+// How much of a module's CPU weights are resident, on huge pages and locked.
+// Huge page and locked bytes are read per mapping from /proc/self/smaps, so
+// they're approximate for weights sharing mappings with other memory.
+struct WeightFootprint {
+  size_t bytes = 0;
+  size_t resident_bytes = 0;
+  size_t huge_page_bytes = 0;
+  size_t locked_bytes = 0;
+
+  std::string ToString() const;
+  json::json ToJson() const;
+};
+
+// Applies `options` to the CPU weights of a module: its parameters, buffers
+// and, for frozen modules, the tensor constants in its graphs. With huge
+// pages, weights are copied into one 2 MiB aligned mapping (which leaves
+// them prefaulted) and the original memory is freed. Returns warnings for
+// anything which couldn't be done, e.g., hugetlb falling back to
+// transparent huge pages when none are reserved.
+std::vector<std::string> PlaceWeights(const torch::jit::script::Module &module,
+                                      const WeightMemoryOptions &options);
+
+// Binds (and migrates) the pages of a module's CPU weights to a NUMA node,
+// returning the number of bytes bound. Weights placed in a huge page arena
+// by PlaceWeights are bound as one range, so its huge pages stay whole.
+size_t BindWeightsToNumaNode(const torch::jit::script::Module &module,
+                             const int &node);
+
+WeightFootprint MeasureWeights(const torch::jit::script::Module &module);
+
+}  // namespace torch_serving
+
+#endif  // TORCH_SERVING__WEIGHT_MEMORY_H_
@@ -0,0 +1,197 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#include "torch_serving/block_pool.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <new>
+
+namespace torch_serving {
+
+namespace {
+
+// Multiples of kAlignment up to 1 KiB, then four per power of two up to
+// 2^63.
+constexpr size_t kSmallBins = 16;
+constexpr size_t kNumBins = kSmallBins + 4 * (63 - 10) + 4;
+constexpr size_t kUnpooled = static_cast<size_t>(-1);
+// Smaller blocks come from the heap, larger ones are mapped, so they can be
+// unmapped (and advised) separately.
+constexpr size_t kMapThreshold = size_t(256) << 10;
+constexpr size_t kHugePageBytes = size_t(2) << 20;
+
+size_t FloorLog2(size_t value) {
+  size_t log = 0;
+  while (value >>= 1) {
+    ++log;
+  }
+  return log;
+}
+
+}  // namespace
+
+// Sits just before every block handed out, padded to keep blocks aligned.
+struct alignas(BlockPool::kAlignment) BlockPool::Header {
+  BlockPool *pool;
+  // Or kUnpooled.
+  size_t bin;
+  // Bytes after the header.
+  size_t bytes;
+  bool mapped;
+};
+
+BlockPool::BlockPool(const BlockPoolOptions &options)
+    : options_(options),
+      bins_(new Bin[kNumBins]),
+      bytes_in_use_(0),
+      bytes_cached_(0),
+      allocations_(0),
+      reused_(0),
+      unpooled_(0),
+      released_(0) {
+  static_assert(sizeof(Header) == kAlignment,
+                "Headers must keep blocks aligned");
+}
+
+BlockPool::~BlockPool() { Trim(); }
+
+size_t BlockPool::BinIndex(const size_t &bytes) {
+  if (bytes <= kSmallBins * kAlignment) {
+    return bytes ? (bytes - 1) / kAlignment : 0;
+  }
+  // bytes is in (2^log, 2^(log + 1)], split into four classes.
+  const auto log = FloorLog2(bytes - 1);
+  const auto base = size_t(1) << log;
+  const auto step = base / 4;
+  const auto quarter = (bytes - base + step - 1) / step;
+  return kSmallBins + (log - 10) * 4 + quarter - 1;
+}
+
+size_t BlockPool::SizeClassBytes(const size_t &bytes) {
+  if (bytes <= kSmallBins * kAlignment) {
+    return (BinIndex(bytes) + 1) * kAlignment;
+  }
+  const auto log = FloorLog2(bytes - 1);
+  const auto base = size_t(1) << log;
+  const auto step = base / 4;
+  return base + (bytes - base + step - 1) / step * step;
+}
+
+void *BlockPool::Allocate(const size_t &bytes) {
+  if (!bytes) {
+    return nullptr;
+  }
+  ++allocations_;
+  if (bytes > options_.max_block_bytes) {
+    ++unpooled_;
+    return Map(bytes, kUnpooled);
+  }
+  const auto bin = BinIndex(bytes);
+  {
+    std::lock_guard<std::mutex> lock(bins_[bin].mutex);
+    auto &blocks = bins_[bin].blocks;
+    if (!blocks.empty()) {
+      auto *data = blocks.back();
+      blocks.pop_back();
+      const auto block_bytes = (static_cast<Header *>(data) - 1)->bytes;
+      bytes_cached_ -= block_bytes;
+      bytes_in_use_ += block_bytes;
+      ++reused_;
+      return data;
+    }
+  }
+  return Map(SizeClassBytes(bytes), bin);
+}
+
+void *BlockPool::Map(const size_t &bytes, const size_t &bin) {
+  const auto total = bytes + sizeof(Header);
+  void *memory = nullptr;
+  const bool mapped = total >= kMapThreshold;
+  if (mapped) {
+    memory = mmap(nullptr, total, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (options_.huge_pages && total >= kHugePageBytes) {
+      madvise(memory, total, MADV_HUGEPAGE);
+    }
+#endif
+  } else if (posix_memalign(&memory, kAlignment, total)) {
+    throw std::bad_alloc();
+  }
+  if (options_.prefault) {
+    const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto *bytes_ptr = static_cast<volatile char *>(memory);
+    for (size_t offset = 0; offset < total; offset += page) {
+      bytes_ptr[offset] = 0;
+    }
+  }
+  auto *header = new (memory) Header{this, bin, bytes, mapped};
+  bytes_in_use_ += bytes;
+  return header + 1;
+}
+
+void BlockPool::Free(void *data) {
+  if (!data) {
+    return;
+  }
+  (static_cast<Header *>(data) - 1)->pool->Recycle(data);
+}
+
+void BlockPool::Recycle(void *data) {
+  const auto *header = static_cast<Header *>(data) - 1;
+  bytes_in_use_ -= header->bytes;
+  if (header->bin != kUnpooled) {
+    if (bytes_cached_.fetch_add(header->bytes) + header->bytes <=
+        options_.max_cached_bytes) {
+      std::lock_guard<std::mutex> lock(bins_[header->bin].mutex);
+      bins_[header->bin].blocks.push_back(data);
+      return;
+    }
+    bytes_cached_ -= header->bytes;
+  }
+  Release(data);
+}
+
+void BlockPool::Release(void *data) {
+  auto *header = static_cast<Header *>(data) - 1;
+  ++released_;
+  if (header->mapped) {
+    munmap(header, header->bytes + sizeof(Header));
+  } else {
+    free(header);
+  }
+}
+
+void BlockPool::Trim() {
+  for (size_t bin = 0; bin < kNumBins; ++bin) {
+    std::vector<void *> blocks;
+    {
+      std::lock_guard<std::mutex> lock(bins_[bin].mutex);
+      blocks.swap(bins_[bin].blocks);
+    }
+    for (auto *data : blocks) {
+      bytes_cached_ -= (static_cast<Header *>(data) - 1)->bytes;
+      Release(data);
+    }
+  }
+}
+
+json::json BlockPool::Stats() const {
+  return {{"allocations", allocations_.load()},
+          {"reused", reused_.load()},
+          {"unpooled", unpooled_.load()},
+          {"released", released_.load()},
+          {"bytes_in_use", bytes_in_use_.load()},
+          {"bytes_cached", bytes_cached_.load()},
+          {"max_cached_bytes", options_.max_cached_bytes}};
+}
+
+}  // namespace torch_serving
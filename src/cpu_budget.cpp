@@ -0,0 +1,136 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#include "torch_serving/cpu_budget.h"
+
+#include <ATen/Parallel.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+namespace torch_serving {
+
+namespace {
+
+// Returns the cgroup (v2) path of this process, e.g. "/system.slice/foo".
+std::string CurrentCgroupV2Path() {
+  std::ifstream cgroup("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(cgroup, line)) {
+    if (line.compare(0, 3, "0::") == 0) {
+      return line.substr(3);
+    }
+  }
+  return "";
+}
+
+// Returns the CPU quota in cores, or a non-positive value if unlimited.
+double CgroupCpuQuota() {
+  // cgroup v2: "<quota> <period>" or "max <period>"
+  for (const auto &path :
+       {"/sys/fs/cgroup" + CurrentCgroupV2Path() + "/cpu.max",
+        std::string("/sys/fs/cgroup/cpu.max")}) {
+    std::ifstream cpu_max(path);
+    std::string quota;
+    double period = 0;
+    if (cpu_max >> quota >> period) {
+      if (quota == "max" || period <= 0) {
+        return -1;
+      }
+      return std::stod(quota) / period;
+    }
+  }
+  // cgroup v1
+  for (const std::string root :
+       {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"}) {
+    std::ifstream quota_file(root + "/cpu.cfs_quota_us");
+    std::ifstream period_file(root + "/cpu.cfs_period_us");
+    double quota = 0, period = 0;
+    if (quota_file >> quota && period_file >> period) {
+      return (quota > 0 && period > 0) ? quota / period : -1;
+    }
+  }
+  return -1;
+}
+
+size_t AffinityCores() {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+    return CPU_COUNT(&cpu_set);
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+}  // namespace
+
+size_t AvailableCores() {
+  auto cores = AffinityCores();
+  auto quota = CgroupCpuQuota();
+  if (quota > 0) {
+    cores = std::min(cores, static_cast<size_t>(std::ceil(quota)));
+  }
+  return std::max<size_t>(cores, 1);
+}
+
+std::string ThreadBudget::ToString() const {
+  std::stringstream stream;
+  stream << "cores=" << cores << ", http_threads=" << http_threads
+         << ", decode_threads=" << decode_threads
+         << ", encode_threads=" << encode_threads
+         << ", inference_workers=" << inference_workers
+         << ", intra_op_threads=" << intra_op_threads
+         << ", inter_op_threads=" << inter_op_threads;
+  return stream.str();
+}
+
+ThreadBudget ComputeThreadBudget(const ThreadBudget &requested) {
+  ThreadBudget budget = requested;
+  if (!budget.cores) {
+    budget.cores = AvailableCores();
+  }
+  // By default, run one single-threaded forward pass per core, which gives
+  // the best throughput for the small models we usually serve. Deployments
+  // which need lower latency can raise --intra-op-threads instead.
+  if (!budget.inference_workers && !budget.intra_op_threads) {
+    budget.intra_op_threads = 1;
+  }
+  if (!budget.inference_workers) {
+    budget.inference_workers =
+        std::max<size_t>(budget.cores / budget.intra_op_threads, 1);
+  }
+  if (!budget.intra_op_threads) {
+    budget.intra_op_threads =
+        std::max<size_t>(budget.cores / budget.inference_workers, 1);
+  }
+  if (!budget.inter_op_threads) {
+    budget.inter_op_threads = budget.intra_op_threads;
+  }
+  // HTTP threads mostly wait on inference, so we need enough of them to keep
+  // every inference worker fed while others parse and serialize JSON.
+  if (!budget.http_threads) {
+    budget.http_threads = 2 * budget.inference_workers;
+  }
+  // Converting JSON to and from tensors is cheap next to a forward pass, so
+  // the conversion stages get half as many threads as inference.
+  if (!budget.decode_threads) {
+    budget.decode_threads = std::max<size_t>(budget.inference_workers / 2, 1);
+  }
+  if (!budget.encode_threads) {
+    budget.encode_threads = std::max<size_t>(budget.inference_workers / 2, 1);
+  }
+  return budget;
+}
+
+void ApplyThreadBudget(const ThreadBudget &budget) {
+  at::set_num_threads(static_cast<int>(budget.intra_op_threads));
+  at::set_num_interop_threads(static_cast<int>(budget.inter_op_threads));
+}
+
+}  // namespace torch_serving
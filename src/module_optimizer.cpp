@@ -0,0 +1,161 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#include "torch_serving/module_optimizer.h"
+
+#include <torch/csrc/jit/passes/inliner.h>
+#include <torch/version.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#if TORCH_VERSION_MAJOR == 1 && TORCH_VERSION_MINOR < 10
+#include <torch/csrc/jit/passes/freeze_module.h>
+#endif
+
+namespace torch_serving {
+
+namespace {
+
+size_t CountBlockOps(const torch::jit::Block *block) {
+  size_t ops = 0;
+  for (const auto *node : block->nodes()) {
+    if (node->kind() != c10::prim::Constant) {
+      ++ops;
+    }
+    for (const auto *nested : node->blocks()) {
+      ops += CountBlockOps(nested);
+    }
+  }
+  return ops;
+}
+
+void CompareOutputs(const torch::jit::IValue &reference,
+                    const torch::jit::IValue &output, double &max_abs_diff,
+                    double &max_reference) {
+  if (reference.isTensor() && output.isTensor()) {
+    const auto expected = reference.toTensor().to(torch::kDouble);
+    const auto actual = output.toTensor().to(torch::kDouble);
+    if (expected.sizes() != actual.sizes()) {
+      throw std::invalid_argument("Outputs have different shapes");
+    }
+    if (expected.numel()) {
+      max_abs_diff = std::max(
+          max_abs_diff, (expected - actual).abs().max().item<double>());
+      max_reference =
+          std::max(max_reference, expected.abs().max().item<double>());
+    }
+  } else if (reference.isTuple() && output.isTuple()) {
+    const auto &expected = reference.toTuple()->elements();
+    const auto &actual = output.toTuple()->elements();
+    if (expected.size() != actual.size()) {
+      throw std::invalid_argument("Outputs have different structures");
+    }
+    for (size_t i = 0; i < expected.size(); ++i) {
+      CompareOutputs(expected[i], actual[i], max_abs_diff, max_reference);
+    }
+  } else if (reference.isList() && output.isList()) {
+    const auto expected = reference.toList();
+    const auto actual = output.toList();
+    if (expected.size() != actual.size()) {
+      throw std::invalid_argument("Outputs have different structures");
+    }
+    for (size_t i = 0; i < expected.size(); ++i) {
+      CompareOutputs(expected.get(i), actual.get(i), max_abs_diff,
+                     max_reference);
+    }
+  } else if (reference.isGenericDict() && output.isGenericDict()) {
+    const auto actual = output.toGenericDict();
+    for (const auto &entry : reference.toGenericDict()) {
+      auto match = actual.find(entry.key());
+      if (match == actual.end()) {
+        throw std::invalid_argument("Outputs have different structures");
+      }
+      CompareOutputs(entry.value(), match->value(), max_abs_diff,
+                     max_reference);
+    }
+  } else if (reference.tagKind() != output.tagKind()) {
+    throw std::invalid_argument("Outputs have different structures");
+  }
+}
+
+}  // namespace
+
+std::string OutputDifference::ToString() const {
+  return "max abs diff " + std::to_string(max_abs_diff) + ", max rel diff " +
+         std::to_string(max_rel_diff);
+}
+
+OutputDifference CompareOutputs(const torch::jit::IValue &reference,
+                                const torch::jit::IValue &output) {
+  OutputDifference difference;
+  double max_reference = 0.0;
+  CompareOutputs(reference, output, difference.max_abs_diff, max_reference);
+  if (max_reference > 0.0) {
+    difference.max_rel_diff = difference.max_abs_diff / max_reference;
+  }
+  return difference;
+}
+
+ModuleOptimizationOptions ModuleOptimizationOptions::FromJson(
+    const json::json &options) {
+  ModuleOptimizationOptions parsed;
+  parsed.freeze = options.value("freeze", false);
+  parsed.optimize_for_inference =
+      options.value("optimize_for_inference", false);
+  const auto quantize = options.value("quantize", "none");
+  if (quantize == "dynamic_int8") {
+    parsed.quantize_dynamic_int8 = true;
+  } else if (quantize != "none") {
+    throw ServableConfigError("Unknown quantization: " + quantize +
+                              " (expected `none` or `dynamic_int8`)");
+  }
+  return parsed;
+}
+
+size_t CountGraphOps(const torch::jit::script::Module &module) {
+  auto graph = module.get_method("forward").graph()->copy();
+  torch::jit::Inline(*graph);
+  return CountBlockOps(graph->block());
+}
+
+torch::jit::script::Module OptimizeModule(
+    const torch::jit::script::Module &module,
+    const ModuleOptimizationOptions &options,
+    QuantizationReport *quantization) {
+#if TORCH_VERSION_MAJOR > 1 || TORCH_VERSION_MINOR >= 10
+  auto frozen = torch::jit::freeze(module);
+  // Quantized before the inference optimizations, which would otherwise
+  // convert the linear layers to other ops first.
+  if (options.quantize_dynamic_int8) {
+    auto report = QuantizeDynamicInt8(frozen);
+    if (quantization) {
+      *quantization = report;
+    }
+  }
+  if (options.optimize_for_inference) {
+    return torch::jit::optimize_for_inference(frozen);
+  }
+  return frozen;
+#elif TORCH_VERSION_MINOR >= 7
+  // Before 1.10, only freezing is exposed to C++.
+  if (options.optimize_for_inference) {
+    throw std::runtime_error(
+        "optimize_for_inference needs libtorch >= 1.10, use `freeze` alone");
+  }
+  auto frozen = torch::jit::freeze_module(module);
+  if (options.quantize_dynamic_int8) {
+    auto report = QuantizeDynamicInt8(frozen);
+    if (quantization) {
+      *quantization = report;
+    }
+  }
+  return frozen;
+#else
+  throw std::runtime_error("Freezing modules needs libtorch >= 1.7");
+#endif
+}
+
+}  // namespace torch_serving
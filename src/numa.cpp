@@ -0,0 +1,141 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#include "torch_serving/numa.h"
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+
+namespace torch_serving {
+
+namespace {
+
+// From <numaif.h>, which is only shipped with libnuma.
+constexpr int kMpolBind = 2;
+constexpr unsigned kMpolMfMove = 1 << 1;
+
+std::vector<int> AllowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &cpu_set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  return cpus;
+}
+
+}  // namespace
+
+std::vector<int> ParseCpuList(const std::string &cpu_list) {
+  std::vector<int> cpus;
+  std::stringstream stream(cpu_list);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    auto dash = range.find('-');
+    auto first = std::stoi(range.substr(0, dash));
+    auto last =
+        dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (auto cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<NumaNode> NumaTopology() {
+  return NumaTopology("/sys/devices/system/node", AllowedCpus());
+}
+
+std::vector<NumaNode> NumaTopology(const std::string &node_root,
+                                   const std::vector<int> &allowed) {
+  std::vector<NumaNode> nodes;
+  for (int node = 0;; ++node) {
+    std::ifstream cpu_list(node_root + "/node" + std::to_string(node) +
+                           "/cpulist");
+    std::string contents;
+    if (!std::getline(cpu_list, contents)) {
+      break;
+    }
+    NumaNode numa_node{node, {}};
+    for (const auto &cpu : ParseCpuList(contents)) {
+      if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+        numa_node.cpus.push_back(cpu);
+      }
+    }
+    if (!numa_node.cpus.empty()) {
+      nodes.push_back(numa_node);
+    }
+  }
+  if (nodes.empty()) {
+    nodes.push_back({0, allowed});
+  }
+  return nodes;
+}
+
+bool PinCurrentThread(const std::vector<int> &cpus) {
+  if (cpus.empty()) {
+    return false;
+  }
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (const auto &cpu : cpus) {
+    CPU_SET(cpu, &cpu_set);
+  }
+  // N.B., a pid of zero applies to the calling thread only.
+  return sched_setaffinity(0, sizeof(cpu_set), &cpu_set) == 0;
+}
+
+size_t BindMemoryToNode(const void *address, const size_t &length,
+                        const int &node) {
+  if (!address || !length || node < 0 || node >= 64) {
+    return 0;
+  }
+  // mbind works on whole pages, so shrink the range to the pages it covers.
+  const auto page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const auto begin = reinterpret_cast<uintptr_t>(address);
+  const auto start = (begin + page_size - 1) & ~(page_size - 1);
+  const auto end = (begin + length) & ~(page_size - 1);
+  if (end <= start) {
+    return 0;
+  }
+  unsigned long node_mask = 1UL << node;
+  if (syscall(SYS_mbind, start, end - start, kMpolBind, &node_mask,
+              sizeof(node_mask) * 8, kMpolMfMove) != 0) {
+    return 0;
+  }
+  return end - start;
+}
+
+std::string CpusToString(const std::vector<int> &cpus) {
+  std::stringstream stream;
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    // Collapse runs of consecutive CPUs into ranges.
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+      ++j;
+    }
+    stream << (i ? "," : "") << cpus[i];
+    if (j > i) {
+      stream << "-" << cpus[j];
+    }
+    i = j;
+  }
+  return stream.str();
+}
+
+}  // namespace torch_serving
@@ -0,0 +1,75 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#include "torch_serving/pooled_allocator.h"
+
+#include <c10/core/Allocator.h>
+#include <torch/version.h>
+
+#include <atomic>
+
+#include "torch_serving/metrics.h"
+
+// libtorch 2.3 made Allocator::allocate non-const, and added copy_data.
+#if TORCH_VERSION_MAJOR > 2 || \
+    (TORCH_VERSION_MAJOR == 2 && TORCH_VERSION_MINOR >= 3)
+#define TORCH_SERVING_ALLOCATE_CONST
+#define TORCH_SERVING_HAS_COPY_DATA 1
+#else
+#define TORCH_SERVING_ALLOCATE_CONST const
+#endif
+
+namespace torch_serving {
+
+namespace {
+
+class PooledCpuAllocator final : public c10::Allocator {
+ public:
+  explicit PooledCpuAllocator(const BlockPoolOptions &options)
+      : pool_(options) {}
+
+  c10::DataPtr allocate(size_t bytes) TORCH_SERVING_ALLOCATE_CONST override {
+    auto *data = pool_.Allocate(bytes);
+    return {data, data, &BlockPool::Free, c10::Device(c10::DeviceType::CPU)};
+  }
+
+  c10::DeleterFnPtr raw_deleter() const override { return &BlockPool::Free; }
+
+#ifdef TORCH_SERVING_HAS_COPY_DATA
+  void copy_data(void *dest, const void *src,
+                 std::size_t count) const override {
+    default_copy_data(dest, src, count);
+  }
+#endif
+
+  BlockPool &Pool() const { return pool_; }
+
+ private:
+  mutable BlockPool pool_;
+};
+
+// Never freed: tensors may be released during static destruction.
+std::atomic<PooledCpuAllocator *> installed(nullptr);
+
+}  // namespace
+
+void InstallPooledCpuAllocator(const BlockPoolOptions &options) {
+  auto *allocator = new PooledCpuAllocator(options);
+  PooledCpuAllocator *expected = nullptr;
+  if (!installed.compare_exchange_strong(expected, allocator)) {
+    delete allocator;
+    return;
+  }
+  c10::SetAllocator(c10::DeviceType::CPU, allocator);
+  MetricsRegistry::Global().RegisterCollector(
+      "cpu_allocator", [allocator] { return allocator->Pool().Stats(); });
+}
+
+BlockPool *PooledCpuAllocatorPool() {
+  auto *allocator = installed.load();
+  return allocator ? &allocator->Pool() : nullptr;
+}
+
+}  // namespace torch_serving
@@ -0,0 +1,117 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#include "torch_serving/precision.h"
+
+#include <torch/version.h>
+
+#include <stdexcept>
+
+#if TORCH_VERSION_MAJOR > 1 || TORCH_VERSION_MINOR >= 10
+#define TORCH_SERVING_HAS_CPU_AUTOCAST 1
+#include <ATen/autocast_mode.h>
+#endif
+
+namespace torch_serving {
+
+ExecutionPrecision StringToExecutionPrecision(const std::string &precision) {
+  if (precision == "fp32") {
+    return ExecutionPrecision::kFp32;
+  } else if (precision == "bf16_autocast") {
+    return ExecutionPrecision::kBf16Autocast;
+  } else if (precision == "bf16_weights") {
+    return ExecutionPrecision::kBf16Weights;
+  } else {
+    throw ServableConfigError(
+        "Invalid precision: " + precision +
+        " (expected `fp32`, `bf16_autocast` or `bf16_weights`)");
+  }
+}
+
+std::string ExecutionPrecisionToString(const ExecutionPrecision &precision) {
+  switch (precision) {
+    case ExecutionPrecision::kBf16Autocast:
+      return "bf16_autocast";
+    case ExecutionPrecision::kBf16Weights:
+      return "bf16_weights";
+    default:
+      return "fp32";
+  }
+}
+
+bool SupportsBf16Autocast() {
+#ifdef TORCH_SERVING_HAS_CPU_AUTOCAST
+  return true;
+#else
+  return false;
+#endif
+}
+
+torch::jit::IValue CastFloatingTensors(const torch::jit::IValue &value,
+                                       const torch::ScalarType &dtype) {
+  if (value.isTensor()) {
+    const auto &tensor = value.toTensor();
+    return tensor.is_floating_point() ? tensor.to(dtype) : tensor;
+  } else if (value.isTensorList()) {
+    c10::List<torch::Tensor> cast;
+    for (const torch::Tensor &tensor : value.toTensorList()) {
+      cast.push_back(tensor.is_floating_point() ? tensor.to(dtype) : tensor);
+    }
+    return cast;
+  } else if (value.isTuple()) {
+    std::vector<torch::jit::IValue> elements;
+    for (const auto &element : value.toTuple()->elements()) {
+      elements.push_back(CastFloatingTensors(element, dtype));
+    }
+    return c10::ivalue::Tuple::create(std::move(elements));
+  } else if (value.isList()) {
+    auto cast = value.toList().copy();
+    for (size_t i = 0; i < cast.size(); ++i) {
+      cast.set(i, CastFloatingTensors(cast.get(i), dtype));
+    }
+    return cast;
+  } else if (value.isGenericDict()) {
+    auto cast = value.toGenericDict().copy();
+    for (const auto &entry : cast) {
+      entry.setValue(CastFloatingTensors(entry.value(), dtype));
+    }
+    return cast;
+  }
+  return value;
+}
+
+Bf16AutocastGuard::Bf16AutocastGuard(const bool &enabled)
+    : enabled_(enabled) {
+#ifdef TORCH_SERVING_HAS_CPU_AUTOCAST
+  if (!enabled_) {
+    return;
+  }
+  previously_enabled_ = at::autocast::is_cpu_enabled();
+  previous_dtype_ = at::autocast::get_autocast_cpu_dtype();
+  at::autocast::set_cpu_enabled(true);
+  at::autocast::set_autocast_cpu_dtype(at::kBFloat16);
+  at::autocast::increment_nesting();
+#else
+  if (enabled_) {
+    throw std::runtime_error("bf16 autocast needs libtorch >= 1.10");
+  }
+#endif
+}
+
+Bf16AutocastGuard::~Bf16AutocastGuard() {
+#ifdef TORCH_SERVING_HAS_CPU_AUTOCAST
+  if (!enabled_) {
+    return;
+  }
+  // Casts of weights are cached for the outermost autocast region only.
+  if (at::autocast::decrement_nesting() == 0) {
+    at::autocast::clear_cache();
+  }
+  at::autocast::set_cpu_enabled(previously_enabled_);
+  at::autocast::set_autocast_cpu_dtype(previous_dtype_);
+#endif
+}
+
+}  // namespace torch_serving
@@ -0,0 +1,176 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#include "torch_serving/quantization.h"
+
+#include <ATen/ATen.h>
+#include <torch/version.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#if TORCH_VERSION_MAJOR > 1 || TORCH_VERSION_MINOR >= 7
+#define TORCH_SERVING_HAS_DYNAMIC_QUANTIZATION 1
+#include <ATen/core/dispatch/Dispatcher.h>
+#include <torch/csrc/jit/ir/constants.h>
+#include <torch/csrc/jit/ir/ir.h>
+#endif
+
+namespace torch_serving {
+
+namespace {
+
+std::string QEngineToString(const at::QEngine &engine) {
+  switch (engine) {
+    case at::QEngine::FBGEMM:
+      return "fbgemm";
+    case at::QEngine::QNNPACK:
+      return "qnnpack";
+    default:
+      return "none";
+  }
+}
+
+#ifdef TORCH_SERVING_HAS_DYNAMIC_QUANTIZATION
+
+// Quantizes a linear layer's weight the way PyTorch's default dynamic
+// quantization config does: symmetric int8, from the weight's range.
+at::Tensor QuantizeWeight(const at::Tensor &weight) {
+  if (at::globalContext().qEngine() == at::QEngine::FBGEMM) {
+    auto scales = std::get<0>(weight.abs().max(1)).div(127.5).clamp_min(1e-8);
+    auto zero_points = at::zeros(scales.sizes(), at::kLong);
+    return at::quantize_per_channel(weight, scales.to(at::kDouble),
+                                    zero_points, 0, at::kQInt8);
+  }
+  auto scale = std::max(weight.abs().max().item<double>() / 127.5, 1e-8);
+  return at::quantize_per_tensor(weight, scale, 0, at::kQInt8);
+}
+
+// Runs quantized::linear_prepack on the weight and bias, returning the packed
+// parameters (a custom class object).
+c10::IValue PrepackLinear(const at::Tensor &weight,
+                          const c10::IValue &bias) {
+  static auto op = c10::Dispatcher::singleton().findSchemaOrThrow(
+      "quantized::linear_prepack", "");
+  torch::jit::Stack stack{QuantizeWeight(weight), bias};
+  op.callBoxed(&stack);
+  return stack.at(0);
+}
+
+void QuantizeBlock(torch::jit::Block *block, QuantizationReport &report) {
+  const auto linear = c10::Symbol::fromQualString("aten::linear");
+  const auto lstm = c10::Symbol::fromQualString("aten::lstm");
+  const auto linear_dynamic =
+      c10::Symbol::fromQualString("quantized::linear_dynamic");
+  auto *graph = block->owningGraph();
+  for (auto it = block->nodes().begin(); it != block->nodes().end();) {
+    auto *node = *it++;
+    for (auto *nested : node->blocks()) {
+      QuantizeBlock(nested, report);
+    }
+    if (node->kind() == lstm) {
+      ++report.skipped_lstms;
+      continue;
+    }
+    if (node->kind() != linear) {
+      continue;
+    }
+    auto weight = torch::jit::toIValue(node->input(1));
+    auto bias = torch::jit::toIValue(node->input(2));
+    if (!weight || !bias || !weight->isTensor() ||
+        weight->toTensor().scalar_type() != at::kFloat ||
+        weight->toTensor().dim() != 2 || !weight->toTensor().is_cpu()) {
+      ++report.skipped_linear_layers;
+      continue;
+    }
+    torch::jit::WithInsertPoint guard(node);
+    auto *packed = graph->insertConstant(
+        PrepackLinear(weight->toTensor(), bias.value()));
+    // FBGEMM's kernels may overflow on some CPUs without it.
+    auto *reduce_range = graph->insertConstant(
+        at::globalContext().qEngine() == at::QEngine::FBGEMM);
+    auto *quantized = graph->insertNode(graph->create(
+        linear_dynamic, {node->input(0), packed, reduce_range}));
+    quantized->output()->setType(node->output()->type());
+    node->output()->replaceAllUsesWith(quantized->output());
+    node->destroy();
+    ++report.quantized_linear_layers;
+  }
+}
+
+#endif
+
+}  // namespace
+
+std::string QuantizationReport::ToString() const {
+  std::string summary = std::to_string(quantized_linear_layers) +
+                        " linear layers quantized to int8";
+  if (skipped_linear_layers) {
+    summary += ", " + std::to_string(skipped_linear_layers) +
+               " left in fp32";
+  }
+  if (skipped_lstms) {
+    summary += ", " + std::to_string(skipped_lstms) + " LSTMs left in fp32";
+  }
+  return summary;
+}
+
+QuantizationReport QuantizeDynamicInt8(torch::jit::script::Module &module) {
+#ifdef TORCH_SERVING_HAS_DYNAMIC_QUANTIZATION
+  QuantizationReport report;
+  for (auto &method : module.get_methods()) {
+    QuantizeBlock(method.graph()->block(), report);
+  }
+  return report;
+#else
+  throw std::runtime_error("Dynamic quantization needs libtorch >= 1.7");
+#endif
+}
+
+std::vector<std::string> SupportedQuantizedEngines() {
+  std::vector<std::string> engines;
+  for (const auto &engine : at::globalContext().supportedQEngines()) {
+    engines.push_back(QEngineToString(engine));
+  }
+  return engines;
+}
+
+void SetQuantizedEngine(const std::string &engine) {
+  const auto &supported = at::globalContext().supportedQEngines();
+  auto available = [&](const at::QEngine &candidate) {
+    return std::find(supported.begin(), supported.end(), candidate) !=
+           supported.end();
+  };
+  at::QEngine selected;
+  if (engine.empty()) {
+    if (available(at::QEngine::FBGEMM)) {
+      selected = at::QEngine::FBGEMM;
+    } else if (available(at::QEngine::QNNPACK)) {
+      selected = at::QEngine::QNNPACK;
+    } else {
+      // Built without quantized ops; quantizing models will fail instead.
+      return;
+    }
+  } else if (engine == "fbgemm") {
+    selected = at::QEngine::FBGEMM;
+  } else if (engine == "qnnpack") {
+    selected = at::QEngine::QNNPACK;
+  } else {
+    throw std::invalid_argument("Unknown quantized engine: " + engine +
+                                " (expected `fbgemm` or `qnnpack`)");
+  }
+  if (!available(selected)) {
+    throw std::invalid_argument("Quantized engine " +
+                                QEngineToString(selected) +
+                                " isn't supported by this build of libtorch");
+  }
+  at::globalContext().setQEngine(selected);
+}
+
+std::string QuantizedEngine() {
+  return QEngineToString(at::globalContext().qEngine());
+}
+
+}  // namespace torch_serving
@@ -0,0 +1,232 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#include "torch_serving/shape_buckets.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "torch_serving/tensor_io.h"
+
+namespace torch_serving {
+
+namespace {
+
+bool HasSequence(const torch::jit::IValue &value, const int64_t &dim) {
+  return value.isTensor() && value.toTensor().dim() > dim;
+}
+
+}  // namespace
+
+ShapeBuckets::ShapeBuckets(const json::json &config) {
+  const auto &sizes = config.is_array() ? config : config.at("sizes");
+  sizes_ = sizes.get<std::vector<int64_t>>();
+  if (config.is_object()) {
+    dim_ = config.value("dim", dim_);
+    sequence_inputs_ = config.value("sequence_inputs", sequence_inputs_);
+    output_dim_ = config.value("output_dim", dim_);
+    const auto slice_outputs =
+        config.value("slice_outputs", json::json::array());
+    for (const auto &path : slice_outputs) {
+      slice_outputs_.push_back(ParseOutputPath(path.get<std::string>()));
+    }
+    pad_value_ = config.value("pad_value", pad_value_);
+    attention_mask_ = config.value("attention_mask", attention_mask_);
+  }
+  if (sizes_.empty() ||
+      std::any_of(sizes_.begin(), sizes_.end(),
+                  [](const int64_t &size) { return size <= 0; })) {
+    throw ServableConfigError(
+        "shape_buckets must be a non-empty list of positive lengths");
+  }
+  if (dim_ < 0 || output_dim_ < 0) {
+    throw ServableConfigError("shape_buckets dimensions must be >= 0");
+  }
+  if (sequence_inputs_.empty()) {
+    throw ServableConfigError(
+        "shape_buckets needs at least one of sequence_inputs");
+  }
+  std::sort(sizes_.begin(), sizes_.end());
+  sizes_.erase(std::unique(sizes_.begin(), sizes_.end()), sizes_.end());
+}
+
+ShapeBuckets::OutputPath ShapeBuckets::ParseOutputPath(
+    const std::string &text) {
+  OutputPath path;
+  path.text = text;
+  size_t position = 0;
+  while (position < text.size()) {
+    PathStep step;
+    if (text[position] == '[') {
+      const auto close = text.find(']', position);
+      const auto index = close == std::string::npos
+                             ? std::string()
+                             : text.substr(position + 1, close - position - 1);
+      if (index.empty() ||
+          index.find_first_not_of("0123456789") != std::string::npos) {
+        throw ServableConfigError("Invalid shape_buckets output `" + text +
+                                  "`");
+      }
+      step.index = std::stoll(index);
+      position = close + 1;
+    } else if (text[position] == '.') {
+      const auto next = text.find_first_of(".[", position + 1);
+      step.key = text.substr(position + 1, next == std::string::npos
+                                               ? std::string::npos
+                                               : next - position - 1);
+      if (step.key.empty()) {
+        throw ServableConfigError("Invalid shape_buckets output `" + text +
+                                  "`");
+      }
+      position = next == std::string::npos ? text.size() : next;
+    } else {
+      throw ServableConfigError("Invalid shape_buckets output `" + text +
+                                "`, expected `[i]` or `.key` steps");
+    }
+    path.steps.push_back(std::move(step));
+  }
+  return path;
+}
+
+int64_t ShapeBuckets::BucketFor(const int64_t &length) const {
+  auto bucket = std::lower_bound(sizes_.begin(), sizes_.end(), length);
+  if (bucket == sizes_.end()) {
+    throw TensorShapeError("Input length " + std::to_string(length) +
+                           " is longer than the largest shape bucket (" +
+                           std::to_string(sizes_.back()) + ")");
+  }
+  return *bucket;
+}
+
+int64_t ShapeBuckets::SequenceLength(
+    const std::vector<torch::jit::IValue> &inputs) const {
+  int64_t length = -1;
+  for (const auto &index : sequence_inputs_) {
+    if (index >= inputs.size() || !HasSequence(inputs[index], dim_)) {
+      throw TensorShapeError("Argument " + std::to_string(index) +
+                             " must be a tensor with a sequence in dimension " +
+                             std::to_string(dim_));
+    }
+    const auto size = inputs[index].toTensor().size(dim_);
+    if (length >= 0 && size != length) {
+      throw TensorShapeError("Argument " + std::to_string(index) +
+                             " has sequence length " + std::to_string(size) +
+                             ", expected " + std::to_string(length));
+    }
+    length = size;
+  }
+  return length;
+}
+
+at::Tensor ShapeBuckets::PadTensor(const at::Tensor &tensor,
+                                   const int64_t &size) const {
+  auto sizes = tensor.sizes().vec();
+  sizes[dim_] = size;
+  auto padded = at::full(sizes, pad_value_, tensor.options());
+  padded.narrow(dim_, 0, tensor.size(dim_)).copy_(tensor);
+  return padded;
+}
+
+BucketedLength ShapeBuckets::Pad(
+    std::vector<torch::jit::IValue> &inputs) const {
+  BucketedLength length;
+  if (!Enabled()) {
+    return length;
+  }
+  length.length = SequenceLength(inputs);
+  length.bucket = BucketFor(length.length);
+  if (attention_mask_) {
+    const auto &tensor = inputs[sequence_inputs_.front()].toTensor();
+    auto sizes = tensor.sizes().slice(0, dim_ + 1).vec();
+    sizes[dim_] = length.bucket;
+    auto mask = at::zeros(sizes, tensor.options().dtype(at::kLong));
+    mask.narrow(dim_, 0, length.length).fill_(1);
+    inputs.emplace_back(mask);
+  }
+  if (length.length != length.bucket) {
+    for (const auto &index : sequence_inputs_) {
+      inputs[index] = PadTensor(inputs[index].toTensor(), length.bucket);
+    }
+  }
+  return length;
+}
+
+torch::jit::IValue ShapeBuckets::Slice(const torch::jit::IValue &output,
+                                       const BucketedLength &length) const {
+  if (!length.Padded() || length.length == length.bucket) {
+    return output;
+  }
+  auto sliced = output;
+  for (const auto &path : slice_outputs_) {
+    sliced = SliceAt(sliced, path, 0, length);
+  }
+  return sliced;
+}
+
+torch::jit::IValue ShapeBuckets::SliceAt(const torch::jit::IValue &value,
+                                         const OutputPath &path,
+                                         const size_t &step,
+                                         const BucketedLength &length) const {
+  auto missing = [&path] {
+    return std::runtime_error("shape_buckets output `" + path.text +
+                              "` isn't in the servable's output");
+  };
+  if (step == path.steps.size()) {
+    if (!value.isTensor() || value.toTensor().dim() <= output_dim_ ||
+        value.toTensor().size(output_dim_) != length.bucket) {
+      throw std::runtime_error(
+          "shape_buckets output `" + path.text + "` must be a tensor of the "
+          "bucket's length (" + std::to_string(length.bucket) +
+          ") in dimension " + std::to_string(output_dim_));
+    }
+    // Contiguous, since tensors are encoded straight from their data.
+    return value.toTensor().narrow(output_dim_, 0, length.length).contiguous();
+  }
+  const auto &next = path.steps[step];
+  if (next.key.empty()) {
+    const auto index = static_cast<size_t>(next.index);
+    if (value.isTuple()) {
+      const auto &tuple = value.toTuple()->elements();
+      std::vector<torch::jit::IValue> elements(tuple.begin(), tuple.end());
+      if (index >= elements.size()) {
+        throw missing();
+      }
+      elements[index] = SliceAt(elements[index], path, step + 1, length);
+      return c10::ivalue::Tuple::create(std::move(elements));
+    } else if (value.isList()) {
+      auto list = value.toList().copy();
+      if (index >= list.size()) {
+        throw missing();
+      }
+      list.set(index, SliceAt(list.get(index), path, step + 1, length));
+      return list;
+    }
+  } else if (value.isGenericDict()) {
+    auto dict = value.toGenericDict().copy();
+    auto entry = dict.find(next.key);
+    if (entry == dict.end()) {
+      throw missing();
+    }
+    entry->setValue(SliceAt(entry->value(), path, step + 1, length));
+    return dict;
+  }
+  throw missing();
+}
+
+std::vector<torch::jit::IValue> ShapeBuckets::Resize(
+    const std::vector<torch::jit::IValue> &inputs, const int64_t &size) const {
+  const auto length = SequenceLength(inputs);
+  auto resized = inputs;
+  for (const auto &index : sequence_inputs_) {
+    const auto &tensor = inputs[index].toTensor();
+    resized[index] = size <= length
+                         ? tensor.narrow(dim_, 0, size).contiguous()
+                         : PadTensor(tensor, size);
+  }
+  return resized;
+}
+
+}  // namespace torch_serving
@@ -0,0 +1,106 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#include "torch_serving/static_runtime.h"
+
+#include <torch/version.h>
+
+#include <mutex>
+#include <stdexcept>
+
+#if TORCH_VERSION_MAJOR > 1 || TORCH_VERSION_MINOR >= 9
+#define TORCH_SERVING_HAS_STATIC_RUNTIME 1
+#include <torch/csrc/jit/runtime/static/impl.h>
+#endif
+
+namespace torch_serving {
+
+#ifdef TORCH_SERVING_HAS_STATIC_RUNTIME
+
+namespace {
+
+torch::jit::StaticModuleOptions GetStaticModuleOptions() {
+  torch::jit::StaticModuleOptions options;
+  // Run ops writing into preallocated outputs, and plan (and reuse) the
+  // memory for intermediate values across forwards.
+  options.enable_out_variant = true;
+  options.optimize_memory = true;
+  options.cleanup_activations = true;
+  return options;
+}
+
+}  // namespace
+
+struct StaticRuntimePool::Impl {
+  Impl(const torch::jit::script::Module &module, const bool &frozen)
+      : static_module(module, frozen, GetStaticModuleOptions()),
+        num_runtimes(0) {}
+
+  torch::jit::StaticModule static_module;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<torch::jit::StaticRuntime>> idle;
+  size_t num_runtimes;
+};
+
+StaticRuntimePool::StaticRuntimePool(const torch::jit::script::Module &module,
+                                     const bool &frozen)
+    : impl_(new Impl(module, frozen)) {}
+
+torch::jit::IValue StaticRuntimePool::Run(
+    const std::vector<torch::jit::IValue> &inputs) {
+  std::unique_ptr<torch::jit::StaticRuntime> runtime;
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    if (!impl_->idle.empty()) {
+      runtime = std::move(impl_->idle.back());
+      impl_->idle.pop_back();
+    } else {
+      ++impl_->num_runtimes;
+    }
+  }
+  torch::jit::IValue output;
+  try {
+    if (!runtime) {
+      runtime.reset(new torch::jit::StaticRuntime(impl_->static_module));
+    }
+    output = (*runtime)(inputs);
+  } catch (...) {
+    // N.B., a runtime which throws is dropped, in case it's left in a bad
+    // state.
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    --impl_->num_runtimes;
+    throw;
+  }
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+  impl_->idle.push_back(std::move(runtime));
+  return output;
+}
+
+size_t StaticRuntimePool::NumRuntimes() const {
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+  return impl_->num_runtimes;
+}
+
+#else
+
+struct StaticRuntimePool::Impl {};
+
+StaticRuntimePool::StaticRuntimePool(const torch::jit::script::Module &module,
+                                     const bool &frozen) {
+  throw std::runtime_error("Static Runtime needs libtorch >= 1.9");
+}
+
+torch::jit::IValue StaticRuntimePool::Run(
+    const std::vector<torch::jit::IValue> &inputs) {
+  throw std::runtime_error("Static Runtime needs libtorch >= 1.9");
+}
+
+size_t StaticRuntimePool::NumRuntimes() const { return 0; }
+
+#endif
+
+StaticRuntimePool::~StaticRuntimePool() = default;
+
+}  // namespace torch_serving
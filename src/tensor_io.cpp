@@ -35,6 +35,8 @@ torch::ScalarType StringToScalarType(const std::string &scalar_type) {
     return torch::ScalarType::Short;
   } else if (scalar_type == "float16") {
     return torch::ScalarType::Half;
+  } else if (scalar_type == "bfloat16") {
+    return torch::ScalarType::BFloat16;
   } else if (scalar_type == "bool") {
     return torch::ScalarType::Bool;
   } else {
@@ -42,7 +44,12 @@ torch::ScalarType StringToScalarType(const std::string &scalar_type) {
   }
 }
 
-json::json TensorToJson(const torch::Tensor &tensor) {
+json::json TensorToJson(
+    torch::Tensor tensor,
+    const c10::optional<torch::ScalarType> &floating_type) {
+  if (floating_type && tensor.is_floating_point()) {
+    tensor = tensor.to(*floating_type);
+  }
   torch::IntArrayRef tensor_shape_ref = tensor.sizes();
   std::vector<int> tensor_shape(tensor_shape_ref.begin(),
                                 tensor_shape_ref.end());
@@ -77,7 +84,11 @@ json::json TensorToJson(const torch::Tensor &tensor) {
       break;
     case c10::ScalarType::Half:
       payload["data_type"] = "float16";
-      payload["value"] = TensorToStdVector<float>(tensor);
+      payload["value"] = TensorToStdVector<float>(tensor.to(torch::kFloat));
+      break;
+    case c10::ScalarType::BFloat16:
+      payload["data_type"] = "bfloat16";
+      payload["value"] = TensorToStdVector<float>(tensor.to(torch::kFloat));
       break;
     case c10::ScalarType::Float:
       payload["data_type"] = "float32";
@@ -125,6 +136,9 @@ json::json ScalarToJson(const torch::jit::IValue &torch_value) {
     case c10::ScalarType::Half:
       data_type = "float16";
       break;
+    case c10::ScalarType::BFloat16:
+      data_type = "bfloat16";
+      break;
     case c10::ScalarType::Float:
       data_type = "float32";
       break;
@@ -148,7 +162,9 @@ json::json ScalarToJson(const torch::jit::IValue &torch_value) {
   return payload;
 }
 
-json::json GenericDictToJson(const torch::jit::IValue &torch_value) {
+json::json GenericDictToJson(
+    const torch::jit::IValue &torch_value,
+    const c10::optional<torch::ScalarType> &floating_type) {
   json::json payload = {{"type", "generic_dict"}};
   const auto &dict = torch_value.toGenericDict();
   for (auto &entry : dict) {
@@ -157,19 +173,21 @@ json::json GenericDictToJson(const torch::jit::IValue &torch_value) {
           "Can only convert GenericDicts to Json if keys are string type");
     }
     payload["value"][entry.key().toStringRef()] =
-        TorchValueToJson(entry.value());
+        TorchValueToJson(entry.value(), floating_type);
   }
   return payload;
 }
 
-json::json TorchValueToJson(const torch::jit::IValue &torch_value) {
+json::json TorchValueToJson(
+    const torch::jit::IValue &torch_value,
+    const c10::optional<torch::ScalarType> &floating_type) {
   if (torch_value.isTensor()) {
-    return TensorToJson(torch_value.toTensor());
+    return TensorToJson(torch_value.toTensor(), floating_type);
   } else if (torch_value.isTensorList()) {
     auto tensor_list = torch_value.toTensorList();
     json::json payload = json::json::array();
     for (const auto &tensor : tensor_list) {
-      payload.emplace_back(TensorToJson(tensor));
+      payload.emplace_back(TensorToJson(tensor, floating_type));
     }
     return payload;
   } else if (torch_value.isString()) {
@@ -177,13 +195,13 @@ json::json TorchValueToJson(const torch::jit::IValue &torch_value) {
   } else if (torch_value.isTuple()) {
     json::json payload = json::json::array();
     for (const auto &value : torch_value.toTuple()->elements()) {
-      payload.emplace_back(TorchValueToJson(value));
+      payload.emplace_back(TorchValueToJson(value, floating_type));
     }
     return payload;
   } else if (torch_value.isScalar()) {
     return ScalarToJson(torch_value);
   } else if (torch_value.isGenericDict()) {
-    return GenericDictToJson(torch_value);
+    return GenericDictToJson(torch_value, floating_type);
   } else {
     throw TensorIOError("Only supports Tensor and TensorList types");
   }
@@ -0,0 +1,382 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#include "torch_serving/weight_memory.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_set>
+
+#include <torch/csrc/jit/ir/ir.h>
+
+#include "torch_serving/numa.h"
+
+namespace torch_serving {
+
+namespace {
+
+constexpr size_t kHugePageBytes = size_t(2) << 20;
+constexpr size_t kStorageAlignment = 64;
+
+size_t PageSize() { return static_cast<size_t>(sysconf(_SC_PAGESIZE)); }
+
+size_t RoundUp(const size_t &value, const size_t &multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+void CollectConstants(const torch::jit::Block *block,
+                      std::vector<at::Tensor> &tensors) {
+  for (const auto *node : block->nodes()) {
+    if (node->kind() == c10::prim::Constant &&
+        node->output()->type()->kind() == c10::TypeKind::TensorType) {
+      auto value = torch::jit::toIValue(node->output());
+      if (value && value->isTensor()) {
+        tensors.push_back(value->toTensor());
+      }
+    }
+    for (const auto *nested : node->blocks()) {
+      CollectConstants(nested, tensors);
+    }
+  }
+}
+
+// The distinct, non-empty CPU storages behind a module's weights.
+std::vector<c10::Storage> WeightStorages(
+    const torch::jit::script::Module &module) {
+  std::vector<at::Tensor> tensors;
+  for (const auto &parameter : module.parameters()) {
+    tensors.push_back(parameter);
+  }
+  for (const auto &buffer : module.buffers()) {
+    tensors.push_back(buffer);
+  }
+  // Frozen modules keep their weights as constants instead.
+  for (const auto &method : module.get_methods()) {
+    CollectConstants(method.graph()->block(), tensors);
+  }
+  std::vector<c10::Storage> storages;
+  std::unordered_set<const c10::StorageImpl *> seen;
+  for (const auto &tensor : tensors) {
+    if (!tensor.defined() || !tensor.device().is_cpu() ||
+        !tensor.has_storage()) {
+      continue;
+    }
+    const auto &storage = tensor.storage();
+    if (storage.nbytes() && storage.data() &&
+        seen.insert(storage.unsafeGetStorageImpl()).second) {
+      storages.push_back(storage);
+    }
+  }
+  return storages;
+}
+
+// One mapping holding every weight of a module, freed once the last storage
+// in it is.
+class WeightArena {
+ public:
+  WeightArena(const size_t &bytes, const HugePages &huge_pages,
+              std::vector<std::string> &warnings) {
+    size_ = RoundUp(std::max<size_t>(bytes, 1), kHugePageBytes);
+    if (huge_pages == HugePages::kHugetlb) {
+#ifdef MAP_HUGETLB
+      base_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (base_ != MAP_FAILED) {
+        return;
+      }
+      warnings.push_back(std::string("Unable to map hugetlb pages (") +
+                         std::strerror(errno) +
+                         "), using transparent huge pages instead");
+#else
+      warnings.push_back(
+          "hugetlb isn't supported, using transparent huge pages instead");
+#endif
+    }
+    // Over-map, then trim to a 2 MiB aligned range, so the whole arena can
+    // be backed by huge pages.
+    const auto mapped = size_ + kHugePageBytes;
+    auto *start = static_cast<char *>(mmap(nullptr, mapped,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (start == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    auto *aligned = reinterpret_cast<char *>(
+        RoundUp(reinterpret_cast<uintptr_t>(start), kHugePageBytes));
+    if (aligned != start) {
+      munmap(start, aligned - start);
+    }
+    const auto tail = (start + mapped) - (aligned + size_);
+    if (tail) {
+      munmap(aligned + size_, tail);
+    }
+    base_ = aligned;
+#ifdef MADV_HUGEPAGE
+    if (huge_pages != HugePages::kNone &&
+        madvise(base_, size_, MADV_HUGEPAGE) != 0) {
+      warnings.push_back(std::string("Unable to advise huge pages (") +
+                         std::strerror(errno) + ")");
+    }
+#endif
+  }
+
+  ~WeightArena() { munmap(base_, size_); }
+
+  WeightArena(const WeightArena &) = delete;
+  WeightArena &operator=(const WeightArena &) = delete;
+
+  char *Data() const { return static_cast<char *>(base_); }
+  size_t Size() const { return size_; }
+
+ private:
+  void *base_ = nullptr;
+  size_t size_ = 0;
+};
+
+// The context of every DataPtr into an arena.
+void ReleaseArena(void *context) {
+  delete static_cast<std::shared_ptr<WeightArena> *>(context);
+}
+
+// The arena a storage was moved into by MoveToArena, if any.
+const WeightArena *ArenaOf(const c10::Storage &storage) {
+  const auto &data_ptr = storage.data_ptr();
+  if (data_ptr.get_deleter() != &ReleaseArena) {
+    return nullptr;
+  }
+  return static_cast<std::shared_ptr<WeightArena> *>(data_ptr.get_context())
+      ->get();
+}
+
+// Copies the storages into one arena, pointing them at their copies.
+std::shared_ptr<WeightArena> MoveToArena(
+    const std::vector<c10::Storage> &storages, const HugePages &huge_pages,
+    std::vector<std::string> &warnings) {
+  size_t bytes = 0;
+  for (const auto &storage : storages) {
+    bytes = RoundUp(bytes, kStorageAlignment) + storage.nbytes();
+  }
+  auto arena = std::make_shared<WeightArena>(bytes, huge_pages, warnings);
+  size_t offset = 0;
+  for (const auto &storage : storages) {
+    offset = RoundUp(offset, kStorageAlignment);
+    auto *data = arena->Data() + offset;
+    std::memcpy(data, storage.data(), storage.nbytes());
+    // The old DataPtr is returned, and freed, here.
+    storage.unsafeGetStorageImpl()->set_data_ptr(
+        c10::DataPtr(data, new std::shared_ptr<WeightArena>(arena),
+                     &ReleaseArena, c10::Device(c10::DeviceType::CPU)));
+    offset += storage.nbytes();
+  }
+  return arena;
+}
+
+void Prefault(const void *data, const size_t &bytes) {
+  const auto page = PageSize();
+  const auto *bytes_ptr = static_cast<const volatile char *>(data);
+  char sink = 0;
+  for (size_t offset = 0; offset < bytes; offset += page) {
+    sink ^= bytes_ptr[offset];
+  }
+  if (bytes) {
+    sink ^= bytes_ptr[bytes - 1];
+  }
+  (void)sink;
+}
+
+// The page-aligned range covering [data, data + bytes).
+std::pair<uintptr_t, size_t> PageRange(const void *data, const size_t &bytes) {
+  const auto page = PageSize();
+  const auto start = reinterpret_cast<uintptr_t>(data) / page * page;
+  const auto end = RoundUp(reinterpret_cast<uintptr_t>(data) + bytes, page);
+  return {start, end - start};
+}
+
+size_t ResidentBytes(const void *data, const size_t &bytes) {
+  const auto page = PageSize();
+  const auto range = PageRange(data, bytes);
+  std::vector<unsigned char> resident(range.second / page);
+  if (mincore(reinterpret_cast<void *>(range.first), range.second,
+              resident.data()) != 0) {
+    return 0;
+  }
+  const auto pages = std::count_if(resident.begin(), resident.end(),
+                                   [](unsigned char in) { return in & 1; });
+  return std::min(bytes, static_cast<size_t>(pages) * page);
+}
+
+struct Mapping {
+  uintptr_t start;
+  uintptr_t end;
+  size_t huge_page_bytes;
+  size_t locked_bytes;
+};
+
+std::vector<Mapping> ReadMappings() {
+  std::vector<Mapping> mappings;
+  std::ifstream smaps("/proc/self/smaps");
+  std::string line;
+  while (std::getline(smaps, line)) {
+    std::istringstream fields(line);
+    std::string key;
+    fields >> key;
+    if (key.empty()) {
+      continue;
+    }
+    const auto dash = key.find('-');
+    if (key.back() != ':' && dash != std::string::npos) {
+      mappings.push_back({std::stoull(key.substr(0, dash), nullptr, 16),
+                          std::stoull(key.substr(dash + 1), nullptr, 16), 0,
+                          0});
+      continue;
+    }
+    if (mappings.empty()) {
+      continue;
+    }
+    size_t kilobytes = 0;
+    fields >> kilobytes;
+    if (key == "AnonHugePages:" || key == "Private_Hugetlb:" ||
+        key == "Shared_Hugetlb:") {
+      mappings.back().huge_page_bytes += kilobytes << 10;
+    } else if (key == "Locked:") {
+      mappings.back().locked_bytes += kilobytes << 10;
+    }
+  }
+  // N.B., /proc/self/smaps lists mappings in address order already.
+  std::sort(mappings.begin(), mappings.end(),
+            [](const Mapping &a, const Mapping &b) {
+              return a.start < b.start;
+            });
+  return mappings;
+}
+
+}  // namespace
+
+WeightMemoryOptions WeightMemoryOptions::FromJson(const json::json &options) {
+  WeightMemoryOptions parsed;
+  const auto huge_pages = options.value("huge_pages", std::string("none"));
+  if (huge_pages == "transparent") {
+    parsed.huge_pages = HugePages::kTransparent;
+  } else if (huge_pages == "hugetlb") {
+    parsed.huge_pages = HugePages::kHugetlb;
+  } else if (huge_pages != "none") {
+    throw ServableConfigError(
+        "Invalid huge_pages: " + huge_pages +
+        " (expected `none`, `transparent` or `hugetlb`)");
+  }
+  parsed.prefault = options.value("prefault_weights", false);
+  parsed.mlock = options.value("mlock_weights", false);
+  return parsed;
+}
+
+std::string WeightFootprint::ToString() const {
+  auto mib = [](const size_t &bytes) {
+    return std::to_string(bytes / static_cast<double>(1 << 20)) + "MiB";
+  };
+  return mib(bytes) + " of weights, " + mib(resident_bytes) + " resident, " +
+         mib(huge_page_bytes) + " on huge pages, " + mib(locked_bytes) +
+         " locked";
+}
+
+json::json WeightFootprint::ToJson() const {
+  return {{"bytes", bytes},
+          {"resident_bytes", resident_bytes},
+          {"huge_page_bytes", huge_page_bytes},
+          {"locked_bytes", locked_bytes}};
+}
+
+std::vector<std::string> PlaceWeights(const torch::jit::script::Module &module,
+                                      const WeightMemoryOptions &options) {
+  std::vector<std::string> warnings;
+  const auto storages = WeightStorages(module);
+  if (storages.empty()) {
+    return warnings;
+  }
+  std::vector<std::pair<uintptr_t, size_t>> ranges;
+  if (options.huge_pages != HugePages::kNone) {
+    // Copying the weights in faults in every page of the arena.
+    auto arena = MoveToArena(storages, options.huge_pages, warnings);
+    ranges.emplace_back(reinterpret_cast<uintptr_t>(arena->Data()),
+                        arena->Size());
+  } else {
+    for (const auto &storage : storages) {
+      if (options.prefault) {
+        Prefault(storage.data(), storage.nbytes());
+      }
+      ranges.push_back(PageRange(storage.data(), storage.nbytes()));
+    }
+  }
+  if (options.mlock) {
+    for (const auto &range : ranges) {
+      if (mlock(reinterpret_cast<void *>(range.first), range.second) != 0) {
+        warnings.push_back(std::string("Unable to lock weights in memory (") +
+                           std::strerror(errno) +
+                           "), check RLIMIT_MEMLOCK (ulimit -l)");
+        break;
+      }
+    }
+  }
+  return warnings;
+}
+
+size_t BindWeightsToNumaNode(const torch::jit::script::Module &module,
+                             const int &node) {
+  size_t bytes = 0;
+  std::unordered_set<const WeightArena *> bound;
+  for (const auto &storage : WeightStorages(module)) {
+    const auto *arena = ArenaOf(storage);
+    if (!arena) {
+      bytes += BindMemoryToNode(storage.data(), storage.nbytes(), node);
+    } else if (bound.insert(arena).second) {
+      // Bound whole, since binding each storage in it would split its huge
+      // pages wherever a storage boundary falls inside one.
+      bytes += BindMemoryToNode(arena->Data(), arena->Size(), node);
+    }
+  }
+  return bytes;
+}
+
+WeightFootprint MeasureWeights(const torch::jit::script::Module &module) {
+  WeightFootprint footprint;
+  const auto storages = WeightStorages(module);
+  const auto mappings = ReadMappings();
+  // Bytes of weights in each mapping.
+  std::vector<size_t> overlaps(mappings.size(), 0);
+  for (const auto &storage : storages) {
+    footprint.bytes += storage.nbytes();
+    footprint.resident_bytes +=
+        ResidentBytes(storage.data(), storage.nbytes());
+    const auto start = reinterpret_cast<uintptr_t>(storage.data());
+    const auto end = start + storage.nbytes();
+    // The first mapping ending after the storage starts, and those after it
+    // until one starts past the storage's end.
+    auto mapping = std::upper_bound(
+        mappings.begin(), mappings.end(), start,
+        [](const uintptr_t &address, const Mapping &m) {
+          return address < m.end;
+        });
+    for (; mapping != mappings.end() && mapping->start < end; ++mapping) {
+      overlaps[mapping - mappings.begin()] +=
+          std::min(end, mapping->end) - std::max(start, mapping->start);
+    }
+  }
+  for (size_t i = 0; i < mappings.size(); ++i) {
+    footprint.huge_page_bytes +=
+        std::min(overlaps[i], mappings[i].huge_page_bytes);
+    footprint.locked_bytes += std::min(overlaps[i], mappings[i].locked_bytes);
+  }
+  return footprint;
+}
+
+}  // namespace torch_serving
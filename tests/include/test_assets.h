@@ -0,0 +1,78 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+#ifndef TORCH_SERVING__TEST_ASSETS_H_
+#define TORCH_SERVING__TEST_ASSETS_H_
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "extern/json.hpp"
+
+inline std::string GetEnvVar(const std::string &variable_name,
+                             const std::string &default_value) {
+  const char *value = std::getenv(variable_name.c_str());
+  return value ? value : default_value;
+}
+
+inline std::string GetDefaultAssetDir() {
+  return GetEnvVar("TS_ASSET_DIR", "../tests/assets");
+}
+
+// The test servable, a request body for it, and the response it gives.
+struct TestAssets {
+  std::string model;
+  nlohmann::json payload;
+  nlohmann::json response;
+};
+
+inline TestAssets LoadTestAssets() {
+  TestAssets assets;
+  assets.model =
+      GetEnvVar("TS_TEST_MODEL", GetDefaultAssetDir() + "/test-servable.pt");
+  assets.payload = nlohmann::json::parse(std::ifstream(
+      GetEnvVar("TS_TEST_PAYLOAD",
+                GetDefaultAssetDir() + "/test-servable-payload.json")));
+  assets.response = nlohmann::json::parse(std::ifstream(
+      GetEnvVar("TS_TEST_RESPONSE",
+                GetDefaultAssetDir() + "/test-servable-response.json")));
+  return assets;
+}
+
+// A fresh directory for files written by a test, so the asset directory is
+// left alone. It's removed, with the files named through it, once the test
+// is done.
+class TempDir {
+ public:
+  TempDir() : path_("/tmp/torch-serving-test-XXXXXX") {
+    if (!mkdtemp(&path_[0])) {
+      throw std::runtime_error("Unable to create a temporary directory");
+    }
+  }
+
+  ~TempDir() {
+    for (const auto &file : files_) {
+      std::remove(file.c_str());
+    }
+    rmdir(path_.c_str());
+  }
+
+  std::string File(const std::string &name) {
+    files_.push_back(path_ + "/" + name);
+    return files_.back();
+  }
+
+ private:
+  std::string path_;
+  std::vector<std::string> files_;
+};
+
+#endif  // TORCH_SERVING__TEST_ASSETS_H_
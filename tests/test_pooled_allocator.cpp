@@ -0,0 +1,29 @@
+//
+// (c) 2020, Luke de Oliveira
+// This code is licensed under MIT license (see LICENSE for details)
+//
+
+// InstallPooledCpuAllocator replaces libtorch's CPU allocator for the rest of
+// the process, so it's tested in a binary of its own.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+#include "torch_serving/pooled_allocator.h"
+#include "torch_serving/torch_jit_servable.h"
+
+#include "test_assets.h"
+
+TEST_CASE("Test pooled allocator reuses blocks across requests") {
+  const auto assets = LoadTestAssets();
+
+  CHECK_FALSE(torch_serving::PooledCpuAllocatorPool());
+  torch_serving::InstallPooledCpuAllocator();
+  REQUIRE(torch_serving::PooledCpuAllocatorPool());
+  torch_serving::TorchJITServable servable(assets.model);
+  CHECK_EQ(assets.response, servable.RunInference(assets.payload));
+  CHECK_EQ(assets.response, servable.RunInference(assets.payload));
+  auto stats = torch_serving::PooledCpuAllocatorPool()->Stats();
+  MESSAGE("Pooled allocator: " << stats.dump());
+  CHECK_GT(stats["reused"].get<uint64_t>(), 0);
+}
@@ -6,19 +6,35 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+
+#include "torch_serving/block_pool.h"
+#include "torch_serving/cpu_budget.h"
+#include "torch_serving/ensemble.h"
+#include "torch_serving/http_server.h"
+#include "torch_serving/inference_mode.h"
 #include "torch_serving/model_server.h"
+#include "torch_serving/module_optimizer.h"
+#include "torch_serving/numa.h"
+#include "torch_serving/pipeline_stage.h"
+#include "torch_serving/precision.h"
+#include "torch_serving/quantization.h"
+#include "torch_serving/request_coalescer.h"
+#include "torch_serving/result_cache.h"
+#include "torch_serving/servable_pipeline.h"
+#include "torch_serving/session_store.h"
+#include "torch_serving/shape_buckets.h"
 #include "torch_serving/tensor_io.h"
+#include "torch_serving/weight_memory.h"
 #include "torch_serving/torch_jit_servable.h"
+#include "torch_serving/torch_lite_servable.h"
 
-std::string GetEnvVar(const std::string &variable_name,
-                      const std::string &default_value) {
-  const char *value = std::getenv(variable_name.c_str());
-  return value ? value : default_value;
-}
-
-std::string GetDefaultAssetDir() {
-  return GetEnvVar("TS_ASSET_DIR", "../tests/assets");
-}
+#include "test_assets.h"
 
 TEST_CASE("Test Torch Tensor to JSON") {
   auto t = torch::tensor({1, 2, 3, 4});
@@ -73,22 +89,935 @@ TEST_CASE("Test JSON Torch Tensor") {
 TEST_CASE("Test servable manager inference") {
   torch_serving::ServableManager<torch_serving::TorchJITServable> manager;
 
-  std::string servable_payload = GetEnvVar(
-      "TS_TEST_PAYLOAD", GetDefaultAssetDir() + "/test-servable-payload.json");
-  std::string servable_response =
-      GetEnvVar("TS_TEST_RESPONSE",
-                GetDefaultAssetDir() + "/test-servable-response.json");
-  std::string servable_model =
-      GetEnvVar("TS_TEST_MODEL", GetDefaultAssetDir() + "/test-servable.pt");
-
-  json::json payload = json::json::parse(std::ifstream(servable_payload));
-  json::json response = json::json::parse(std::ifstream(servable_response));
+  const auto assets = LoadTestAssets();
 
   MESSAGE("Verify sync result");
-  auto result = manager.InferenceRequest(servable_model, payload);
-  CHECK_EQ(response, result);
+  auto result = manager.InferenceRequest(assets.model, assets.payload);
+  CHECK_EQ(assets.response, result);
 
   MESSAGE("Verify async result");
-  auto result_async = manager.AsyncInferenceRequest(servable_model, payload);
-  CHECK_EQ(response, result_async.get());
+  auto result_async =
+      manager.AsyncInferenceRequest(assets.model, assets.payload);
+  CHECK_EQ(assets.response, result_async.get());
+}
+
+TEST_CASE("Test model server shuts down with work in flight") {
+  const auto assets = LoadTestAssets();
+
+  torch_serving::SchedulerOptions scheduler_options;
+  scheduler_options.num_workers = 1;
+  torch_serving::PipelineOptions pipeline_options;
+  pipeline_options.decode_threads = 1;
+  pipeline_options.encode_threads = 1;
+  std::unique_ptr<torch_serving::ModelServer<torch_serving::TorchJITServable>>
+      server(new torch_serving::ModelServer<torch_serving::TorchJITServable>(
+          10, 0, 8, {}, scheduler_options, {}, pipeline_options));
+  const int port = 18931;
+  std::thread listener([&] { server->RunServer("localhost", port); });
+  httplib::Client client("localhost", port);
+  for (int attempt = 0; attempt < 100 && !client.Get("/metrics"); ++attempt) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  MESSAGE("Ensembles fail once a servable fails to load, while the forward "
+          "passes of their other servables may still be queued");
+  std::vector<std::future<int>> statuses;
+  for (int i = 0; i < 8; ++i) {
+    statuses.push_back(std::async(std::launch::async, [&] {
+      httplib::Client ensemble_client("localhost", port);
+      auto res = ensemble_client.Post(
+          ("/ensemble?servable_identifier=" + assets.model +
+           "&servable_identifier=missing-servable.pt")
+              .c_str(),
+          assets.payload.dump(), "application/json");
+      return res ? res->status : -1;
+    }));
+  }
+  for (auto &status : statuses) {
+    CHECK_EQ(status.get(), 400);
+  }
+
+  MESSAGE("Destroying the server drains the stages in order");
+  server->Stop();
+  listener.join();
+  server.reset();
+}
+
+TEST_CASE("Test admission control sheds past queue limits") {
+  torch_serving::AdmissionLimits limits;
+  limits.max_in_flight_per_servable = 1;
+  limits.max_queued_per_servable = 1;
+  torch_serving::AdmissionController controller(limits);
+  auto &metrics = torch_serving::MetricsRegistry::Global();
+
+  auto ticket = controller.Admit("admission-test");
+
+  MESSAGE("Second request queues behind the first");
+  auto queued = std::async(std::launch::async, [&controller] {
+    auto queued_ticket = controller.Admit("admission-test");
+  });
+  while (metrics.GetGauge("queued", "admission-test") < 1) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  MESSAGE("Third request is shed");
+  CHECK_THROWS_AS(controller.Admit("admission-test"),
+                  torch_serving::OverloadedError);
+  CHECK_EQ(metrics.GetCounter("admission_shed", "admission-test"), 1);
+
+  MESSAGE("Other servables are unaffected");
+  CHECK_NOTHROW(controller.Admit("admission-test-other"));
+
+  ticket.Release();
+  queued.get();
+  CHECK_EQ(metrics.GetCounter("admission_accepted", "admission-test"), 2);
+}
+
+TEST_CASE("Test queued requests are dropped past their deadline") {
+  torch_serving::AdmissionLimits limits;
+  limits.max_in_flight_per_servable = 1;
+  torch_serving::AdmissionController controller(limits);
+  auto &metrics = torch_serving::MetricsRegistry::Global();
+
+  auto ticket = controller.Admit("deadline-test");
+  auto context = torch_serving::RequestContext::WithTimeout(
+      std::chrono::milliseconds(20));
+  CHECK_FALSE(context.Expired());
+
+  MESSAGE("Queued request expires while waiting for a slot");
+  CHECK_THROWS_AS(controller.Admit("deadline-test", context),
+                  torch_serving::DeadlineExceededError);
+  CHECK(context.Expired());
+  CHECK_EQ(metrics.GetCounter("deadline_exceeded", "deadline-test"), 1);
+}
+
+TEST_CASE("Test huge request timeouts mean no deadline") {
+  auto context = torch_serving::RequestContext::WithTimeout(
+      std::chrono::milliseconds::max());
+  CHECK_FALSE(context.HasDeadline());
+  CHECK_FALSE(context.Expired());
+
+  MESSAGE("Timeouts within the clock's range still set a deadline");
+  context = torch_serving::RequestContext::WithTimeout(std::chrono::hours(1));
+  CHECK(context.HasDeadline());
+  CHECK_FALSE(context.Expired());
+}
+
+TEST_CASE("Test cancelled requests are removed from the queue") {
+  torch_serving::AdmissionLimits limits;
+  limits.max_in_flight_per_servable = 1;
+  torch_serving::AdmissionController controller(limits);
+  auto &metrics = torch_serving::MetricsRegistry::Global();
+
+  auto ticket = controller.Admit("cancel-test");
+
+  std::atomic<bool> connected(true);
+  torch_serving::RequestContext context;
+  context.cancellation =
+      torch_serving::CancellationToken([&connected] { return !connected; });
+  CHECK_FALSE(context.cancellation.IsCancelled());
+
+  MESSAGE("Queued request is dropped once its probe reports a disconnect");
+  auto queued = std::async(std::launch::async, [&controller, &context] {
+    controller.Admit("cancel-test", context);
+  });
+  connected = false;
+  CHECK_THROWS_AS(queued.get(), torch_serving::CancelledError);
+  CHECK(context.cancellation.IsCancelled());
+  CHECK_EQ(metrics.GetCounter("cancelled", "cancel-test"), 1);
+  CHECK_EQ(metrics.GetGauge("queued", "cancel-test"), 0);
+}
+
+TEST_CASE("Test connections are only probed while the server has them open") {
+  int sockets[2];
+  REQUIRE_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+  auto connection = std::make_shared<torch_serving::Connection>(sockets[0]);
+  CHECK(torch_serving::HTTPServer::IsConnected(connection));
+
+  MESSAGE("A connection the server has closed is never probed again");
+  connection->alive = false;
+  CHECK_FALSE(torch_serving::HTTPServer::IsConnected(connection));
+  CHECK_FALSE(torch_serving::HTTPServer::IsConnected(nullptr));
+
+  MESSAGE("The peer hanging up is seen as a disconnect");
+  connection->alive = true;
+  close(sockets[1]);
+  CHECK_FALSE(torch_serving::HTTPServer::IsConnected(connection));
+  close(sockets[0]);
+}
+
+TEST_CASE("Test admitting several servables at once") {
+  torch_serving::AdmissionLimits limits;
+  limits.max_in_flight_per_servable = 1;
+  torch_serving::AdmissionController controller(limits);
+  auto expired =
+      torch_serving::RequestContext::WithTimeout(std::chrono::milliseconds(0));
+
+  MESSAGE("Each distinct servable takes one slot");
+  auto tickets = controller.AdmitAll({"all-b", "all-a", "all-b"});
+  CHECK_EQ(tickets.size(), 2);
+  CHECK_THROWS_AS(controller.Admit("all-a", expired),
+                  torch_serving::DeadlineExceededError);
+
+  MESSAGE("Slots already taken are given back if a later one can't be");
+  // Servables are admitted in sorted order, so `all-0` is taken before
+  // `all-b` times out.
+  CHECK_THROWS_AS(controller.AdmitAll({"all-b", "all-0"}, expired),
+                  torch_serving::DeadlineExceededError);
+  CHECK_EQ(torch_serving::MetricsRegistry::Global().GetGauge("in_flight",
+                                                             "all-0"),
+           0);
+  CHECK_NOTHROW(controller.Admit("all-0", expired));
+}
+
+TEST_CASE("Test interactive requests are scheduled ahead of bulk requests") {
+  torch_serving::SchedulerOptions options;
+  options.num_workers = 1;
+  torch_serving::InferenceScheduler scheduler(options);
+
+  std::mutex mutex;
+  std::vector<std::string> order;
+  std::promise<void> release;
+  auto released = release.get_future().share();
+  auto record = [&mutex, &order](const std::string &name) {
+    return [&mutex, &order, name] {
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(name);
+    };
+  };
+  auto ignore = [](std::exception_ptr) {};
+
+  MESSAGE("Block the only worker, then queue bulk before interactive work");
+  torch_serving::RequestContext bulk;
+  bulk.priority = torch_serving::Priority::kBulk;
+  torch_serving::RequestContext interactive;
+  scheduler.Submit("blocker", interactive, [released] { released.wait(); },
+                   ignore);
+  scheduler.Submit("bulk", bulk, record("bulk"), ignore);
+  scheduler.Submit("interactive", interactive, record("interactive"), ignore);
+  release.set_value();
+  scheduler.Shutdown();
+
+  CHECK_EQ(order, std::vector<std::string>({"interactive", "bulk"}));
+}
+
+TEST_CASE("Test servable options are parsed when the config is loaded") {
+  torch_serving::ServableConfig config(json::json{
+      {"defaults", {{"weight", 2}}},
+      {"servables",
+       {{"config-a", {{"max_concurrency", 3}, {"freeze", true}}}}}});
+  const auto &options = config.Options("config-a");
+  CHECK_EQ(options.weight, 2);
+  CHECK_EQ(options.max_concurrency, 3);
+  CHECK_FALSE(options.has_adaptive_concurrency);
+  CHECK(options.raw.contains("freeze"));
+
+  MESSAGE("Servables without an entry get the defaults");
+  CHECK_EQ(config.Options("config-b").weight, 2);
+  CHECK_FALSE(config.Options("config-b").raw.contains("freeze"));
+
+  MESSAGE("Options of the wrong type are rejected up front");
+  CHECK_THROWS(torch_serving::ServableConfig(
+      json::json{{"servables", {{"config-a", {{"weight", "heavy"}}}}}}));
+}
+
+TEST_CASE("Test servables share inference workers by weight") {
+  json::json config = {{"servables", {{"heavy", {{"weight", 2}}}}}};
+  torch_serving::SchedulerOptions options;
+  options.num_workers = 1;
+  torch_serving::InferenceScheduler scheduler(
+      options, torch_serving::ServableConfig(config));
+
+  std::mutex mutex;
+  std::vector<std::string> order;
+  std::promise<void> release;
+  auto released = release.get_future().share();
+  auto ignore = [](std::exception_ptr) {};
+  torch_serving::RequestContext context;
+  auto submit = [&](const std::string &name) {
+    scheduler.Submit(name, context,
+                     [&mutex, &order, name] {
+                       std::lock_guard<std::mutex> lock(mutex);
+                       order.push_back(name);
+                     },
+                     ignore);
+  };
+
+  MESSAGE("Queue a burst for the hot servables ahead of the cold one");
+  scheduler.Submit("blocker", context, [released] { released.wait(); },
+                   ignore);
+  for (int i = 0; i < 4; ++i) {
+    submit("heavy");
+  }
+  for (int i = 0; i < 2; ++i) {
+    submit("light");
+  }
+  submit("cold");
+  release.set_value();
+  scheduler.Shutdown();
+
+  MESSAGE("Round robin between servables, two dispatches per heavy turn");
+  CHECK_EQ(order, std::vector<std::string>({"heavy", "heavy", "light", "cold",
+                                            "heavy", "heavy", "light"}));
+}
+
+TEST_CASE("Test scheduler only tracks loaded or busy servables") {
+  torch_serving::SchedulerOptions options;
+  options.num_workers = 2;
+  torch_serving::InferenceScheduler scheduler(options);
+  torch_serving::RequestContext context;
+  auto ignore = [](std::exception_ptr) {};
+
+  scheduler.Retain("loaded");
+  for (int i = 0; i < 100; ++i) {
+    scheduler.Submit("unknown-" + std::to_string(i), context, [] {}, ignore);
+  }
+  scheduler.Submit("loaded", context, [] {}, ignore);
+  scheduler.Shutdown();
+  CHECK_EQ(scheduler.NumServables(), 1);
+
+  MESSAGE("Evicted servables are forgotten");
+  scheduler.ReleaseUnloaded([](const std::string &) { return false; });
+  CHECK_EQ(scheduler.NumServables(), 0);
+}
+
+TEST_CASE("Test adaptive concurrency limit follows forward latency") {
+  torch_serving::ConcurrencyLimiterOptions options;
+  options.initial_limit = 4;
+  options.max_limit = 16;
+  torch_serving::GradientConcurrencyLimiter limiter(options);
+  CHECK_EQ(limiter.Limit(), 4);
+
+  MESSAGE("Stable latency at full utilisation grows the limit");
+  for (int i = 0; i < 100; ++i) {
+    limiter.OnSample(std::chrono::milliseconds(10), limiter.Limit());
+  }
+  auto grown = limiter.Limit();
+  CHECK_GT(grown, 4);
+  CHECK_LE(grown, 16);
+
+  MESSAGE("Latency collapse backs the limit off");
+  for (int i = 0; i < 20; ++i) {
+    limiter.OnSample(std::chrono::milliseconds(100), limiter.Limit());
+  }
+  CHECK_LT(limiter.Limit(), grown);
+  CHECK_GE(limiter.Limit(), 1);
+}
+
+TEST_CASE("Test thread budget splits cores between pools") {
+  CHECK_GE(torch_serving::AvailableCores(), 1);
+
+  torch_serving::ThreadBudget requested;
+  requested.cores = 8;
+  auto budget = torch_serving::ComputeThreadBudget(requested);
+  MESSAGE("By default, one single-threaded forward pass per core");
+  CHECK_EQ(budget.inference_workers, 8);
+  CHECK_EQ(budget.intra_op_threads, 1);
+  CHECK_EQ(budget.http_threads, 16);
+  CHECK_EQ(budget.decode_threads, 4);
+  CHECK_EQ(budget.encode_threads, 4);
+
+  MESSAGE("Fewer workers get more intra-op threads each");
+  requested.inference_workers = 2;
+  budget = torch_serving::ComputeThreadBudget(requested);
+  CHECK_EQ(budget.intra_op_threads, 4);
+  CHECK_EQ(budget.inter_op_threads, 4);
+  CHECK_EQ(budget.http_threads, 4);
+}
+
+TEST_CASE("Test NUMA topology is read from sysfs") {
+  CHECK_EQ(torch_serving::ParseCpuList("0-3,8,10-11\n"),
+           std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  CHECK_EQ(torch_serving::CpusToString({0, 1, 2, 3, 8, 10, 11}),
+           "0-3,8,10-11");
+
+  MESSAGE("Nodes without allowed CPUs are skipped");
+  char root[] = "/tmp/numa-test-XXXXXX";
+  REQUIRE(mkdtemp(root));
+  const std::vector<std::string> cpu_lists = {"0-3", "4-7", "8"};
+  for (size_t node = 0; node < cpu_lists.size(); ++node) {
+    const auto directory = std::string(root) + "/node" + std::to_string(node);
+    REQUIRE_EQ(mkdir(directory.c_str(), 0755), 0);
+    std::ofstream(directory + "/cpulist") << cpu_lists[node] << "\n";
+  }
+  auto nodes = torch_serving::NumaTopology(root, {1, 2, 5, 6});
+  REQUIRE_EQ(nodes.size(), 2);
+  CHECK_EQ(nodes[0].id, 0);
+  CHECK_EQ(nodes[0].cpus, std::vector<int>({1, 2}));
+  CHECK_EQ(nodes[1].id, 1);
+  CHECK_EQ(nodes[1].cpus, std::vector<int>({5, 6}));
+  for (size_t node = 0; node < cpu_lists.size(); ++node) {
+    const auto directory = std::string(root) + "/node" + std::to_string(node);
+    std::remove((directory + "/cpulist").c_str());
+    rmdir(directory.c_str());
+  }
+  rmdir(root);
+
+  MESSAGE("Without NUMA support, every allowed CPU is on one node");
+  nodes = torch_serving::NumaTopology(root, {0, 1});
+  REQUIRE_EQ(nodes.size(), 1);
+  CHECK_EQ(nodes[0].cpus, std::vector<int>({0, 1}));
+
+  MESSAGE("Servables are placed on their node, or the least loaded one");
+  json::json config = {{"servables", {{"pinned", {{"numa_node", 1}}}}}};
+  torch_serving::SchedulerOptions options;
+  options.num_workers = 2;
+  options.numa_aware = true;
+  options.numa_nodes = {{0, {}}, {1, {}}};
+  torch_serving::InferenceScheduler scheduler(
+      options, torch_serving::ServableConfig(config));
+  std::vector<int> servables_per_node(2, 0);
+  for (const std::string servable : {"pinned", "a", "b", "c"}) {
+    scheduler.Retain(servable);
+    ++servables_per_node.at(scheduler.NumaNode(servable));
+  }
+  CHECK_EQ(scheduler.NumaNode("pinned"), 1);
+  CHECK_EQ(scheduler.NumaNode("a"), 0);
+  CHECK_EQ(servables_per_node, std::vector<int>({2, 2}));
+
+  MESSAGE("Only whole pages of a range are bound");
+  const auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  std::vector<char> small(page_size / 2);
+  CHECK_EQ(torch_serving::BindMemoryToNode(small.data(), small.size(), 0), 0);
+}
+
+TEST_CASE("Test pipeline stage sheds past its queue limit") {
+  torch_serving::PipelineStage stage("test", 1, 1);
+  std::promise<void> started, release;
+  auto released = release.get_future().share();
+  stage.Submit([&started, released] {
+    started.set_value();
+    released.wait();
+  });
+  started.get_future().wait();
+
+  MESSAGE("One request may queue behind the running one");
+  std::promise<void> ran;
+  stage.Submit([&ran] { ran.set_value(); });
+  CHECK_THROWS_AS(stage.Submit([] {}), torch_serving::OverloadedError);
+  CHECK_EQ(stage.Stats().at("rejected").get<int>(), 1);
+
+  release.set_value();
+  ran.get_future().wait();
+  CHECK_EQ(stage.Stats().at("queued").get<int>(), 0);
+
+  MESSAGE("Shutting down runs the queued work first");
+  bool drained = false;
+  stage.Submit([&drained] { drained = true; });
+  stage.Shutdown();
+  CHECK(drained);
+  CHECK_NOTHROW(stage.Shutdown());
+}
+
+TEST_CASE("Test pipeline stage reservations hold a queue slot") {
+  torch_serving::PipelineStage stage("test", 1, 1);
+  auto reservation = stage.Reserve();
+  CHECK_THROWS_AS(stage.Reserve(), torch_serving::OverloadedError);
+  CHECK_THROWS_AS(stage.Submit([] {}), torch_serving::OverloadedError);
+
+  MESSAGE("Reserved work isn't shed");
+  std::promise<void> ran;
+  stage.Submit(*reservation, [&ran] { ran.set_value(); });
+  ran.get_future().wait();
+  CHECK_THROWS_AS(stage.Submit(*reservation, [] {}), std::logic_error);
+
+  MESSAGE("Dropping an unused reservation frees its slot");
+  reservation = stage.Reserve();
+  reservation.reset();
+  CHECK_EQ(stage.Stats().at("queued").get<int>(), 0);
+  CHECK_NOTHROW(stage.Reserve());
+}
+
+TEST_CASE("Test input digests ignore formatting") {
+  auto digest = [](const std::string &text) {
+    return torch_serving::DigestJson(json::json::parse(text));
+  };
+  CHECK(digest(R"({"a": [1, 2], "b": 0.5})") ==
+        digest(R"({ "b":5e-1,"a":[1,2] })"));
+  MESSAGE("Integers and floats make different tensors");
+  CHECK_FALSE(digest("[1, 2]") == digest("[1.0, 2.0]"));
+  CHECK_FALSE(digest(R"(["ab", "c"])") == digest(R"(["a", "bc"])"));
+  CHECK_FALSE(digest("[[1], [2]]") == digest("[[1, 2]]"));
+}
+
+TEST_CASE("Test result cache evicts by bytes, age and servable") {
+  torch_serving::ResultCacheOptions options;
+  options.max_bytes = 4096;
+  options.ttl = std::chrono::milliseconds(50);
+  torch_serving::ResultCache cache(options);
+
+  auto key = [](const std::string &servable_identifier, const int &input) {
+    torch_serving::ResultCache::Key key;
+    key.servable_identifier = servable_identifier;
+    key.digest = torch_serving::DigestJson(input);
+    return key;
+  };
+  auto result = std::make_shared<const json::json>(json::json{1, 2, 3});
+  cache.Put(key("a", 1), result);
+  cache.Put(key("b", 1), result);
+  REQUIRE(cache.Get(key("a", 1)));
+  CHECK_EQ(*cache.Get(key("a", 1)), *result);
+  CHECK_FALSE(cache.Get(key("a", 2)));
+
+  MESSAGE("Invalidating one servable keeps the others");
+  cache.Invalidate("a");
+  CHECK_FALSE(cache.Get(key("a", 1)));
+  CHECK(cache.Get(key("b", 1)));
+
+  MESSAGE("The least recently used results go first");
+  for (int i = 0; i < 100; ++i) {
+    cache.Put(key("c", i), result);
+  }
+  CHECK_LE(cache.Stats().at("bytes").get<size_t>(), 4096);
+  CHECK_FALSE(cache.Get(key("c", 0)));
+  CHECK(cache.Get(key("c", 99)));
+
+  MESSAGE("Results expire after the TTL");
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  CHECK_FALSE(cache.Get(key("c", 99)));
+}
+
+TEST_CASE("Test request coalescer shares one result between waiters") {
+  torch_serving::RequestCoalescer<std::string, int> coalescer;
+  auto leader = coalescer.Join("a");
+  auto follower = coalescer.Join("a");
+  auto other = coalescer.Join("b");
+  CHECK(leader.leader);
+  CHECK_FALSE(follower.leader);
+  CHECK(other.leader);
+  CHECK_EQ(coalescer.InFlight(), 2);
+
+  std::thread completer([&coalescer] { coalescer.Complete("a", 42); });
+  CHECK_EQ(follower.future.get(), 42);
+  completer.join();
+
+  MESSAGE("Requests after completion start over");
+  CHECK(coalescer.Join("a").leader);
+
+  MESSAGE("Failures reach every waiter");
+  auto failed = coalescer.Join("b");
+  coalescer.Fail("b", std::make_exception_ptr(std::runtime_error("failed")));
+  CHECK_THROWS_AS(failed.future.get(), std::runtime_error);
+  CHECK_THROWS_AS(other.future.get(), std::runtime_error);
+}
+
+TEST_CASE("Test request coalescer elects a new leader") {
+  torch_serving::RequestCoalescer<std::string, int> coalescer;
+  auto leader = coalescer.Join("a");
+  auto first = coalescer.Join("a");
+  auto second = coalescer.Join("a");
+
+  MESSAGE("Followers can't take over while the leader is running");
+  CHECK_FALSE(coalescer.TakeOver("a", first));
+
+  MESSAGE("Once the leader abandons the key, one follower takes over");
+  coalescer.Abandon("a");
+  CHECK(coalescer.TakeOver("a", first));
+  CHECK(first.leader);
+  CHECK_FALSE(coalescer.TakeOver("a", second));
+  coalescer.Complete("a", 7);
+  CHECK_EQ(second.future.get(), 7);
+  coalescer.Leave("a", second);
+  CHECK_EQ(coalescer.InFlight(), 0);
+
+  MESSAGE("New requests lead an abandoned key");
+  leader = coalescer.Join("b");
+  auto follower = coalescer.Join("b");
+  coalescer.Abandon("b");
+  CHECK(coalescer.Join("b").leader);
+  CHECK_FALSE(coalescer.TakeOver("b", follower));
+
+  MESSAGE("An abandoned key is dropped once its followers leave");
+  coalescer.Complete("b", 1);
+  leader = coalescer.Join("c");
+  follower = coalescer.Join("c");
+  coalescer.Abandon("c");
+  coalescer.Leave("c", follower);
+  CHECK_EQ(coalescer.InFlight(), 0);
+  CHECK(coalescer.Join("c").leader);
+
+  MESSAGE("Stale members don't touch newer groups");
+  CHECK_FALSE(coalescer.TakeOver("c", follower));
+  coalescer.Leave("c", follower);
+  CHECK_EQ(coalescer.InFlight(), 1);
+}
+
+TEST_CASE("Test ensemble results are reduced element-wise") {
+  using torch_serving::EnsembleReduction;
+  json::json a = {{"scores", {1, 2}}, {"bias", 0}};
+  json::json b = {{"scores", {3, 6}}, {"bias", 1.0}};
+  auto mean = torch_serving::ReduceResults({&a, &b}, EnsembleReduction::kMean);
+  CHECK_EQ(mean["scores"], json::json({2.0, 4.0}));
+  CHECK_EQ(mean["bias"], 0.5);
+
+  auto weights = torch_serving::ParseEnsembleWeights("0.75,0.25");
+  REQUIRE_EQ(weights.size(), 2);
+  auto weighted_sum = torch_serving::ReduceResults(
+      {&a, &b}, EnsembleReduction::kWeightedSum, weights);
+  CHECK_EQ(weighted_sum["scores"], json::json({1.5, 3.0}));
+
+  MESSAGE("Encoded tensors keep their shape and type tags");
+  json::json x = {{"type", "tensor"},
+                  {"shape", {1, 2}},
+                  {"data_type", "int64"},
+                  {"value", {1, 2}}};
+  json::json y = x;
+  y["value"] = {3, 4};
+  auto tensor =
+      torch_serving::ReduceResults({&x, &y}, EnsembleReduction::kMean);
+  CHECK_EQ(tensor["shape"], json::json({1, 2}));
+  CHECK_EQ(tensor["data_type"], "float64");
+  CHECK_EQ(tensor["value"], json::json({2.0, 3.0}));
+
+  MESSAGE("Results of different shapes can't be reduced");
+  json::json c = {{"scores", {1, 2, 3}}, {"bias", 0}};
+  CHECK_THROWS_AS(
+      torch_serving::ReduceResults({&a, &c}, EnsembleReduction::kMean),
+      torch_serving::EnsembleError);
+  CHECK_THROWS_AS(torch_serving::ParseEnsembleWeights("0.5,"),
+                  std::invalid_argument);
+}
+
+TEST_CASE("Test servable pipelines wire stages together") {
+  auto pipeline = torch_serving::ServablePipeline("rank", json::json::parse(R"({
+    "stages": [
+      {"name": "encoder", "servable_identifier": "encoder.pt"},
+      {"name": "ranker", "servable_identifier": "ranker.pt",
+       "inputs": ["encoder[1]", "encoder.scores", "$input[0]"]}
+    ]
+  })"));
+  using Selector = torch_serving::ValueReference::Selector;
+  const auto &steps = pipeline.Steps();
+  REQUIRE_EQ(steps.size(), 2);
+  CHECK_EQ(pipeline.Output(), 1);
+  CHECK_EQ(steps[0].dependents, std::vector<size_t>{1});
+  CHECK_EQ(steps[1].dependencies, std::vector<size_t>{0});
+  REQUIRE_EQ(steps[1].inputs.size(), 3);
+  CHECK_EQ(steps[1].inputs[0].selector, Selector::kIndex);
+  CHECK_EQ(steps[1].inputs[0].index, 1);
+  CHECK_EQ(steps[1].inputs[1].key, "scores");
+  // A copy, since CHECK_EQ binds references and C++14 has no definition of
+  // the static member to bind them to.
+  const size_t pipeline_input = torch_serving::ValueReference::kPipelineInput;
+  CHECK_EQ(steps[1].inputs[2].source, pipeline_input);
+
+  MESSAGE("Tuple outputs are indexed without serializing them");
+  std::vector<torch::jit::IValue> arguments;
+  auto output = torch::jit::IValue(
+      c10::ivalue::Tuple::create({torch::ones({2}), torch::zeros({3})}));
+  torch_serving::AppendReferencedValues(steps[1].inputs[0], {}, {&output},
+                                        arguments);
+  REQUIRE_EQ(arguments.size(), 1);
+  CHECK(arguments[0].toTensor().equal(torch::zeros({3})));
+  CHECK_THROWS_AS(torch_serving::AppendReferencedValues(
+                      steps[1].inputs[1], {}, {&output}, arguments),
+                  torch_serving::PipelineError);
+
+  MESSAGE("Stages may only take the outputs of earlier stages");
+  CHECK_THROWS_AS(
+      torch_serving::ServablePipeline("cycle", json::json::parse(R"({
+        "stages": [{"name": "a", "servable_identifier": "a.pt",
+                    "inputs": ["b"]},
+                   {"name": "b", "servable_identifier": "b.pt"}]
+      })")),
+      std::invalid_argument);
+}
+
+TEST_CASE("Test frozen servables give the same results") {
+  const auto assets = LoadTestAssets();
+
+  MESSAGE("Options from the servable config reach the servable");
+  torch_serving::ServableConfig config(json::json{
+      {"servables",
+       {{assets.model,
+         {{"freeze", true}, {"warmup_input", assets.payload}}}}}});
+  torch_serving::ServableManager<torch_serving::TorchJITServable> manager(
+      1, 0, {}, config);
+  CHECK_EQ(assets.response,
+           manager.InferenceRequest(assets.model, assets.payload));
+
+  MESSAGE("Invalid options fail the load as a config error");
+  torch_serving::ServableManager<torch_serving::TorchJITServable>
+      misconfigured(1, 0, {},
+                    torch_serving::ServableConfig(json::json{
+                        {"servables",
+                         {{assets.model, {{"warmup_runs", "many"}}}}}}));
+  CHECK_THROWS_AS(misconfigured.InferenceRequest(assets.model, assets.payload),
+                  torch_serving::ServableConfigError);
+}
+
+TEST_CASE("Test dynamic int8 quantization stays close to fp32") {
+  CHECK_THROWS_AS(torch_serving::ModuleOptimizationOptions::FromJson(
+                      {{"quantize", "int4"}}),
+                  torch_serving::ServableConfigError);
+  CHECK_THROWS_AS(torch_serving::SetQuantizedEngine("mkldnn"),
+                  std::invalid_argument);
+  auto options = torch_serving::ModuleOptimizationOptions::FromJson(
+      {{"quantize", "dynamic_int8"}});
+  CHECK(options.Enabled());
+
+#if TORCH_VERSION_MAJOR > 1 || TORCH_VERSION_MINOR >= 7
+  torch::manual_seed(0);
+  torch::jit::script::Module module("Mlp");
+  module.register_parameter("hidden", torch::randn({32, 16}), false);
+  module.register_parameter("output", torch::randn({4, 32}), false);
+  module.define(R"(
+    def forward(self, x):
+        return torch.linear(torch.relu(torch.linear(x, self.hidden)),
+                            self.output)
+  )");
+  module.eval();
+  auto input = torch::randn({8, 16});
+  auto reference = module.forward({input});
+
+  torch_serving::SetQuantizedEngine();
+  torch_serving::QuantizationReport report;
+  auto quantized = torch_serving::OptimizeModule(module, options, &report);
+  CHECK_EQ(2, report.quantized_linear_layers);
+  auto difference =
+      torch_serving::CompareOutputs(reference, quantized.forward({input}));
+  MESSAGE("Quantized output: " << difference.ToString());
+  CHECK_GT(difference.max_abs_diff, 0.0);
+  CHECK_LT(difference.max_rel_diff, 0.05);
+#endif
+}
+
+TEST_CASE("Test bfloat16 servables return the requested data type") {
+  const auto assets = LoadTestAssets();
+
+  CHECK_THROWS_AS(torch_serving::StringToExecutionPrecision("fp16"),
+                  torch_serving::ServableConfigError);
+
+  MESSAGE("bfloat16 tensors are encoded as such, unless cast");
+  auto tensor = torch::ones({2}, torch::kBFloat16);
+  CHECK_EQ("bfloat16", torch_serving::TorchValueToJson(tensor)["data_type"]);
+  CHECK_EQ("float32", torch_serving::TorchValueToJson(
+                          tensor, torch::kFloat)["data_type"]);
+  CHECK_EQ(torch::kBFloat16, torch_serving::CastFloatingTensors(
+                                 torch::ones({2}), torch::kBFloat16)
+                                 .toTensor()
+                                 .scalar_type());
+
+  torch_serving::TorchJITServable fp32(assets.model);
+  torch_serving::TorchJITServable bf16(
+      assets.model, {{"precision", "bf16_weights"},
+                     {"warmup_input", assets.payload},
+                     {"max_precision_error", 1.0}});
+  CHECK(bf16.Precision() == torch_serving::ExecutionPrecision::kBf16Weights);
+  auto reference = fp32.Forward(fp32.Decode(assets.payload));
+  auto output = bf16.Forward(bf16.Decode(assets.payload));
+  auto difference = torch_serving::CompareOutputs(reference, output);
+  MESSAGE("bf16_weights output: " << difference.ToString());
+  CHECK_LT(difference.max_rel_diff, 0.05);
+  MESSAGE("Outputs are cast back to float32");
+  auto first_tensor = json::json::json_pointer("/value/out/0/0/data_type");
+  CHECK_EQ(fp32.Encode(reference)[first_tensor],
+           bf16.Encode(output)[first_tensor]);
+}
+
+TEST_CASE("Test servables run forwards without autograd") {
+  const auto assets = LoadTestAssets();
+
+  torch_serving::TorchJITServable servable(assets.model);
+  MESSAGE("Stacks are reused between forwards");
+  CHECK_EQ(assets.response, servable.RunInference(assets.payload));
+  CHECK_EQ(assets.response, servable.RunInference(assets.payload));
+
+  torch::jit::script::Module module("Projection");
+  module.register_parameter(
+      "weight", torch::randn({3, 2}, torch::requires_grad()), false);
+  module.define(R"(
+    def forward(self, x):
+        return torch.mm(x, self.weight)
+  )");
+  TempDir temp_dir;
+  const auto projection_model = temp_dir.File("projection.pt");
+  module.save(projection_model);
+  torch_serving::TorchJITServable projection(projection_model);
+  auto output =
+      projection.Forward({torch::ones({1, 3}, torch::kFloat)}).toTensor();
+  CHECK_FALSE(output.requires_grad());
+#if TORCH_VERSION_MAJOR > 1 || TORCH_VERSION_MINOR >= 9
+  CHECK(output.is_inference());
+#endif
+}
+
+TEST_CASE("Test block pool reuses blocks across requests") {
+  CHECK_EQ(64, torch_serving::BlockPool::SizeClassBytes(1));
+  CHECK_EQ(1024, torch_serving::BlockPool::SizeClassBytes(1000));
+  CHECK_EQ(1280, torch_serving::BlockPool::SizeClassBytes(1025));
+  CHECK_EQ(3 << 20, torch_serving::BlockPool::SizeClassBytes(3000000));
+
+  torch_serving::BlockPoolOptions options;
+  options.max_cached_bytes = 4 << 20;
+  torch_serving::BlockPool pool(options);
+  auto *block = pool.Allocate(1 << 20);
+  // A copy, since CHECK_EQ would ODR-use the static member.
+  const size_t alignment = torch_serving::BlockPool::kAlignment;
+  CHECK_EQ(0, reinterpret_cast<uintptr_t>(block) % alignment);
+  torch_serving::BlockPool::Free(block);
+  MESSAGE("Blocks of the same size class are reused");
+  CHECK_EQ(block, pool.Allocate((1 << 20) - 100));
+  torch_serving::BlockPool::Free(block);
+  MESSAGE("Blocks beyond the cache budget go back to the OS");
+  torch_serving::BlockPool::Free(pool.Allocate(8 << 20));
+  CHECK_EQ(1, pool.Stats()["released"]);
+}
+
+TEST_CASE("Test weights can be moved onto huge pages") {
+  const auto assets = LoadTestAssets();
+
+  CHECK_THROWS_AS(
+      torch_serving::WeightMemoryOptions::FromJson({{"huge_pages", "1gb"}}),
+      torch_serving::ServableConfigError);
+
+  torch_serving::TorchJITServable loaded(assets.model);
+  // N.B., huge pages and locking depend on the machine, so only the weights'
+  // integrity and residency are checked.
+  torch_serving::TorchJITServable placed(
+      assets.model,
+      {{"huge_pages", "transparent"}, {"prefault_weights", true}});
+  CHECK_EQ(assets.response, placed.RunInference(assets.payload));
+  auto footprint = placed.Footprint();
+  MESSAGE("Footprint: " << footprint.ToString());
+  CHECK_EQ(loaded.Footprint().bytes, footprint.bytes);
+  CHECK_EQ(footprint.bytes, footprint.resident_bytes);
+}
+
+TEST_CASE("Test shape buckets pad inputs and slice outputs") {
+  torch_serving::ShapeBuckets buckets(json::json{{"sizes", {8, 4}},
+                                                {"slice_outputs", {"[1]"}},
+                                                {"attention_mask", true}});
+  CHECK_EQ(std::vector<int64_t>{4, 8}, buckets.Sizes());
+  CHECK_EQ(8, buckets.BucketFor(5));
+  CHECK_THROWS_AS(buckets.BucketFor(9), torch_serving::TensorShapeError);
+
+  std::vector<torch::jit::IValue> inputs{torch::ones({1, 5, 2}),
+                                         torch::ones({1, 5})};
+  auto length = buckets.Pad(inputs);
+  CHECK_EQ(5, length.length);
+  CHECK_EQ(8, length.bucket);
+  REQUIRE_EQ(3, inputs.size());
+  CHECK_EQ(std::vector<int64_t>{1, 8, 2}, inputs[0].toTensor().sizes().vec());
+  MESSAGE("Only the sequence inputs are padded, whatever the others' lengths");
+  CHECK_EQ(std::vector<int64_t>{1, 5}, inputs[1].toTensor().sizes().vec());
+  MESSAGE("The mask covers the true length");
+  CHECK_EQ(5, inputs[2].toTensor().sum().item<int64_t>());
+  MESSAGE("Only the configured outputs are sliced");
+  std::vector<torch::jit::IValue> outputs{torch::zeros({1, 8}),
+                                          torch::zeros({1, 8})};
+  auto sliced =
+      buckets.Slice(c10::ivalue::Tuple::create(std::move(outputs)), length)
+          .toTuple();
+  CHECK_EQ(std::vector<int64_t>{1, 8},
+           sliced->elements()[0].toTensor().sizes().vec());
+  CHECK_EQ(std::vector<int64_t>{1, 5},
+           sliced->elements()[1].toTensor().sizes().vec());
+  CHECK_THROWS(buckets.Slice(torch::zeros({1, 8}), length));
+
+  MESSAGE("Sequence inputs must agree on their length");
+  torch_serving::ShapeBuckets pair(
+      json::json{{"sizes", {8}}, {"sequence_inputs", {0, 1}}});
+  std::vector<torch::jit::IValue> mismatched{torch::ones({1, 5}),
+                                             torch::ones({1, 6})};
+  CHECK_THROWS_AS(pair.Pad(mismatched), torch_serving::TensorShapeError);
+  std::vector<torch::jit::IValue> missing{torch::ones({1, 5})};
+  CHECK_THROWS_AS(pair.Pad(missing), torch_serving::TensorShapeError);
+  CHECK_THROWS_AS(torch_serving::ShapeBuckets(json::json{
+                      {"sizes", {8}}, {"slice_outputs", {"logits"}}}),
+                  torch_serving::ServableConfigError);
+
+  torch::jit::script::Module module("Scorer");
+  module.define(R"(
+    def forward(self, x, mask):
+        return x.sum(-1) * mask
+  )");
+  TempDir temp_dir;
+  const auto scorer_model = temp_dir.File("scorer.pt");
+  module.save(scorer_model);
+  json::json payload = {
+      {"type", "tensor"}, {"shape", {1, 3, 2}}, {"value", {1, 2, 3, 4, 5, 6}}};
+  torch_serving::TorchJITServable servable(
+      scorer_model, {{"shape_buckets", {{"sizes", {4, 8}},
+                                        {"slice_outputs", {""}},
+                                        {"attention_mask", true}}},
+                     {"warmup_input", payload}});
+  auto result = servable.RunInference(payload);
+  CHECK_EQ(json::json({1, 3}), result["shape"]);
+  CHECK_EQ(json::json({3.0, 7.0, 11.0}), result["value"]);
+}
+
+TEST_CASE("Test session store keeps state between requests") {
+  torch_serving::SessionStoreOptions options;
+  options.max_sessions = 2;
+  options.max_bytes = 64 * sizeof(float);
+  options.ttl = std::chrono::milliseconds(50);
+  torch_serving::SessionStore sessions(options);
+
+  auto id = sessions.Create("rnn.pt");
+  auto session = sessions.Take(id);
+  CHECK_EQ(session.servable_identifier, "rnn.pt");
+  CHECK(session.state.isNone());
+  CHECK_THROWS_AS(sessions.Take(id), torch_serving::SessionBusyError);
+  sessions.Return(id, torch::ones({4, 4}));
+  CHECK(sessions.Take(id).state.toTensor().equal(torch::ones({4, 4})));
+  sessions.Release(id);
+  CHECK_EQ(sessions.Stats().at("bytes").get<size_t>(), 16 * sizeof(float));
+
+  MESSAGE("Sessions past the budget are evicted least recently used first");
+  auto busy = sessions.Create("rnn.pt");
+  sessions.Take(busy);
+  auto other = sessions.Create("rnn.pt");
+  CHECK_THROWS_AS(sessions.Take(id), torch_serving::UnknownSessionError);
+  sessions.Take(other);
+  sessions.Return(other, torch::ones({48}));
+  sessions.Return(busy, torch::ones({32}));
+  CHECK_THROWS_AS(sessions.Take(other), torch_serving::UnknownSessionError);
+  CHECK_EQ(sessions.Stats().at("bytes").get<size_t>(), 32 * sizeof(float));
+
+  MESSAGE("A state larger than the whole budget is rejected");
+  sessions.Take(busy);
+  CHECK_THROWS_AS(sessions.Return(busy, torch::ones({128})),
+                  torch_serving::SessionStateError);
+  sessions.Release(busy);
+  CHECK(sessions.Take(busy).state.toTensor().equal(torch::ones({32})));
+  sessions.Release(busy);
+
+  MESSAGE("Sessions expire after the TTL, and can be deleted");
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  CHECK_EQ(sessions.Stats().at("sessions").get<size_t>(), 0);
+  CHECK_EQ(sessions.Stats().at("bytes").get<size_t>(), 0);
+  CHECK_THROWS_AS(sessions.Take(busy), torch_serving::UnknownSessionError);
+  CHECK_FALSE(sessions.Erase(busy));
+  CHECK(sessions.Erase(sessions.Create("rnn.pt")));
+
+  MESSAGE("Session IDs are 128 random bits");
+  auto first = sessions.Create("rnn.pt");
+  CHECK_EQ(first.size(), 32);
+  CHECK_NE(first, sessions.Create("rnn.pt"));
+}
+
+TEST_CASE("Test static runtime servable matches the interpreter") {
+  const auto assets = LoadTestAssets();
+
+  // N.B., models Static Runtime can't run fall back to the interpreter, so
+  // this holds either way.
+  torch_serving::TorchStaticServable servable(assets.model);
+  MESSAGE("Static Runtime in use: " << servable.UsesStaticRuntime());
+  CHECK_EQ(assets.response, servable.RunInference(assets.payload));
+  MESSAGE("Runtimes are reused between forwards");
+  CHECK_EQ(assets.response, servable.RunInference(assets.payload));
+}
+
+#ifdef TORCH_SERVING_HAS_LITE_INTERPRETER
+TEST_CASE("Test lite interpreter servable matches the interpreter") {
+  const auto assets = LoadTestAssets();
+
+  TempDir temp_dir;
+  const auto lite_model = temp_dir.File("test-servable.ptl");
+  torch::jit::load(assets.model)._save_for_mobile(lite_model);
+  torch_serving::ServableManager<torch_serving::TorchLiteServable> manager;
+  CHECK_EQ(assets.response,
+           manager.InferenceRequest(lite_model, assets.payload));
 }
+#endif